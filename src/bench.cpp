@@ -0,0 +1,688 @@
+#include "bench.h"
+#include "convert.h"
+#include "memory.h"
+#include "system.h"
+#include "synthwad.h"
+#include "wad.h"
+#include "map.h"
+#include "renderer.h"
+#include "jobs.h"
+
+#include "string.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+
+static f64 ticksToMilliseconds(u64 ticks) {
+	return (f64)ticks * 1000.0 / (f64)getPerformanceFrequency();
+}
+
+
+const i32 BENCH_RUNS = 10;
+
+struct ConversionOutput {
+	Vertex* vertexes;
+	Node*   nodes;
+	Seg*    segs;
+	f64     times[3];
+};
+
+
+void runConversionBenchmark(usize numSegs) {
+	usize numVertexes = numSegs / 2 + 1;
+	usize numNodes = numSegs / 4 + 1;
+
+	Random random = { 0x1234567 };
+
+	auto mapVertexes = arenaPush<MapVertex>(temporary, numVertexes);
+	auto mapNodes = arenaPush<MapNode>(temporary, numNodes);
+
+	for (usize i = 0; i < numVertexes; ++i) {
+		mapVertexes[i].x = (i16)nextRandom(random);
+		mapVertexes[i].y = (i16)nextRandom(random);
+	}
+
+	for (usize i = 0; i < numNodes; ++i) {
+		auto fields = (i16*)(mapNodes + i);
+
+		for (usize f = 0; f < sizeof(MapNode) / sizeof(i16); ++f) {
+			fields[f] = (i16)nextRandom(random);
+		}
+	}
+
+	SimdLevel detected = detectSimdLevel();
+	i32 numLevels = (i32)detected + 1;
+
+	ConversionOutput outputs[3] = {};
+
+	logMessage("Conversion benchmark: %i segs, %i vertexes, %i nodes, best of %i runs", numSegs, numVertexes, numNodes, BENCH_RUNS);
+
+	for (i32 l = 0; l < numLevels; ++l) {
+		auto& output = outputs[l];
+
+		output.vertexes = arenaPush<Vertex>(temporary, numVertexes, MAP_SLICE_ALIGNMENT);
+		output.nodes = arenaPush<Node>(temporary, numNodes, MAP_SLICE_ALIGNMENT);
+		output.segs = arenaPush<Seg>(temporary, numSegs, MAP_SLICE_ALIGNMENT);
+
+		Random segRandom = { 0x7654321 };
+
+		for (usize i = 0; i < numSegs; ++i) {
+			output.segs[i] = {};
+			output.segs[i].v1 = nextRandom(segRandom) % numVertexes;
+			output.segs[i].v2 = nextRandom(segRandom) % numVertexes;
+		}
+
+		setSimdLevel((SimdLevel)l);
+
+		for (i32 k = 0; k < 3; ++k) output.times[k] = 1e30;
+
+		for (i32 run = 0; run < BENCH_RUNS; ++run) {
+			u64 start = getPerformanceCounter();
+			convertVertexes(output.vertexes, mapVertexes, numVertexes);
+			u64 vertexesDone = getPerformanceCounter();
+			convertNodes(output.nodes, mapNodes, numNodes);
+			u64 nodesDone = getPerformanceCounter();
+			computeSegLengths(output.segs, numSegs, output.vertexes);
+			u64 segsDone = getPerformanceCounter();
+
+			f64 times[3] = {
+				ticksToMilliseconds(vertexesDone - start),
+				ticksToMilliseconds(nodesDone - vertexesDone),
+				ticksToMilliseconds(segsDone - nodesDone)
+			};
+
+			for (i32 k = 0; k < 3; ++k) {
+				if (times[k] < output.times[k]) output.times[k] = times[k];
+			}
+		}
+	}
+
+	setSimdLevel(detected);
+
+	static const char* kernelNames[3] = { "vertexes", "nodes", "seg lengths" };
+
+	for (i32 l = 0; l < numLevels; ++l) {
+		auto& output = outputs[l];
+
+		bool matches = memcmp(output.vertexes, outputs[0].vertexes, sizeof(Vertex) * numVertexes) == 0
+			&& memcmp(output.nodes, outputs[0].nodes, sizeof(Node) * numNodes) == 0;
+
+		for (usize i = 0; i < numSegs && matches; ++i) {
+			matches = output.segs[i].length == outputs[0].segs[i].length;
+		}
+
+		for (i32 k = 0; k < 3; ++k) {
+			logMessage("\t%-6s %-12s %8.3f ms  %5.2fx", simdLevelName((SimdLevel)l), kernelNames[k], output.times[k], outputs[0].times[k] / output.times[k]);
+		}
+
+		if (!matches) {
+			logError("%s results do not match the scalar kernels!", simdLevelName((SimdLevel)l));
+		}
+	}
+
+	resetArena(temporary);
+}
+
+
+// Synthetic wads for the suite are built at every size with every layout
+// and tree shape
+static const u32 defaultSuiteSizes[] = { 1000, 10000, 100000, 500000 };
+static const SynthLayout suiteLayouts[] = { SynthLayout::Grid, SynthLayout::Polygons };
+static const SynthTree suiteTrees[] = { SynthTree::Balanced, SynthTree::Unbalanced };
+
+// Relative to fitting the selected node on screen
+static const f32 suiteZooms[] = { 1.0f, 4.0f, 16.0f };
+
+// A mix of map lumps, filler lumps and a name no wad has
+static const char* suiteLookupNames[] = { "MAP01", "THINGS", "BLOCKMAP", "SYN00000", "SYN01023", "SYN02047", "PLAYPAL" };
+const i32 NUM_LOOKUP_NAMES = sizeof(suiteLookupNames) / sizeof(suiteLookupNames[0]);
+
+const u32 SUITE_SEED = 0x2545F491;
+const u32 SUITE_FILLER_LUMPS = 2048;
+const i32 SUITE_LOOKUPS = 4096;
+const i32 SUITE_VIEWS = 256;
+const i32 SUITE_WIDTH = 1920;
+const i32 SUITE_HEIGHT = 1080;
+
+const i32 MAX_SUITE_RUNS = 100;
+const i32 MAX_SUITE_CASES = 256;
+const i32 MAX_SUITE_TIMINGS = 4096;
+
+// Timings shorter than this are mostly noise, so are never called a
+// regression however much they change
+const f64 SUITE_NOISE_MS = 0.05;
+
+struct SuiteOptions {
+	const char* outputDir;
+	const char* baselineFile;
+	f64         tolerance;
+	i32         runs;
+	Slice<u32>  sizes;
+};
+
+struct SuiteCase {
+	char          name[64];
+	SynthWadSpec  spec;
+	SynthWadStats stats;
+};
+
+struct SuiteTiming {
+	char name[64];
+	i32  caseIndex;
+	f64  best;
+	f64  median;
+	f64  baseline;
+	bool regressed;
+};
+
+struct BaselineTiming {
+	char caseName[64];
+	char name[64];
+	f64  best;
+};
+
+struct Suite {
+	SuiteOptions*   options;
+	MemoryArena*    arena;
+	SuiteCase*      cases;
+	i32             numCases;
+	SuiteTiming*    timings;
+	i32             numTimings;
+	BaselineTiming* baseline;
+	i32             numBaseline;
+	DrawContext     drawContext;
+	i32             failed;
+};
+
+struct RunTimes {
+	f64 ms[MAX_SUITE_RUNS];
+	i32 count;
+};
+
+// Results of lookups and views go here so they can't be optimised away
+static volatile f64 benchSink;
+
+
+static void addRun(RunTimes& runs, u64 start, u64 end) {
+	if (runs.count < MAX_SUITE_RUNS) runs.ms[runs.count++] = ticksToMilliseconds(end - start);
+}
+
+
+static void addTiming(Suite& suite, const char* name, RunTimes& runs) {
+	if (suite.numTimings == MAX_SUITE_TIMINGS || runs.count == 0) return;
+
+	// Insertion sort, there are only a handful of runs
+	for (i32 i = 1; i < runs.count; ++i) {
+		f64 ms = runs.ms[i];
+		i32 j = i;
+
+		for (; j > 0 && runs.ms[j - 1] > ms; --j) runs.ms[j] = runs.ms[j - 1];
+
+		runs.ms[j] = ms;
+	}
+
+	SuiteTiming& timing = suite.timings[suite.numTimings++];
+	timing = {};
+	snprintf(timing.name, sizeof(timing.name), "%s", name);
+	timing.caseIndex = suite.numCases - 1;
+	timing.best = runs.ms[0];
+	timing.median = runs.count & 1 ? runs.ms[runs.count / 2] : (runs.ms[runs.count / 2 - 1] + runs.ms[runs.count / 2]) * 0.5;
+	timing.baseline = -1.0;
+}
+
+
+// Loads the wad and its map from scratch on every run, so each run pays for
+// the same work. The first run is a warm up and also writes the wad's map
+// index, so later catalogs come from the index.
+static Map* timeLoading(Suite& suite, const char* wadName, MemoryArena** mapArena) {
+	i32 numRuns = suite.options->runs;
+	ArenaMarker permanentMark = saveArena(permanent);
+
+	RunTimes loadWad = {}, catalog = {}, lookups = {}, mapLoad = {};
+	Map* map = 0;
+
+	for (i32 run = 0; run <= numRuns; ++run) {
+		unloadWads();
+		restoreArena(permanentMark);
+
+		u64 start = getPerformanceCounter();
+		WadResult wad = loadWadFile(wadName);
+		u64 wadLoaded = getPerformanceCounter();
+
+		if (wad != WadResult::Success) return 0;
+
+		Array<MapEntry> maps = findMapLumps();
+		u64 catalogued = getPerformanceCounter();
+
+		LumpNum found = 0;
+
+		for (i32 i = 0; i < SUITE_LOOKUPS; ++i) {
+			found += findLumpByName(suiteLookupNames[i % NUM_LOOKUP_NAMES]);
+		}
+
+		u64 looked = getPerformanceCounter();
+		benchSink = benchSink + found;
+
+		if (maps.length != 1) return 0;
+
+		if (!*mapArena) *mapArena = createArena(mapMemoryRequired(maps.data[0]) + KILOBYTES(4), "benchmark map");
+		resetArena(*mapArena);
+
+		u64 mapStart = getPerformanceCounter();
+		MapLoad load = loadMap(maps.data[0], *mapArena);
+		u64 mapLoaded = getPerformanceCounter();
+
+		if (load.result != MapResult::Success) return 0;
+
+		map = load.map;
+
+		if (run == 0) continue;
+
+		addRun(loadWad, start, wadLoaded);
+		addRun(catalog, wadLoaded, catalogued);
+		addRun(lookups, catalogued, looked);
+		addRun(mapLoad, mapStart, mapLoaded);
+	}
+
+	addTiming(suite, "loadWadFile", loadWad);
+	addTiming(suite, "findMapLumps", catalog);
+	addTiming(suite, "findLumpByName x4096", lookups);
+	addTiming(suite, "loadMap", mapLoad);
+
+	return map;
+}
+
+
+static void timeViews(Suite& suite, Map* map) {
+	RunTimes views = {};
+
+	for (i32 run = 0; run <= suite.options->runs; ++run) {
+		f32 total = 0.0f;
+
+		u64 start = getPerformanceCounter();
+
+		for (i32 i = 0; i < SUITE_VIEWS; ++i) {
+			i32 node = (i32)(((usize)i * map->nodes.length) / SUITE_VIEWS);
+			total += calculateView(map, suite.drawContext, node).zoom;
+		}
+
+		u64 end = getPerformanceCounter();
+		benchSink = benchSink + total;
+
+		if (run > 0) addRun(views, start, end);
+	}
+
+	addTiming(suite, "calculateView x256", views);
+}
+
+
+// Renders the root, a leaf's parent and the node halfway between them, found
+// by following front children down from the root
+static void timeRendering(Suite& suite, Map* map) {
+	i32 root = (i32)map->nodes.length - 1;
+	i32 leaf = root;
+	i32 depth = 0;
+
+	while (!(map->nodes[leaf].children[0] & SubsectorChildFlag)) {
+		leaf = map->nodes[leaf].children[0];
+		depth++;
+	}
+
+	i32 middle = root;
+
+	for (i32 i = 0; i < depth / 2; ++i) middle = map->nodes[middle].children[0];
+
+	const i32 selections[3] = { root, middle, leaf };
+	static const char* selectionNames[3] = { "root", "middle", "leaf" };
+
+	DrawContext& context = suite.drawContext;
+
+	for (i32 s = 0; s < 3; ++s) {
+		for (f32 zoom : suiteZooms) {
+			RenderState state = { selections[s], 0 };
+			View view = calculateView(map, context, selections[s]);
+
+			view.zoom *= zoom;
+			view.offset *= zoom;
+
+			RunTimes frames = {};
+
+			for (i32 run = 0; run <= suite.options->runs; ++run) {
+				u64 start = getPerformanceCounter();
+				renderMap(map, view, context, state);
+				u64 end = getPerformanceCounter();
+
+				resetArena(temporary);
+
+				if (run > 0) addRun(frames, start, end);
+			}
+
+			char name[64];
+			snprintf(name, sizeof(name), "renderMap %s x%g", selectionNames[s], zoom);
+			addTiming(suite, name, frames);
+		}
+	}
+}
+
+
+// Each case's map depends only on what the case is, so adding or removing
+// sizes doesn't change the maps the other cases measure
+static u32 suiteCaseSeed(const SynthWadSpec& spec) {
+	u32 hash = SUITE_SEED;
+	u32 parts[] = { (u32)spec.layout, (u32)spec.tree, spec.targetSegs };
+
+	for (u32 part : parts) {
+		hash = (hash ^ part) * 0x01000193;
+		hash ^= hash >> 15;
+	}
+
+	return hash;
+}
+
+
+static void runSuiteCase(Suite& suite, const SynthWadSpec& spec) {
+	if (suite.numCases == MAX_SUITE_CASES) return;
+
+	SuiteCase& suiteCase = suite.cases[suite.numCases++];
+	suiteCase = {};
+	suiteCase.spec = spec;
+	snprintf(suiteCase.name, sizeof(suiteCase.name), "%s-%s-%u", synthLayoutName(spec.layout), synthTreeName(spec.tree), spec.targetSegs);
+
+	char wadName[1024];
+	snprintf(wadName, sizeof(wadName), "%s/synth-%s.wad", suite.options->outputDir, suiteCase.name);
+
+	if (!writeSynthWad(wadName, spec, &suiteCase.stats)) {
+		logError("Failed to generate %s", wadName);
+		suite.failed++;
+		return;
+	}
+
+	auto& stats = suiteCase.stats;
+	logMessage("%s: %u segs, %u nodes, %u deep, %s nodes", suiteCase.name, stats.segs, stats.nodes, stats.depth, stats.extendedNodes ? "XNOD" : "vanilla");
+
+	// Keeps every map load from logging its lump counts
+	setLogLevel(LogLevel::Warning);
+
+	ArenaMarker permanentMark = saveArena(permanent);
+	MemoryArena* mapArena = 0;
+	Map* map = timeLoading(suite, wadName, &mapArena);
+
+	if (map) {
+		timeViews(suite, map);
+		timeRendering(suite, map);
+	}
+
+	setLogLevel(LogLevel::Info);
+
+	if (!map) {
+		logError("Failed to load %s", wadName);
+		suite.failed++;
+	}
+
+	unloadWads();
+	restoreArena(permanentMark);
+	if (mapArena) destroyArena(mapArena);
+}
+
+
+static bool parseSizes(const char* text, SuiteOptions* options) {
+	i32 count = 1;
+	for (const char* c = text; *c; ++c) {
+		if (*c == ',') count++;
+	}
+
+	options->sizes.data = arenaPush<u32>(permanent, count);
+	options->sizes.length = 0;
+
+	const char* c = text;
+
+	while (*c) {
+		char* end;
+		long size = strtol(c, &end, 10);
+
+		if (end == c || size <= 0) return false;
+
+		options->sizes.data[options->sizes.length++] = (u32)size;
+
+		c = *end == ',' ? end + 1 : end;
+		if (*end && *end != ',') return false;
+	}
+
+	return options->sizes.length > 0;
+}
+
+
+static bool parseSuiteOptions(i32 argc, char** argv, SuiteOptions* options) {
+	*options = {};
+	options->tolerance = 0.1;
+	options->runs = 5;
+	options->sizes = { sizeof(defaultSuiteSizes) / sizeof(defaultSuiteSizes[0]), (u32*)defaultSuiteSizes };
+
+	if (argc < 1) return false;
+
+	options->outputDir = argv[0];
+
+	for (i32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+			options->baselineFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+			options->tolerance = atof(argv[++i]) / 100.0;
+			if (options->tolerance < 0.0) return false;
+		}
+		else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+			options->runs = atoi(argv[++i]);
+			if (options->runs < 1 || options->runs > MAX_SUITE_RUNS) return false;
+		}
+		else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+			if (!parseSizes(argv[++i], options)) return false;
+		}
+		else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+// Copies the quoted string after key on the line, false if it isn't there
+static bool readJsonString(const char* line, const char* key, char* dest, usize size) {
+	const char* start = strstr(line, key);
+	if (!start) return false;
+
+	start += strlen(key);
+	const char* end = strchr(start, '"');
+	if (!end || (usize)(end - start) >= size) return false;
+
+	memcpy(dest, start, end - start);
+	dest[end - start] = 0;
+
+	return true;
+}
+
+
+// Only reads back what writeSuiteResults writes, one timing per line
+static bool readBaseline(Suite& suite, const char* fileName) {
+	FILE* f;
+	if (fopen_s(&f, fileName, "rb") != 0) return false;
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	char* text = arenaPush<char>(suite.arena, size + 1);
+	bool success = size >= 0 && fread(text, 1, size, f) == (usize)size;
+
+	fclose(f);
+
+	if (!success) return false;
+
+	text[size] = 0;
+
+	suite.baseline = arenaPush<BaselineTiming>(suite.arena, MAX_SUITE_TIMINGS);
+	suite.numBaseline = 0;
+
+	for (char* line = text; line && *line && suite.numBaseline < MAX_SUITE_TIMINGS; ) {
+		char* next = strchr(line, '\n');
+		if (next) *next++ = 0;
+
+		BaselineTiming& timing = suite.baseline[suite.numBaseline];
+		const char* best = strstr(line, "\"best_ms\": ");
+
+		if (best
+			&& readJsonString(line, "\"case\": \"", timing.caseName, sizeof(timing.caseName))
+			&& readJsonString(line, "\"name\": \"", timing.name, sizeof(timing.name))) {
+			timing.best = atof(best + strlen("\"best_ms\": "));
+			suite.numBaseline++;
+		}
+
+		line = next;
+	}
+
+	return true;
+}
+
+
+static i32 compareWithBaseline(Suite& suite) {
+	i32 regressions = 0;
+	f64 tolerance = suite.options->tolerance;
+
+	for (i32 i = 0; i < suite.numTimings; ++i) {
+		SuiteTiming& timing = suite.timings[i];
+		const char* caseName = suite.cases[timing.caseIndex].name;
+
+		for (i32 b = 0; b < suite.numBaseline; ++b) {
+			BaselineTiming& baseline = suite.baseline[b];
+
+			if (strcmp(baseline.caseName, caseName) != 0 || strcmp(baseline.name, timing.name) != 0) continue;
+
+			timing.baseline = baseline.best;
+			timing.regressed = timing.best > baseline.best * (1.0 + tolerance) && timing.best - baseline.best > SUITE_NOISE_MS;
+
+			if (timing.regressed) {
+				logWarning("%s %s regressed by %.1f%%, %.3f ms against %.3f ms", caseName, timing.name, (timing.best / baseline.best - 1.0) * 100.0, timing.best, baseline.best);
+				regressions++;
+			}
+
+			break;
+		}
+	}
+
+	return regressions;
+}
+
+
+static bool writeSuiteResults(Suite& suite, const char* fileName, i32 regressions) {
+	FILE* f;
+	if (fopen_s(&f, fileName, "wb") != 0) return false;
+
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"workers\": %d,\n", getNumWorkers());
+	fprintf(f, "\t\"simd\": \"%s\",\n", simdLevelName(getSimdLevel()));
+	fprintf(f, "\t\"width\": %d,\n", SUITE_WIDTH);
+	fprintf(f, "\t\"height\": %d,\n", SUITE_HEIGHT);
+	fprintf(f, "\t\"runs\": %d,\n", suite.options->runs);
+	fprintf(f, "\t\"baseline\": \"%s\",\n", suite.options->baselineFile ? suite.options->baselineFile : "");
+	fprintf(f, "\t\"tolerance\": %.3f,\n", suite.options->tolerance);
+	fprintf(f, "\t\"cases\": [\n");
+
+	for (i32 i = 0; i < suite.numCases; ++i) {
+		SuiteCase& suiteCase = suite.cases[i];
+		SynthWadStats& stats = suiteCase.stats;
+
+		fprintf(f, "\t\t{\"case\": \"%s\", \"layout\": \"%s\", \"tree\": \"%s\", \"segs\": %u, \"subsectors\": %u, \"nodes\": %u, \"lines\": %u, \"vertexes\": %u, \"depth\": %u, \"nodeFormat\": \"%s\"}%s\n",
+			suiteCase.name, synthLayoutName(suiteCase.spec.layout), synthTreeName(suiteCase.spec.tree),
+			stats.segs, stats.subsectors, stats.nodes, stats.lines, stats.vertexes, stats.depth,
+			stats.extendedNodes ? "XNOD" : "vanilla", i + 1 < suite.numCases ? "," : "");
+	}
+
+	fprintf(f, "\t],\n");
+	fprintf(f, "\t\"timings\": [\n");
+
+	for (i32 i = 0; i < suite.numTimings; ++i) {
+		SuiteTiming& timing = suite.timings[i];
+
+		fprintf(f, "\t\t{\"case\": \"%s\", \"name\": \"%s\", \"best_ms\": %.6f, \"median_ms\": %.6f",
+			suite.cases[timing.caseIndex].name, timing.name, timing.best, timing.median);
+
+		if (timing.baseline >= 0.0) {
+			fprintf(f, ", \"baseline_ms\": %.6f, \"change\": %.4f, \"regressed\": %s",
+				timing.baseline, timing.baseline > 0.0 ? timing.best / timing.baseline - 1.0 : 0.0, timing.regressed ? "true" : "false");
+		}
+
+		fprintf(f, "}%s\n", i + 1 < suite.numTimings ? "," : "");
+	}
+
+	fprintf(f, "\t],\n");
+	fprintf(f, "\t\"failed\": %d,\n", suite.failed);
+	fprintf(f, "\t\"regressions\": %d\n", regressions);
+	fprintf(f, "}\n");
+
+	return fclose(f) == 0;
+}
+
+
+i32 runBenchmarkSuite(i32 argc, char** argv) {
+	SuiteOptions options;
+
+	if (!parseSuiteOptions(argc, argv, &options)) {
+		logMessage("Usage: --bench <output dir> [--baseline <json>] [--tolerance <percent>] [--runs <n>] [--sizes <segs,segs,...>]");
+		return 1;
+	}
+
+	Suite suite = {};
+	suite.options = &options;
+	suite.arena = createArena(MEGABYTES(64), "benchmark");
+	suite.cases = arenaPush<SuiteCase>(suite.arena, MAX_SUITE_CASES);
+	suite.timings = arenaPush<SuiteTiming>(suite.arena, MAX_SUITE_TIMINGS);
+
+	if (options.baselineFile && !readBaseline(suite, options.baselineFile)) {
+		logError("Failed to read baseline %s", options.baselineFile);
+		return 1;
+	}
+
+	DrawContext& context = suite.drawContext;
+	context.w = SUITE_WIDTH;
+	context.h = SUITE_HEIGHT;
+	context.xcenter = SUITE_WIDTH / 2;
+	context.ycenter = SUITE_HEIGHT / 2;
+	context.bytesPerPixel = 4;
+	context.pitch = SUITE_WIDTH * 4;
+	context.pixels = arenaPush<u8>(suite.arena, (usize)SUITE_WIDTH * SUITE_HEIGHT * 4, 64);
+	context.format = PixelFormat::BGRA32;
+	context.clip = fullClipRect(context);
+	context.backend = RenderBackend::Tiled;
+	context.scratch = temporary;
+
+	logMessage("Benchmark suite: best of %i runs on %i workers", options.runs, getNumWorkers());
+
+	for (usize s = 0; s < options.sizes.length; ++s) {
+		for (SynthLayout layout : suiteLayouts) {
+			for (SynthTree tree : suiteTrees) {
+				SynthWadSpec spec = { layout, tree, options.sizes.data[s], 0, SUITE_FILLER_LUMPS };
+				spec.seed = suiteCaseSeed(spec);
+
+				runSuiteCase(suite, spec);
+			}
+		}
+	}
+
+	i32 regressions = compareWithBaseline(suite);
+
+	char fileName[1024];
+	snprintf(fileName, sizeof(fileName), "%s/bench.json", options.outputDir);
+
+	if (!writeSuiteResults(suite, fileName, regressions)) {
+		logError("Failed to write %s", fileName);
+		return 1;
+	}
+
+	logMessage("Wrote %i timings to %s", suite.numTimings, fileName);
+
+	if (options.baselineFile) {
+		logMessage("%i regressions against %s, %.0f%% tolerance", regressions, options.baselineFile, options.tolerance * 100.0);
+	}
+
+	return suite.failed || regressions ? 1 : 0;
+}
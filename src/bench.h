@@ -0,0 +1,13 @@
+#pragma once
+
+#include "types.h"
+
+// Times the map lump conversion kernels at every simd level the cpu supports
+// on synthetic data and checks they all agree with the scalar versions
+void runConversionBenchmark(usize numSegs);
+
+// Generates synthetic wads of several sizes, layouts and tree shapes into the
+// output directory and times loading and drawing each one. Results go to
+// bench.json there, compared against an earlier run's if a baseline is given.
+// Takes the suite's options and returns the process exit code.
+i32 runBenchmarkSuite(i32 argc, char** argv);
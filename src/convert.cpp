@@ -0,0 +1,431 @@
+#include "convert.h"
+
+#include "math.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define CONVERT_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC lets any function use any instruction set, gcc and clang need to be
+// told per function
+#if defined(CONVERT_X86) && defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+
+static inline i32 convertChild(u16 child) {
+	if (child & MapSubsectorChildFlag) return (child & ~MapSubsectorChildFlag) | SubsectorChildFlag;
+
+	return child;
+}
+
+
+static void convertVertexesScalar(Vertex* dest, const MapVertex* src, usize count) {
+	for (usize i = 0; i < count; ++i) {
+		dest[i].x = src[i].x;
+		dest[i].y = src[i].y;
+	}
+}
+
+
+static void convertNodesScalar(Node* dest, const MapNode* src, usize count) {
+	for (usize i = 0; i < count; ++i) {
+		const MapNode* mn = src + i;
+		Node*          n = dest + i;
+
+		n->x = (f32)mn->x;
+		n->y = (f32)mn->y;
+		n->dx = (f32)mn->dx;
+		n->dy = (f32)mn->dy;
+
+		for (int j = 0; j < 2; ++j) {
+			n->children[j] = convertChild(mn->children[j]);
+
+			for (int k = 0; k < 4; ++k) {
+				n->bbox[j][k] = (f32)mn->bbox[j][k];
+			}
+		}
+	}
+}
+
+
+static void computeSegLengthsScalar(Seg* segs, usize count, const Vertex* vertexes) {
+	for (usize i = 0; i < count; ++i) {
+		const Vertex* v1 = vertexes + segs[i].v1;
+		const Vertex* v2 = vertexes + segs[i].v2;
+
+		f32 dx = (v2->x - v1->x);
+		f32 dy = (v2->y - v1->y);
+
+		segs[i].length = sqrtf(dx * dx + dy * dy);
+	}
+}
+
+
+static inline u8 computeOutcode(f32 x, f32 y, const ScreenTransform& transform) {
+	u8 result = 0;
+
+	if (x < transform.clipx1) result |= OutcodeLeft;
+	if (x >= transform.clipx2) result |= OutcodeRight;
+	if (y < transform.clipy1) result |= OutcodeAbove;
+	if (y >= transform.clipy2) result |= OutcodeBelow;
+
+	return result;
+}
+
+
+static void transformVertexesScalar(ScreenVertex* dest, u8* outcodes, const Vertex* src, usize count, const ScreenTransform& transform) {
+	for (usize i = 0; i < count; ++i) {
+		dest[i].x = transform.xoffset + (src[i].x * transform.zoom);
+		dest[i].y = transform.yoffset - (src[i].y * transform.zoom);
+
+		if (outcodes) outcodes[i] = computeOutcode(dest[i].x, dest[i].y, transform);
+	}
+}
+
+
+#ifdef CONVERT_X86
+
+// A vertex is just a pair of i16s, so the whole lump converts as one flat
+// array of i16 to f32
+static void convertVertexesSSE2(Vertex* dest, const MapVertex* src, usize count) {
+	const i16* in = (const i16*)src;
+	f32* out = (f32*)dest;
+	usize values = count * 2;
+	usize i = 0;
+
+	for (; i + 8 <= values; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+
+		// Sign extend by unpacking into the top half and shifting back down
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+
+		_mm_storeu_ps(out + i, _mm_cvtepi32_ps(lo));
+		_mm_storeu_ps(out + i + 4, _mm_cvtepi32_ps(hi));
+	}
+
+	for (; i < values; ++i) {
+		out[i] = in[i];
+	}
+}
+
+
+// The first twelve fields of a node (the partition line and both bounding
+// boxes) sit next to each other in both layouts
+static void convertNodesSSE2(Node* dest, const MapNode* src, usize count) {
+	for (usize i = 0; i < count; ++i) {
+		const MapNode* mn = src + i;
+		Node*          n = dest + i;
+
+		__m128i first = _mm_loadu_si128((const __m128i*)&mn->x);
+		__m128i last = _mm_loadl_epi64((const __m128i*)mn->bbox[1]);
+
+		_mm_storeu_ps(&n->x, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(first, first), 16)));
+		_mm_storeu_ps(n->bbox[0], _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(first, first), 16)));
+		_mm_storeu_ps(n->bbox[1], _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(last, last), 16)));
+
+		n->children[0] = convertChild(mn->children[0]);
+		n->children[1] = convertChild(mn->children[1]);
+	}
+}
+
+
+static inline __m128 loadVertexPair(const Vertex* vertexes, i32 a, i32 b) {
+	return _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(vertexes + a)), (const __m64*)(vertexes + b));
+}
+
+
+// Each vertex is loaded as an (x, y) pair, two segs share a register, then
+// the pairs are shuffled apart so the squares and roots run four wide
+static void computeSegLengthsSSE2(Seg* segs, usize count, const Vertex* vertexes) {
+	usize i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		const Seg* s = segs + i;
+
+		__m128 a1 = loadVertexPair(vertexes, s[0].v1, s[1].v1);
+		__m128 a2 = loadVertexPair(vertexes, s[0].v2, s[1].v2);
+		__m128 b1 = loadVertexPair(vertexes, s[2].v1, s[3].v1);
+		__m128 b2 = loadVertexPair(vertexes, s[2].v2, s[3].v2);
+
+		__m128 a = _mm_sub_ps(a2, a1);
+		__m128 b = _mm_sub_ps(b2, b1);
+
+		__m128 dx = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 dy = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+		alignas(16) f32 length[4];
+		_mm_store_ps(length, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy))));
+
+		for (int j = 0; j < 4; ++j) {
+			segs[i + j].length = length[j];
+		}
+	}
+
+	computeSegLengthsScalar(segs + i, count - i, vertexes);
+}
+
+
+TARGET_AVX2
+static void convertVertexesAVX2(Vertex* dest, const MapVertex* src, usize count) {
+	const i16* in = (const i16*)src;
+	f32* out = (f32*)dest;
+	usize values = count * 2;
+	usize i = 0;
+
+	for (; i + 16 <= values; i += 16) {
+		__m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i)));
+		__m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i + 8)));
+
+		_mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(lo));
+		_mm256_storeu_ps(out + i + 8, _mm256_cvtepi32_ps(hi));
+	}
+
+	for (; i < values; ++i) {
+		out[i] = in[i];
+	}
+}
+
+
+TARGET_AVX2
+static void convertNodesAVX2(Node* dest, const MapNode* src, usize count) {
+	for (usize i = 0; i < count; ++i) {
+		const MapNode* mn = src + i;
+		Node*          n = dest + i;
+
+		__m256i first = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)&mn->x));
+		__m128i last = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i*)mn->bbox[1]));
+
+		_mm256_storeu_ps(&n->x, _mm256_cvtepi32_ps(first));
+		_mm_storeu_ps(n->bbox[1], _mm_cvtepi32_ps(last));
+
+		n->children[0] = convertChild(mn->children[0]);
+		n->children[1] = convertChild(mn->children[1]);
+	}
+}
+
+
+// Same pairing as the SSE2 version with each 128 bit lane handling four segs.
+// Hardware gathers turned out slower than the pair loads.
+TARGET_AVX2
+static void computeSegLengthsAVX2(Seg* segs, usize count, const Vertex* vertexes) {
+	usize i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		const Seg* s = segs + i;
+
+		__m256 a1 = _mm256_insertf128_ps(_mm256_castps128_ps256(loadVertexPair(vertexes, s[0].v1, s[1].v1)), loadVertexPair(vertexes, s[4].v1, s[5].v1), 1);
+		__m256 a2 = _mm256_insertf128_ps(_mm256_castps128_ps256(loadVertexPair(vertexes, s[0].v2, s[1].v2)), loadVertexPair(vertexes, s[4].v2, s[5].v2), 1);
+		__m256 b1 = _mm256_insertf128_ps(_mm256_castps128_ps256(loadVertexPair(vertexes, s[2].v1, s[3].v1)), loadVertexPair(vertexes, s[6].v1, s[7].v1), 1);
+		__m256 b2 = _mm256_insertf128_ps(_mm256_castps128_ps256(loadVertexPair(vertexes, s[2].v2, s[3].v2)), loadVertexPair(vertexes, s[6].v2, s[7].v2), 1);
+
+		__m256 a = _mm256_sub_ps(a2, a1);
+		__m256 b = _mm256_sub_ps(b2, b1);
+
+		__m256 dx = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		__m256 dy = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+		// Kept as separate multiplies and adds rather than fma so the results
+		// match the scalar path exactly
+		alignas(32) f32 length[8];
+		_mm256_store_ps(length, _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy))));
+
+		for (int j = 0; j < 8; ++j) {
+			segs[i + j].length = length[j];
+		}
+	}
+
+	computeSegLengthsScalar(segs + i, count - i, vertexes);
+}
+
+// Vertexes stay interleaved, x and y lanes just use their own offset and
+// scale. y is negated through the scale, which is exact, so the results are
+// bit identical to the scalar subtract.
+static void transformVertexesSSE2(ScreenVertex* dest, u8* outcodes, const Vertex* src, usize count, const ScreenTransform& transform) {
+	const f32* in = (const f32*)src;
+	f32* out = (f32*)dest;
+
+	__m128 offset = _mm_setr_ps(transform.xoffset, transform.yoffset, transform.xoffset, transform.yoffset);
+	__m128 scale = _mm_setr_ps(transform.zoom, -transform.zoom, transform.zoom, -transform.zoom);
+
+	__m128 lower = _mm_setr_ps(transform.clipx1, transform.clipy1, transform.clipx1, transform.clipy1);
+	__m128 upper = _mm_setr_ps(transform.clipx2, transform.clipy2, transform.clipx2, transform.clipy2);
+	__m128i lowerBits = _mm_setr_epi32(OutcodeLeft, OutcodeAbove, OutcodeLeft, OutcodeAbove);
+	__m128i upperBits = _mm_setr_epi32(OutcodeRight, OutcodeBelow, OutcodeRight, OutcodeBelow);
+
+	usize i = 0;
+
+	for (; i + 2 <= count; i += 2) {
+		__m128 v = _mm_loadu_ps(in + i * 2);
+		__m128 p = _mm_add_ps(offset, _mm_mul_ps(v, scale));
+
+		_mm_storeu_ps(out + i * 2, p);
+
+		if (outcodes) {
+			__m128i bits = _mm_or_si128(
+				_mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(p, lower)), lowerBits),
+				_mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(p, upper)), upperBits)
+			);
+
+			// Fold each vertex's y bits into its x lane
+			bits = _mm_or_si128(bits, _mm_srli_epi64(bits, 32));
+
+			outcodes[i] = (u8)_mm_cvtsi128_si32(bits);
+			outcodes[i + 1] = (u8)_mm_extract_epi16(bits, 4);
+		}
+	}
+
+	transformVertexesScalar(dest + i, outcodes ? outcodes + i : 0, src + i, count - i, transform);
+}
+
+
+TARGET_AVX2
+static void transformVertexesAVX2(ScreenVertex* dest, u8* outcodes, const Vertex* src, usize count, const ScreenTransform& transform) {
+	const f32* in = (const f32*)src;
+	f32* out = (f32*)dest;
+
+	__m256 offset = _mm256_setr_ps(transform.xoffset, transform.yoffset, transform.xoffset, transform.yoffset, transform.xoffset, transform.yoffset, transform.xoffset, transform.yoffset);
+	__m256 scale = _mm256_setr_ps(transform.zoom, -transform.zoom, transform.zoom, -transform.zoom, transform.zoom, -transform.zoom, transform.zoom, -transform.zoom);
+
+	__m256 lower = _mm256_setr_ps(transform.clipx1, transform.clipy1, transform.clipx1, transform.clipy1, transform.clipx1, transform.clipy1, transform.clipx1, transform.clipy1);
+	__m256 upper = _mm256_setr_ps(transform.clipx2, transform.clipy2, transform.clipx2, transform.clipy2, transform.clipx2, transform.clipy2, transform.clipx2, transform.clipy2);
+	__m256i lowerBits = _mm256_setr_epi32(OutcodeLeft, OutcodeAbove, OutcodeLeft, OutcodeAbove, OutcodeLeft, OutcodeAbove, OutcodeLeft, OutcodeAbove);
+	__m256i upperBits = _mm256_setr_epi32(OutcodeRight, OutcodeBelow, OutcodeRight, OutcodeBelow, OutcodeRight, OutcodeBelow, OutcodeRight, OutcodeBelow);
+
+	// Gathers one byte from each 64 bit lane, the x lane of each vertex
+	__m256i gatherBytes = _mm256_setr_epi8(
+		0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+	);
+
+	usize i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m256 v = _mm256_loadu_ps(in + i * 2);
+		__m256 p = _mm256_add_ps(offset, _mm256_mul_ps(v, scale));
+
+		_mm256_storeu_ps(out + i * 2, p);
+
+		if (outcodes) {
+			__m256i bits = _mm256_or_si256(
+				_mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(p, lower, _CMP_LT_OQ)), lowerBits),
+				_mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(p, upper, _CMP_GE_OQ)), upperBits)
+			);
+
+			bits = _mm256_or_si256(bits, _mm256_srli_epi64(bits, 32));
+			bits = _mm256_shuffle_epi8(bits, gatherBytes);
+
+			u32 lo = (u32)_mm_cvtsi128_si32(_mm256_castsi256_si128(bits));
+			u32 hi = (u32)_mm_cvtsi128_si32(_mm256_extracti128_si256(bits, 1));
+
+			outcodes[i] = (u8)lo;
+			outcodes[i + 1] = (u8)(lo >> 8);
+			outcodes[i + 2] = (u8)hi;
+			outcodes[i + 3] = (u8)(hi >> 8);
+		}
+	}
+
+	transformVertexesSSE2(dest + i, outcodes ? outcodes + i : 0, src + i, count - i, transform);
+}
+
+#endif
+
+
+SimdLevel detectSimdLevel() {
+#ifdef CONVERT_X86
+#ifdef _MSC_VER
+	int info[4];
+
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+
+	__cpuidex(info, 7, 0);
+	bool avx2 = (info[1] & (1 << 5)) != 0;
+
+	// The OS also has to save the upper halves of the ymm registers
+	if (osxsave && avx && avx2 && (_xgetbv(0) & 6) == 6) return SimdLevel::AVX2;
+#else
+	if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+#endif
+
+	return SimdLevel::SSE2;
+#else
+	return SimdLevel::Scalar;
+#endif
+}
+
+
+static SimdLevel simdLevel = detectSimdLevel();
+
+
+SimdLevel getSimdLevel() {
+	return simdLevel;
+}
+
+
+void setSimdLevel(SimdLevel level) {
+	SimdLevel supported = detectSimdLevel();
+
+	simdLevel = (i32)level > (i32)supported ? supported : level;
+}
+
+
+const char* simdLevelName(SimdLevel level) {
+	switch (level) {
+		case SimdLevel::SSE2: return "SSE2";
+		case SimdLevel::AVX2: return "AVX2";
+		default: return "Scalar";
+	}
+}
+
+
+void convertVertexes(Vertex* dest, const MapVertex* src, usize count) {
+	switch (simdLevel) {
+#ifdef CONVERT_X86
+		case SimdLevel::AVX2: convertVertexesAVX2(dest, src, count); break;
+		case SimdLevel::SSE2: convertVertexesSSE2(dest, src, count); break;
+#endif
+		default: convertVertexesScalar(dest, src, count); break;
+	}
+}
+
+
+void convertNodes(Node* dest, const MapNode* src, usize count) {
+	switch (simdLevel) {
+#ifdef CONVERT_X86
+		case SimdLevel::AVX2: convertNodesAVX2(dest, src, count); break;
+		case SimdLevel::SSE2: convertNodesSSE2(dest, src, count); break;
+#endif
+		default: convertNodesScalar(dest, src, count); break;
+	}
+}
+
+
+void computeSegLengths(Seg* segs, usize count, const Vertex* vertexes) {
+	switch (simdLevel) {
+#ifdef CONVERT_X86
+		case SimdLevel::AVX2: computeSegLengthsAVX2(segs, count, vertexes); break;
+		case SimdLevel::SSE2: computeSegLengthsSSE2(segs, count, vertexes); break;
+#endif
+		default: computeSegLengthsScalar(segs, count, vertexes); break;
+	}
+}
+
+
+void transformVertexes(ScreenVertex* dest, u8* outcodes, const Vertex* src, usize count, const ScreenTransform& transform) {
+	switch (simdLevel) {
+#ifdef CONVERT_X86
+		case SimdLevel::AVX2: transformVertexesAVX2(dest, outcodes, src, count, transform); break;
+		case SimdLevel::SSE2: transformVertexesSSE2(dest, outcodes, src, count, transform); break;
+#endif
+		default: transformVertexesScalar(dest, outcodes, src, count, transform); break;
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "types.h"
+#include "map.h"
+#include "mapformat.h"
+
+// Conversion kernels for the purely numeric map lumps, and the per frame
+// world to screen transform. The best version the cpu supports is picked at
+// startup, every version gives identical results.
+
+enum class SimdLevel {
+	Scalar,
+	SSE2,
+	AVX2
+};
+
+SimdLevel detectSimdLevel();
+SimdLevel getSimdLevel();
+// Overrides the detected level, clamped to what the cpu supports
+void setSimdLevel(SimdLevel level);
+const char* simdLevelName(SimdLevel level);
+
+void convertVertexes(Vertex* dest, const MapVertex* src, usize count);
+void convertNodes(Node* dest, const MapNode* src, usize count);
+void computeSegLengths(Seg* segs, usize count, const Vertex* vertexes);
+
+
+// Screen space position of a vertex, exactly as drawWorldLine works it out
+struct ScreenVertex {
+	f32 x, y;
+};
+
+// Which sides of the clip rectangle a vertex is beyond. A line whose two
+// outcodes share a bit is entirely off screen.
+const u8 OutcodeLeft = 0x1;
+const u8 OutcodeRight = 0x2;
+const u8 OutcodeAbove = 0x4;
+const u8 OutcodeBelow = 0x8;
+
+struct ScreenTransform {
+	f32 xoffset, yoffset;
+	f32 zoom;
+	// Clip rectangle, x2 and y2 exclusive
+	f32 clipx1, clipy1, clipx2, clipy2;
+};
+
+// Outcodes are optional, pass null to skip them
+void transformVertexes(ScreenVertex* dest, u8* outcodes, const Vertex* src, usize count, const ScreenTransform& transform);
@@ -0,0 +1,436 @@
+#include "export.h"
+#include "memory.h"
+#include "wad.h"
+#include "map.h"
+#include "renderer.h"
+#include "jobs.h"
+#include "system.h"
+
+#include <zlib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+enum class ImageFormat {
+	PNG,
+	PPM
+};
+
+enum class NodeSelection {
+	Root,
+	All,
+	List
+};
+
+struct ExportOptions {
+	const char*        outputDir;
+	i32                width, height;
+	ImageFormat        format;
+	NodeSelection      nodes;
+	Slice<i32>         nodeList;
+	Slice<const char*> wadNames;
+};
+
+// Each thread renders into its own frame. Rows start with a spare byte for
+// the PNG filter type, so the frame can be compressed as it is.
+struct ExportFrame {
+	u8*   rows;
+	usize rowBytes;
+	u8*   compressed;
+	usize compressedSize;
+};
+
+struct ExportState {
+	ExportOptions*   options;
+	ExportFrame*     frames;
+	std::atomic<i32> written;
+	std::atomic<i32> failed;
+};
+
+// Images are named after the wad and the map, with the map's place in the
+// catalog added when another map has the same names
+const usize EXPORT_STEM_SIZE = 128;
+
+struct MapExportJob {
+	ExportState* state;
+	MapEntry     entry;
+	char         fileStem[EXPORT_STEM_SIZE];
+};
+
+struct NodeExportJob {
+	ExportState* state;
+	Map*         map;
+	const char*  fileStem;
+	i32          first, last;
+};
+
+// Nodes per job, small enough that a map with only a few hundred nodes still
+// spreads across every worker
+const i32 EXPORT_NODES_PER_JOB = 16;
+
+
+static bool parseNodeList(const char* text, ExportOptions* options) {
+	i32 count = 1;
+	for (const char* c = text; *c; ++c) {
+		if (*c == ',') count++;
+	}
+
+	options->nodeList.data = arenaPush<i32>(permanent, count);
+	options->nodeList.length = 0;
+
+	const char* c = text;
+
+	while (*c) {
+		char* end;
+		long node = strtol(c, &end, 10);
+
+		if (end == c || node < 0) return false;
+
+		options->nodeList.data[options->nodeList.length++] = (i32)node;
+
+		c = *end == ',' ? end + 1 : end;
+		if (*end && *end != ',') return false;
+	}
+
+	return options->nodeList.length > 0;
+}
+
+
+// <width>x<height>. The rasterizer's fixed point only covers screens up to
+// 32k pixels.
+static bool parseImageSize(const char* text, ExportOptions* options) {
+	if (*text < '0' || *text > '9') return false;
+
+	char* end;
+	long width = strtol(text, &end, 10);
+
+	if (end == text || *end != 'x' || width <= 0 || width > 32000) return false;
+
+	const char* c = end + 1;
+	if (*c < '0' || *c > '9') return false;
+
+	long height = strtol(c, &end, 10);
+
+	if (end == c || *end || height <= 0 || height > 32000) return false;
+
+	options->width = (i32)width;
+	options->height = (i32)height;
+
+	return true;
+}
+
+
+static bool parseExportOptions(i32 argc, char** argv, ExportOptions* options) {
+	*options = {};
+	options->width = 1920;
+	options->height = 1080;
+	options->format = ImageFormat::PNG;
+	options->nodes = NodeSelection::Root;
+
+	options->wadNames.data = arenaPush<const char*>(permanent, argc + 1);
+
+	if (argc < 1) return false;
+
+	options->outputDir = argv[0];
+
+	for (i32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+			if (!parseImageSize(argv[++i], options)) return false;
+		}
+		else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+			const char* format = argv[++i];
+
+			if (strcmp(format, "png") == 0) options->format = ImageFormat::PNG;
+			else if (strcmp(format, "ppm") == 0) options->format = ImageFormat::PPM;
+			else return false;
+		}
+		else if (strcmp(argv[i], "--nodes") == 0 && i + 1 < argc) {
+			const char* nodes = argv[++i];
+
+			if (strcmp(nodes, "root") == 0) options->nodes = NodeSelection::Root;
+			else if (strcmp(nodes, "all") == 0) options->nodes = NodeSelection::All;
+			else {
+				options->nodes = NodeSelection::List;
+				if (!parseNodeList(nodes, options)) return false;
+			}
+		}
+		else {
+			options->wadNames.data[options->wadNames.length++] = argv[i];
+		}
+	}
+
+	return options->wadNames.length > 0;
+}
+
+
+static void writeU32(u8* dest, u32 value) {
+	dest[0] = (u8)(value >> 24);
+	dest[1] = (u8)(value >> 16);
+	dest[2] = (u8)(value >> 8);
+	dest[3] = (u8)value;
+}
+
+
+static bool writeChunk(FILE* f, const char* type, const u8* data, usize size) {
+	u8 header[8];
+	writeU32(header, (u32)size);
+	memcpy(header + 4, type, 4);
+
+	uLong crc = crc32(0, header + 4, 4);
+	if (size > 0) crc = crc32(crc, data, (uInt)size);
+
+	u8 footer[4];
+	writeU32(footer, (u32)crc);
+
+	return fwrite(header, 1, sizeof(header), f) == sizeof(header)
+		&& (size == 0 || fwrite(data, 1, size, f) == size)
+		&& fwrite(footer, 1, sizeof(footer), f) == sizeof(footer);
+}
+
+
+// Eight bit RGB with every row unfiltered. The diagrams are mostly flat black,
+// so the fastest compression level already does well.
+static bool writePNG(const char* fileName, ExportFrame& frame, i32 width, i32 height) {
+	uLongf compressedSize = (uLongf)frame.compressedSize;
+	usize rawSize = frame.rowBytes * height;
+
+	if (compress2(frame.compressed, &compressedSize, frame.rows, (uLong)rawSize, Z_BEST_SPEED) != Z_OK) return false;
+
+	FILE* f;
+	if (fopen_s(&f, fileName, "wb") != 0) return false;
+
+	static const u8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+	u8 header[13];
+	writeU32(header, (u32)width);
+	writeU32(header + 4, (u32)height);
+	header[8] = 8;
+	header[9] = 2;
+	header[10] = 0;
+	header[11] = 0;
+	header[12] = 0;
+
+	bool success = fwrite(signature, 1, sizeof(signature), f) == sizeof(signature)
+		&& writeChunk(f, "IHDR", header, sizeof(header))
+		&& writeChunk(f, "IDAT", frame.compressed, compressedSize)
+		&& writeChunk(f, "IEND", 0, 0);
+
+	success = fclose(f) == 0 && success;
+
+	return success;
+}
+
+
+static bool writePPM(const char* fileName, ExportFrame& frame, i32 width, i32 height) {
+	FILE* f;
+	if (fopen_s(&f, fileName, "wb") != 0) return false;
+
+	bool success = fprintf(f, "P6\n%d %d\n255\n", width, height) > 0;
+
+	for (i32 y = 0; y < height && success; ++y) {
+		success = fwrite(frame.rows + y * frame.rowBytes + 1, 3, width, f) == (usize)width;
+	}
+
+	success = fclose(f) == 0 && success;
+
+	return success;
+}
+
+
+static void exportNodes(void* data) {
+	auto job = (NodeExportJob*)data;
+	ExportState* state = job->state;
+	ExportOptions* options = state->options;
+	ExportFrame& frame = state->frames[getThreadIndex()];
+
+	DrawContext context = {};
+	context.w = options->width;
+	context.h = options->height;
+	context.xcenter = options->width / 2;
+	context.ycenter = options->height / 2;
+	context.pitch = (i32)frame.rowBytes;
+	context.bytesPerPixel = 3;
+	context.pixels = frame.rows + 1;
+	context.format = PixelFormat::RGB24;
+	context.clip = fullClipRect(context);
+	context.backend = RenderBackend::Direct;
+
+	char fileName[1024];
+
+	for (i32 i = job->first; i < job->last; ++i) {
+		i32 node = i;
+
+		if (options->nodes == NodeSelection::Root) node = (i32)job->map->nodes.length - 1;
+		else if (options->nodes == NodeSelection::List) node = options->nodeList.data[i];
+
+		if ((usize)node >= job->map->nodes.length) continue;
+
+		RenderState renderState = { node, 0 };
+		View view = calculateView(job->map, context, node);
+
+		renderMap(job->map, view, context, renderState);
+
+		const char* extension = options->format == ImageFormat::PNG ? "png" : "ppm";
+		snprintf(fileName, sizeof(fileName), "%s/%s_node%05d.%s", options->outputDir, job->fileStem, node, extension);
+
+		bool success = options->format == ImageFormat::PNG
+			? writePNG(fileName, frame, options->width, options->height)
+			: writePPM(fileName, frame, options->width, options->height);
+
+		if (success) {
+			state->written.fetch_add(1, std::memory_order_relaxed);
+		}
+		else {
+			logError("Failed to write %s", fileName);
+			state->failed.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+}
+
+
+// Loads the map into its own arena, then splits its nodes into jobs and
+// waits for them, which runs some of them on this thread too
+static void exportMap(void* data) {
+	auto job = (MapExportJob*)data;
+	ExportState* state = job->state;
+	ExportOptions* options = state->options;
+
+	MemoryArena* arena = createArena(mapMemoryRequired(job->entry) + KILOBYTES(4), "export map");
+	MapLoad load = loadMap(job->entry, arena);
+
+	LumpResult marker = getLumpByNum(job->entry.lump);
+
+	if (load.result != MapResult::Success) {
+		logWarning("Failed to load map %.8s", marker.name);
+		state->failed.fetch_add(1, std::memory_order_relaxed);
+		destroyArena(arena);
+		return;
+	}
+
+	i32 count = 1;
+	if (options->nodes == NodeSelection::All) count = (i32)load.map->nodes.length;
+	else if (options->nodes == NodeSelection::List) count = (i32)options->nodeList.length;
+
+	i32 numJobs = (count + EXPORT_NODES_PER_JOB - 1) / EXPORT_NODES_PER_JOB;
+	auto jobs = arenaPush<NodeExportJob>(arena, numJobs);
+
+	JobGroup group = {};
+
+	for (i32 i = 0; i < numJobs; ++i) {
+		NodeExportJob* nodeJob = jobs + i;
+
+		nodeJob->state = state;
+		nodeJob->map = load.map;
+		nodeJob->fileStem = job->fileStem;
+		nodeJob->first = i * EXPORT_NODES_PER_JOB;
+		nodeJob->last = nodeJob->first + EXPORT_NODES_PER_JOB < count ? nodeJob->first + EXPORT_NODES_PER_JOB : count;
+
+		addJob(&group, exportNodes, nodeJob);
+	}
+
+	waitForJobs(&group);
+
+	destroyArena(arena);
+}
+
+
+static bool sameMapNames(const MapEntry& a, const MapEntry& b) {
+	return strcmp(pathBaseName(getWadName(a.lump)), pathBaseName(getWadName(b.lump))) == 0
+		&& strncmp((const char*)getLumpByNum(a.lump).name, (const char*)getLumpByNum(b.lump).name, 8) == 0;
+}
+
+
+// Maps with the same name in different wads would otherwise overwrite each
+// other's images, possibly from two threads at once
+static void getExportStem(Array<MapEntry> maps, usize index, char* buffer) {
+	const MapEntry& entry = maps.data[index];
+
+	i32 written = snprintf(buffer, EXPORT_STEM_SIZE, "%s.%.8s", pathBaseName(getWadName(entry.lump)), getLumpByNum(entry.lump).name);
+
+	for (usize i = 0; i < maps.length; ++i) {
+		if (i == index || !sameMapNames(entry, maps.data[i])) continue;
+
+		if (written > 0 && written < (i32)EXPORT_STEM_SIZE) {
+			snprintf(buffer + written, EXPORT_STEM_SIZE - written, ".%d", (i32)index);
+		}
+
+		break;
+	}
+}
+
+
+i32 runExport(i32 argc, char** argv) {
+	ExportOptions options;
+
+	if (!parseExportOptions(argc, argv, &options)) {
+		logMessage("Usage: --export <output dir> [--nodes root|all|<n,n,...>] [--size <w>x<h>] [--format png|ppm] <wads...>");
+		return 1;
+	}
+
+	if (loadWadFiles(options.wadNames.data, options.wadNames.length) == WadResult::Failure) {
+		logError("Failed to load wad");
+		return 1;
+	}
+
+	Array<MapEntry> mapLumps = findMapLumps();
+	if (mapLumps.length == 0) {
+		logMessage("Wad contains no map lumps");
+		return 1;
+	}
+
+	u64 start = getPerformanceCounter();
+
+	ExportState state;
+	state.options = &options;
+	state.written = 0;
+	state.failed = 0;
+
+	// One frame per thread that can run jobs, the main thread included
+	i32 numFrames = getNumWorkers() + 1;
+	usize rowBytes = (usize)options.width * 3 + 1;
+	usize rawSize = rowBytes * options.height;
+	usize compressedSize = compressBound((uLong)rawSize);
+
+	MemoryArena* frameArena = createArena((sizeof(ExportFrame) + rawSize + compressedSize) * numFrames + 64, "export frames");
+	state.frames = arenaPush<ExportFrame>(frameArena, numFrames);
+
+	for (i32 i = 0; i < numFrames; ++i) {
+		ExportFrame& frame = state.frames[i];
+
+		frame.rowBytes = rowBytes;
+		frame.rows = memoryAlloc(frameArena, rawSize);
+		frame.compressed = memoryAlloc(frameArena, compressedSize);
+		frame.compressedSize = compressedSize;
+
+		// Filter bytes are never drawn over
+		memset(frame.rows, 0, rawSize);
+	}
+
+	// Maps go out a batch at a time so only so many are resident at once
+	i32 batchSize = numFrames;
+	auto mapJobs = arenaPush<MapExportJob>(permanent, mapLumps.length);
+
+	for (usize first = 0; first < mapLumps.length; first += batchSize) {
+		usize last = first + batchSize < mapLumps.length ? first + batchSize : mapLumps.length;
+		JobGroup group = {};
+
+		for (usize i = first; i < last; ++i) {
+			mapJobs[i].state = &state;
+			mapJobs[i].entry = mapLumps.data[i];
+			getExportStem(mapLumps, i, mapJobs[i].fileStem);
+
+			addJob(&group, exportMap, mapJobs + i);
+		}
+
+		waitForJobs(&group);
+	}
+
+	destroyArena(frameArena);
+
+	f64 seconds = (f64)(getPerformanceCounter() - start) / (f64)getPerformanceFrequency();
+	logMessage("Exported %i images from %i maps in %.2f seconds", state.written.load(), mapLumps.length, seconds);
+
+	return state.failed.load() == 0 ? 0 : 1;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "types.h"
+
+// Renders BSP diagrams without a window and writes them out as PNG or PPM
+// files. Takes the export options followed by the wads to load and returns
+// the process exit code.
+i32 runExport(i32 argc, char** argv);
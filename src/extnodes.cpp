@@ -0,0 +1,400 @@
+#include "extnodes.h"
+#include "system.h"
+#include "memtrace.h"
+
+#include "string.h"
+
+// Records are packed in the stream, so they are read a batch at a time into a
+// small buffer and picked apart field by field
+const usize READ_BATCH_BYTES = 4096;
+
+const usize NEW_VERTEX_BYTES = 8;
+const usize SUBSECTOR_BYTES = 4;
+const usize NODE_BYTES = 32;
+
+// Deflate can't shrink data by more than this
+const usize ZLIB_MAX_RATIO = 1032;
+
+
+struct NodeMagic {
+	const char* magic;
+	NodeFormat  format;
+	bool        compressed;
+};
+
+static const NodeMagic nodeMagics[] = {
+	{ "XNOD", NodeFormat::XNOD, false },
+	{ "ZNOD", NodeFormat::ZNOD, true },
+	{ "XGLN", NodeFormat::XGLN, false },
+	{ "ZGLN", NodeFormat::ZGLN, true },
+	{ "XGL2", NodeFormat::XGL2, false },
+	{ "ZGL2", NodeFormat::ZGL2, true },
+};
+
+
+const char* nodeFormatName(NodeFormat format) {
+	switch (format) {
+		case NodeFormat::XNOD: return "XNOD";
+		case NodeFormat::ZNOD: return "ZNOD";
+		case NodeFormat::XGLN: return "XGLN";
+		case NodeFormat::ZGLN: return "ZGLN";
+		case NodeFormat::XGL2: return "XGL2";
+		case NodeFormat::ZGL2: return "ZGL2";
+		default:               return "vanilla";
+	}
+}
+
+
+static inline u16 readU16(const u8* p) {
+	u16 result;
+	memcpy(&result, p, sizeof(result));
+	return result;
+}
+
+
+static inline u32 readU32(const u8* p) {
+	u32 result;
+	memcpy(&result, p, sizeof(result));
+	return result;
+}
+
+
+static inline bool isGlFormat(NodeFormat format) {
+	return format == NodeFormat::XGLN || format == NodeFormat::ZGLN || format == NodeFormat::XGL2 || format == NodeFormat::ZGL2;
+}
+
+
+static usize segBytes(NodeFormat format) {
+	// v1, v2 or partner, line, side
+	if (format == NodeFormat::XGL2 || format == NodeFormat::ZGL2) return 4 + 4 + 4 + 1;
+
+	return 4 + 4 + 2 + 1;
+}
+
+
+static bool readBytes(ExtendedNodeReader* reader, void* dest, usize size) {
+	if (reader->failed) return false;
+
+	if (!reader->compressed) {
+		if (size > reader->size - reader->pos) {
+			reader->failed = true;
+			return false;
+		}
+
+		memcpy(dest, reader->data + reader->pos, size);
+		reader->pos += size;
+
+		return true;
+	}
+
+	z_stream& zlib = reader->zlib;
+	zlib.next_out = (Bytef*)dest;
+	zlib.avail_out = (uInt)size;
+
+	while (zlib.avail_out > 0) {
+		int status = inflate(&zlib, Z_NO_FLUSH);
+
+		if (status == Z_STREAM_END && zlib.avail_out > 0) status = Z_DATA_ERROR;
+
+		if (status != Z_OK && status != Z_STREAM_END) {
+			reader->failed = true;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+static bool skipBytes(ExtendedNodeReader* reader, usize size) {
+	if (!reader->compressed) {
+		if (size > reader->size - reader->pos) reader->failed = true;
+		else reader->pos += size;
+
+		return !reader->failed;
+	}
+
+	u8 discard[READ_BATCH_BYTES];
+
+	while (size > 0 && !reader->failed) {
+		usize step = size < sizeof(discard) ? size : sizeof(discard);
+
+		readBytes(reader, discard, step);
+		size -= step;
+	}
+
+	return !reader->failed;
+}
+
+
+static bool readCount(ExtendedNodeReader* reader, u32* count) {
+	u8 bytes[4];
+	if (!readBytes(reader, bytes, sizeof(bytes))) return false;
+
+	*count = readU32(bytes);
+
+	return true;
+}
+
+
+static bool detectFormat(ExtendedNodeReader* reader, LumpResult lookup) {
+	if (lookup.result != WadResult::Success || lookup.lump.length < 4) return false;
+
+	for (auto& magic : nodeMagics) {
+		if (memcmp(lookup.lump.data, magic.magic, 4) != 0) continue;
+
+		*reader = {};
+		reader->format = magic.format;
+		reader->data = lookup.lump.data;
+		reader->size = lookup.lump.length;
+		reader->pos = 4;
+		reader->compressed = magic.compressed;
+
+		return true;
+	}
+
+	return false;
+}
+
+
+bool openExtendedNodes(ExtendedNodeReader* reader, LumpNum mapLump) {
+	if (!detectFormat(reader, getLumpByNum(mapLump, (int)MapLumps::Nodes))
+		&& !detectFormat(reader, getLumpByNum(mapLump, (int)MapLumps::SubSectors))) {
+		return false;
+	}
+
+	if (reader->compressed) {
+		reader->zlib.next_in = (Bytef*)(reader->data + reader->pos);
+		reader->zlib.avail_in = (uInt)(reader->size - reader->pos);
+
+		if (inflateInit(&reader->zlib) != Z_OK) {
+			logWarning("Could not start decompressing %s nodes", nodeFormatName(reader->format));
+			reader->failed = true;
+			reader->compressed = false;
+		}
+	}
+
+	return true;
+}
+
+
+bool extendedNodeLimits(LumpNum mapLump, ExtendedNodeCounts* counts) {
+	ExtendedNodeReader reader;
+
+	if (!detectFormat(&reader, getLumpByNum(mapLump, (int)MapLumps::Nodes))
+		&& !detectFormat(&reader, getLumpByNum(mapLump, (int)MapLumps::SubSectors))) {
+		return false;
+	}
+
+	usize bytes = reader.size - reader.pos;
+	if (reader.compressed) bytes *= ZLIB_MAX_RATIO;
+
+	// Any of them could take up the whole stream
+	u64 limit = 0xFFFFFFFF;
+	*counts = {};
+	counts->newVertexes = (u32)(bytes / NEW_VERTEX_BYTES < limit ? bytes / NEW_VERTEX_BYTES : limit);
+	counts->subsectors = (u32)(bytes / SUBSECTOR_BYTES < limit ? bytes / SUBSECTOR_BYTES : limit);
+	counts->segs = (u32)(bytes / segBytes(reader.format) < limit ? bytes / segBytes(reader.format) : limit);
+	counts->nodes = (u32)(bytes / NODE_BYTES < limit ? bytes / NODE_BYTES : limit);
+
+	return true;
+}
+
+
+void closeExtendedNodes(ExtendedNodeReader* reader) {
+	if (reader->compressed) inflateEnd(&reader->zlib);
+
+	reader->compressed = false;
+}
+
+
+bool readExtendedVertexCounts(ExtendedNodeReader* reader, ExtendedNodeCounts* counts) {
+	return readCount(reader, &counts->originalVertexes)
+		&& readCount(reader, &counts->newVertexes);
+}
+
+
+bool readExtendedNodeCounts(ExtendedNodeReader* reader, ExtendedNodeCounts* counts) {
+	return skipBytes(reader, (usize)counts->newVertexes * NEW_VERTEX_BYTES)
+		&& readCount(reader, &counts->subsectors)
+		&& skipBytes(reader, (usize)counts->subsectors * SUBSECTOR_BYTES)
+		&& readCount(reader, &counts->segs)
+		&& skipBytes(reader, (usize)counts->segs * segBytes(reader->format))
+		&& readCount(reader, &counts->nodes);
+}
+
+
+// Counts come from the stream, so check they fit before trusting them with
+// the arena
+template<typename T>
+static bool allocFromStream(MemoryArena* arena, Slice<T>& slice, u32 count, const char* tag) {
+	MemoryTag memoryTag("map", tag);
+
+	if ((u64)sizeof(T) * count + MAP_SLICE_ALIGNMENT >= arenaBytesFree(arena)) return false;
+
+	slice.data = arenaPush<T>(arena, count, MAP_SLICE_ALIGNMENT);
+	slice.length = count;
+
+	return true;
+}
+
+
+static bool readNewVertexes(ExtendedNodeReader* reader, const ExtendedNodeCounts* counts, Map* map) {
+	u8 batch[READ_BATCH_BYTES];
+	usize perBatch = sizeof(batch) / NEW_VERTEX_BYTES;
+
+	for (usize first = 0; first < counts->newVertexes; first += perBatch) {
+		usize count = counts->newVertexes - first < perBatch ? counts->newVertexes - first : perBatch;
+		if (!readBytes(reader, batch, count * NEW_VERTEX_BYTES)) return false;
+
+		Vertex* dest = map->vertexes.data + counts->originalVertexes + first;
+
+		// 16.16 fixed point
+		for (usize i = 0; i < count; ++i) {
+			dest[i].x = (f32)(i32)readU32(batch + i * NEW_VERTEX_BYTES) / 65536.0f;
+			dest[i].y = (f32)(i32)readU32(batch + i * NEW_VERTEX_BYTES + 4) / 65536.0f;
+		}
+	}
+
+	return true;
+}
+
+
+static bool readSubSectors(ExtendedNodeReader* reader, ExtendedNodeCounts* counts, Map* map, MemoryArena* arena) {
+	if (!readCount(reader, &counts->subsectors)) return false;
+
+	if (!allocFromStream(arena, map->subsectors, counts->subsectors, "subsectors")) return false;
+
+	u8 batch[READ_BATCH_BYTES];
+	usize perBatch = sizeof(batch) / SUBSECTOR_BYTES;
+	u64 firstSeg = 0;
+
+	// Each subsector's segs follow straight on from the previous one's
+	for (usize first = 0; first < counts->subsectors; first += perBatch) {
+		usize count = counts->subsectors - first < perBatch ? counts->subsectors - first : perBatch;
+		if (!readBytes(reader, batch, count * SUBSECTOR_BYTES)) return false;
+
+		for (usize i = 0; i < count; ++i) {
+			SubSector* ssec = map->subsectors.data + first + i;
+			u32 numSegs = readU32(batch + i * SUBSECTOR_BYTES);
+
+			ssec->sector = -1;
+			ssec->firstseg = (i32)firstSeg;
+			ssec->numsegs = (i32)numSegs;
+
+			firstSeg += numSegs;
+		}
+	}
+
+	if (firstSeg > 0x7FFFFFFF) return false;
+
+	counts->segs = (u32)firstSeg;
+
+	return true;
+}
+
+
+static bool readSegs(ExtendedNodeReader* reader, ExtendedNodeCounts* counts, Map* map, MemoryArena* arena) {
+	u32 numSegs;
+	if (!readCount(reader, &numSegs)) return false;
+
+	if (numSegs != counts->segs) {
+		logWarning("Subsectors use %u segs, %u in the nodes", counts->segs, numSegs);
+		return false;
+	}
+
+	if (!allocFromStream(arena, map->segs, numSegs, "segs")) return false;
+
+	bool gl = isGlFormat(reader->format);
+	bool wideLines = reader->format == NodeFormat::XGL2 || reader->format == NodeFormat::ZGL2;
+	usize recordBytes = segBytes(reader->format);
+
+	u8 batch[READ_BATCH_BYTES];
+	usize perBatch = sizeof(batch) / recordBytes;
+
+	for (usize first = 0; first < numSegs; first += perBatch) {
+		usize count = numSegs - first < perBatch ? numSegs - first : perBatch;
+		if (!readBytes(reader, batch, count * recordBytes)) return false;
+
+		for (usize i = 0; i < count; ++i) {
+			const u8* record = batch + i * recordBytes;
+			Seg* seg = map->segs.data + first + i;
+
+			*seg = {};
+			seg->v1 = (i32)readU32(record);
+			seg->v2 = (i32)readU32(record + 4);
+
+			if (wideLines) {
+				seg->linedef = (i32)readU32(record + 8);
+			}
+			else {
+				u16 line = readU16(record + 8);
+				seg->linedef = line == 0xFFFF ? -1 : line;
+			}
+
+			seg->side = record[recordBytes - 1];
+		}
+	}
+
+	// Gl segs store their partner seg instead of the end vertex, which is
+	// the start of the next seg around the subsector
+	if (gl) {
+		for (usize s = 0; s < map->subsectors.length; ++s) {
+			SubSector* ssec = map->subsectors.data + s;
+			Seg* segs = map->segs.data + ssec->firstseg;
+
+			for (i32 i = 0; i < ssec->numsegs; ++i) {
+				segs[i].v2 = segs[(i + 1) % ssec->numsegs].v1;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+static bool readNodes(ExtendedNodeReader* reader, ExtendedNodeCounts* counts, Map* map, MemoryArena* arena) {
+	if (!readCount(reader, &counts->nodes)) return false;
+
+	if (!allocFromStream(arena, map->nodes, counts->nodes, "nodes")) return false;
+
+	u8 batch[READ_BATCH_BYTES];
+	usize perBatch = sizeof(batch) / NODE_BYTES;
+
+	for (usize first = 0; first < counts->nodes; first += perBatch) {
+		usize count = counts->nodes - first < perBatch ? counts->nodes - first : perBatch;
+		if (!readBytes(reader, batch, count * NODE_BYTES)) return false;
+
+		for (usize i = 0; i < count; ++i) {
+			const u8* record = batch + i * NODE_BYTES;
+			Node* n = map->nodes.data + first + i;
+
+			n->x = (i16)readU16(record);
+			n->y = (i16)readU16(record + 2);
+			n->dx = (i16)readU16(record + 4);
+			n->dy = (i16)readU16(record + 6);
+
+			for (int j = 0; j < 2; ++j) {
+				for (int k = 0; k < 4; ++k) {
+					n->bbox[j][k] = (i16)readU16(record + 8 + (j * 4 + k) * 2);
+				}
+
+				n->children[j] = (i32)readU32(record + 24 + j * 4);
+			}
+		}
+	}
+
+	return true;
+}
+
+
+bool readExtendedNodes(ExtendedNodeReader* reader, ExtendedNodeCounts* counts, Map* map, MemoryArena* arena) {
+	bool success = readNewVertexes(reader, counts, map)
+		&& readSubSectors(reader, counts, map, arena)
+		&& readSegs(reader, counts, map, arena)
+		&& readNodes(reader, counts, map, arena);
+
+	if (!success) logWarning("%s nodes are truncated or corrupt", nodeFormatName(reader->format));
+
+	return success;
+}
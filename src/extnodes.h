@@ -0,0 +1,62 @@
+#pragma once
+
+#include "types.h"
+#include "map.h"
+#include "memory.h"
+#include "wad.h"
+
+#include <zlib.h>
+
+// ZDoom extended nodes. XNOD and ZNOD replace the NODES lump, the gl versions
+// (XGLN, XGL2 and their compressed forms) live in SSECTORS with NODES left
+// empty. The Z formats are zlib compressed after the four byte magic and are
+// inflated a piece at a time straight into the level arena.
+
+enum class NodeFormat {
+	Vanilla,
+	XNOD,
+	ZNOD,
+	XGLN,
+	ZGLN,
+	XGL2,
+	ZGL2
+};
+
+struct ExtendedNodeReader {
+	NodeFormat format;
+	const u8*  data;
+	usize      size;
+	usize      pos;
+	bool       compressed;
+	bool       failed;
+	z_stream   zlib;
+};
+
+struct ExtendedNodeCounts {
+	u32 originalVertexes;
+	u32 newVertexes;
+	u32 subsectors;
+	u32 segs;
+	u32 nodes;
+};
+
+const char* nodeFormatName(NodeFormat format);
+
+// Returns false if the map only has vanilla nodes
+bool openExtendedNodes(ExtendedNodeReader* reader, LumpNum mapLump);
+void closeExtendedNodes(ExtendedNodeReader* reader);
+
+// The most records of each kind the map's node stream could hold, worked out
+// from the lump size alone so nothing is inflated. False for vanilla nodes.
+bool extendedNodeLimits(LumpNum mapLump, ExtendedNodeCounts* counts);
+
+// The vertex counts come first in the stream and have to be read before
+// anything else, so the vertex array can be sized to hold both sets
+bool readExtendedVertexCounts(ExtendedNodeReader* reader, ExtendedNodeCounts* counts);
+// Skips through the rest of the stream to find the other counts
+bool readExtendedNodeCounts(ExtendedNodeReader* reader, ExtendedNodeCounts* counts);
+
+// Reads the new vertexes into map->vertexes after the original ones, then
+// allocates and fills the subsectors, segs and nodes. Segs only get their raw
+// fields, sectors, offsets and lengths are left to the caller.
+bool readExtendedNodes(ExtendedNodeReader* reader, ExtendedNodeCounts* counts, Map* map, MemoryArena* arena);
@@ -0,0 +1,207 @@
+#include "jobs.h"
+#include "memory.h"
+#include "system.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+
+struct Job {
+	JobFunction* function;
+	void*        data;
+	JobGroup*    group;
+};
+
+
+// Each worker owns a deque. Jobs a worker adds go on the back of its own
+// deque and it takes its next job from the back too, so nested work stays
+// on the thread that made it. Idle threads steal from the front of everyone
+// else's. Threads that are not workers share one extra deque.
+struct JobDeque {
+	std::mutex mutex;
+	Job*       jobs;
+	usize      head;
+	usize      count;
+};
+
+const i32 MAX_WORKERS = 64;
+const usize DEQUE_CAPACITY = 4096;
+
+
+// Workers are never joined, so the sync objects are constructed in raw
+// storage and never destroyed, rather than being torn down underneath
+// waiting workers at exit
+alignas(JobDeque) static u8 dequeStorage[sizeof(JobDeque) * (MAX_WORKERS + 1)];
+alignas(std::mutex) static u8 sleepMutexStorage[sizeof(std::mutex)];
+alignas(std::condition_variable) static u8 sleepSignalStorage[sizeof(std::condition_variable)];
+
+static JobDeque* deques = 0;
+static i32 numDeques = 0;
+
+static std::mutex* sleepMutex = 0;
+static std::condition_variable* sleepSignal = 0;
+
+// Jobs sitting in any deque, idle workers sleep while this is zero
+static std::atomic<i32> queuedJobs(0);
+
+static i32 numWorkers = 0;
+
+static thread_local i32 threadDeque = -1;
+
+
+static i32 getThreadDeque() {
+	return threadDeque == -1 ? numWorkers : threadDeque;
+}
+
+
+static bool pushJob(JobDeque& deque, const Job& job) {
+	std::lock_guard<std::mutex> lock(deque.mutex);
+
+	if (deque.count == DEQUE_CAPACITY) return false;
+
+	deque.jobs[(deque.head + deque.count) % DEQUE_CAPACITY] = job;
+	deque.count++;
+
+	return true;
+}
+
+
+static bool popBack(JobDeque& deque, Job* job) {
+	std::lock_guard<std::mutex> lock(deque.mutex);
+
+	if (deque.count == 0) return false;
+
+	deque.count--;
+	*job = deque.jobs[(deque.head + deque.count) % DEQUE_CAPACITY];
+
+	return true;
+}
+
+
+static bool popFront(JobDeque& deque, Job* job) {
+	std::lock_guard<std::mutex> lock(deque.mutex);
+
+	if (deque.count == 0) return false;
+
+	*job = deque.jobs[deque.head];
+	deque.head = (deque.head + 1) % DEQUE_CAPACITY;
+	deque.count--;
+
+	return true;
+}
+
+
+static bool findJob(Job* job) {
+	if (queuedJobs.load(std::memory_order_acquire) == 0) return false;
+
+	i32 self = getThreadDeque();
+	bool found = popBack(deques[self], job);
+
+	for (i32 i = 1; i < numDeques && !found; ++i) {
+		found = popFront(deques[(self + i) % numDeques], job);
+	}
+
+	if (found) queuedJobs.fetch_sub(1, std::memory_order_relaxed);
+
+	return found;
+}
+
+
+static void runJob(Job& job) {
+	job.function(job.data);
+	job.group->pending.fetch_sub(1, std::memory_order_release);
+}
+
+
+static void workerLoop(i32 index) {
+	threadDeque = index;
+
+	for (;;) {
+		Job job;
+
+		if (findJob(&job)) {
+			runJob(job);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(*sleepMutex);
+		sleepSignal->wait(lock, [] { return queuedJobs.load(std::memory_order_acquire) > 0; });
+	}
+}
+
+
+void initJobs(i32 workerCount) {
+	if (workerCount <= 0) {
+		workerCount = (i32)std::thread::hardware_concurrency() - 1;
+		if (workerCount < 1) workerCount = 1;
+	}
+
+	if (workerCount > MAX_WORKERS) workerCount = MAX_WORKERS;
+
+	sleepMutex = new (sleepMutexStorage) std::mutex;
+	sleepSignal = new (sleepSignalStorage) std::condition_variable;
+
+	numWorkers = workerCount;
+	numDeques = workerCount + 1;
+
+	deques = (JobDeque*)dequeStorage;
+
+	for (i32 i = 0; i < numDeques; ++i) {
+		JobDeque* deque = new (deques + i) JobDeque;
+		deque->jobs = arenaPush<Job>(permanent, DEQUE_CAPACITY);
+		deque->head = 0;
+		deque->count = 0;
+	}
+
+	for (i32 i = 0; i < numWorkers; ++i) {
+		std::thread(workerLoop, i).detach();
+	}
+}
+
+
+i32 getNumWorkers() {
+	return numWorkers;
+}
+
+
+i32 getThreadIndex() {
+	return getThreadDeque();
+}
+
+
+void addJob(JobGroup* group, JobFunction* function, void* data) {
+	Job job = { function, data, group };
+
+	group->pending.fetch_add(1, std::memory_order_relaxed);
+
+	if (!pushJob(deques[getThreadDeque()], job)) {
+		// Deque is full, just do the work here
+		runJob(job);
+		return;
+	}
+
+	queuedJobs.fetch_add(1, std::memory_order_release);
+
+	// Taking the lock means a worker can't miss the wakeup between checking
+	// the count and going to sleep
+	{
+		std::lock_guard<std::mutex> lock(*sleepMutex);
+	}
+
+	sleepSignal->notify_one();
+}
+
+
+void waitForJobs(JobGroup* group) {
+	while (group->pending.load(std::memory_order_acquire) > 0) {
+		Job job;
+
+		if (findJob(&job)) {
+			runJob(job);
+		}
+		else {
+			std::this_thread::yield();
+		}
+	}
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "types.h"
+
+#include <atomic>
+
+typedef void JobFunction(void* data);
+
+// Tracks a batch of jobs so the caller can wait on all of them at once
+struct JobGroup {
+	std::atomic<i32> pending;
+};
+
+// Starts the worker threads. Zero picks one worker per hardware thread, minus
+// one for the main thread. Each worker has its own queue and steals from the
+// others when it runs dry.
+void initJobs(i32 workerCount = 0);
+i32 getNumWorkers();
+// Index of the calling thread, 0 to getNumWorkers() - 1 for workers.
+// Every other thread gets getNumWorkers().
+i32 getThreadIndex();
+
+void addJob(JobGroup* group, JobFunction* function, void* data);
+
+// Blocks until every job in the group has finished. The calling thread runs
+// queued jobs while it waits, so it is safe to wait from inside a job.
+void waitForJobs(JobGroup* group);
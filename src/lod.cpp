@@ -0,0 +1,333 @@
+#include "lod.h"
+#include "jobs.h"
+#include "system.h"
+#include "memtrace.h"
+
+#include "math.h"
+
+// The finest level may be off by a map unit, each one after that doubles it
+const f32 LOD_BASE_TOLERANCE = 1.0f;
+const f32 LOD_MAX_ERROR_PIXELS = 0.5f;
+
+
+struct LodStep {
+	i32  node;
+	i32  first, last;
+	bool collapse;
+};
+
+struct LodSpan {
+	i32 first, last;
+};
+
+// One level's worth of work. Everything is allocated before the jobs start.
+struct LodBuild {
+	Map*     map;
+	f32      tolerance;
+	LodLine* lines;
+	i32      numLines;
+	i32      longest;
+	i32*     points;
+	u8*      keep;
+	LodSpan* spans;
+	LodStep* steps;
+};
+
+
+usize lodMemoryRequired(usize numSegs) {
+	return sizeof(LodLevel) * MAP_LOD_LEVELS + sizeof(LodLine) * numSegs + MAP_SLICE_ALIGNMENT * 2;
+}
+
+
+static f32 distanceToLine(const Vertex& p, const Vertex& a, const Vertex& b) {
+	f32 dx = b.x - a.x;
+	f32 dy = b.y - a.y;
+	f32 length = sqrtf(dx * dx + dy * dy);
+
+	if (length == 0.0f) return sqrtf((p.x - a.x) * (p.x - a.x) + (p.y - a.y) * (p.y - a.y));
+
+	return fabsf((p.x - a.x) * dy - (p.y - a.y) * dx) / length;
+}
+
+
+// Douglas-Peucker over the chain's points. A closed chain starts and ends on
+// the same vertex, its first split is just the point furthest from there.
+static void simplifyChain(LodBuild& build, i32 count, i32 firstseg) {
+	const Vertex* vertexes = build.map->vertexes.data;
+
+	for (i32 i = 0; i < count; ++i) build.keep[i] = 0;
+
+	build.keep[0] = 1;
+	build.keep[count - 1] = 1;
+
+	i32 numSpans = 0;
+	build.spans[numSpans++] = { 0, count - 1 };
+
+	while (numSpans > 0) {
+		LodSpan span = build.spans[--numSpans];
+
+		const Vertex& a = vertexes[build.points[span.first]];
+		const Vertex& b = vertexes[build.points[span.last]];
+
+		f32 furthest = 0.0f;
+		i32 split = -1;
+
+		for (i32 i = span.first + 1; i < span.last; ++i) {
+			f32 distance = distanceToLine(vertexes[build.points[i]], a, b);
+
+			if (distance > furthest) {
+				furthest = distance;
+				split = i;
+			}
+		}
+
+		if (split == -1 || furthest <= build.tolerance) continue;
+
+		build.keep[split] = 1;
+		build.spans[numSpans++] = { span.first, split };
+		build.spans[numSpans++] = { split, span.last };
+	}
+
+	i32 start = 0;
+
+	for (i32 i = 1; i < count; ++i) {
+		if (!build.keep[i]) continue;
+
+		build.lines[build.numLines++] = { build.points[start], build.points[i], firstseg + start };
+		start = i;
+	}
+}
+
+
+// Splits the subsector's segs into chains of connected segs that look the
+// same and simplifies each one. Minisegs are never drawn and break chains.
+static void simplifySegs(LodBuild& build, i32 first, i32 last) {
+	Map* map = build.map;
+	i32 i = first;
+
+	while (i < last) {
+		const Seg& seg = map->segs.data[i];
+
+		if (seg.linedef < 0) {
+			i++;
+			continue;
+		}
+
+		LineKind kind = getLineKind(map, seg);
+
+		build.points[0] = seg.v1;
+		build.points[1] = seg.v2;
+		i32 count = 2;
+		i32 next = i + 1;
+
+		while (next < last) {
+			const Seg& link = map->segs.data[next];
+
+			if (link.linedef < 0 || link.v1 != map->segs.data[next - 1].v2 || getLineKind(map, link) != kind) break;
+
+			build.points[count++] = link.v2;
+			next++;
+		}
+
+		simplifyChain(build, count, i);
+		i = next;
+	}
+}
+
+
+// The whole run fits inside the tolerance, so a dot on its first drawn seg
+// is as close as anything else
+static void collapseSegs(LodBuild& build, i32 first, i32 last) {
+	for (i32 i = first; i < last; ++i) {
+		const Seg& seg = build.map->segs.data[i];
+		if (seg.linedef < 0) continue;
+
+		build.lines[build.numLines++] = { seg.v1, seg.v1, i };
+		return;
+	}
+}
+
+
+static bool fitsTolerance(const f32 bbox[4], f32 tolerance) {
+	return bbox[BoxRight] - bbox[BoxLeft] <= tolerance && bbox[BoxTop] - bbox[BoxBottom] <= tolerance;
+}
+
+
+// Same walk as the renderer's culling, so lines come out in seg order. The
+// working buffers live in the thread's scratch memory only while it runs.
+static void buildLodLevel(void* data) {
+	auto build = (LodBuild*)data;
+	Map* map = build->map;
+
+	MemoryTag memoryTag("map", "lod");
+	MemoryArena* scratch = threadTemporary();
+	ArenaScope scope(scratch);
+
+	// Chains have at most one point more than the subsector has segs, and
+	// the walk holds at most one step per node plus the two children
+	build->points = arenaPush<i32>(scratch, build->longest + 1);
+	build->keep = arenaPush<u8>(scratch, build->longest + 1);
+	build->spans = arenaPush<LodSpan>(scratch, build->longest + 1);
+	build->steps = arenaPush<LodStep>(scratch, map->nodes.length + 2);
+
+	build->numLines = 0;
+
+	i32 numSteps = 0;
+	build->steps[numSteps++] = { (i32)map->nodes.length - 1, 0, 0, false };
+
+	while (numSteps > 0) {
+		LodStep step = build->steps[--numSteps];
+
+		if (step.node < 0) {
+			if (step.collapse) collapseSegs(*build, step.first, step.last);
+			else simplifySegs(*build, step.first, step.last);
+
+			continue;
+		}
+
+		const Node& node = map->nodes.data[step.node];
+
+		for (i32 side = 1; side >= 0; --side) {
+			i32 first = node.firstseg[side];
+			i32 last = first + node.numsegs[side];
+
+			if (fitsTolerance(node.bbox[side], build->tolerance)) {
+				build->steps[numSteps++] = { -1, first, last, true };
+			}
+			else if (node.children[side] & SubsectorChildFlag) {
+				build->steps[numSteps++] = { -1, first, last, false };
+			}
+			else {
+				build->steps[numSteps++] = { node.children[side], first, last, false };
+			}
+		}
+	}
+
+	// Subsectors the tree never reaches were laid out after it
+	const Node& root = map->nodes.data[map->nodes.length - 1];
+	i32 treeLast = root.firstseg[1] + root.numsegs[1];
+
+	for (usize i = 0; i < map->subsectors.length; ++i) {
+		const SubSector& ssec = map->subsectors.data[i];
+
+		if (ssec.firstseg >= treeLast) {
+			simplifySegs(*build, ssec.firstseg, ssec.firstseg + ssec.numsegs);
+		}
+	}
+}
+
+
+void buildMapLod(Map* map, MemoryArena* arena) {
+	MemoryTag memoryTag("map", "lod");
+
+	map->lodLevels = {};
+	map->lodLines = {};
+
+	usize numSegs = map->segs.length;
+	usize numNodes = map->nodes.length;
+
+	if (numSegs == 0 || numNodes == 0) return;
+
+	i32 longest = 0;
+
+	for (usize i = 0; i < map->subsectors.length; ++i) {
+		if (map->subsectors.data[i].numsegs > longest) longest = map->subsectors.data[i].numsegs;
+	}
+
+	// Every level can have at most one line per seg. They are kept in this
+	// thread's scratch memory until the levels worth keeping are known.
+	MemoryArena* scratch = threadTemporary();
+	ArenaScope scope(scratch);
+
+	LodBuild builds[MAP_LOD_LEVELS];
+	JobGroup group = {};
+
+	for (i32 i = 0; i < MAP_LOD_LEVELS; ++i) {
+		LodBuild& build = builds[i];
+
+		build.map = map;
+		build.tolerance = LOD_BASE_TOLERANCE * (f32)(1 << i);
+		build.lines = arenaPush<LodLine>(scratch, numSegs);
+		build.numLines = 0;
+		build.longest = longest;
+
+		addJob(&group, buildLodLevel, &build);
+	}
+
+	waitForJobs(&group);
+
+	// Keep the coarse levels first, they save the most
+	usize numLevels = 0;
+	usize numLines = 0;
+	usize free = arenaBytesFree(arena);
+
+	for (i32 i = MAP_LOD_LEVELS - 1; i >= 0; --i) {
+		usize lines = numLines + builds[i].numLines;
+
+		if (sizeof(LodLevel) * MAP_LOD_LEVELS + sizeof(LodLine) * lines + MAP_SLICE_ALIGNMENT * 2 >= free) break;
+
+		// No point keeping a level that barely saves anything
+		if ((usize)builds[i].numLines * 10 > numSegs * 9) break;
+
+		numLevels++;
+		numLines = lines;
+	}
+
+	if (numLevels < MAP_LOD_LEVELS) {
+		logMessage("\tKept %i of %i detail levels", numLevels, MAP_LOD_LEVELS);
+	}
+
+	if (numLevels > 0) {
+		map->lodLevels.data = arenaPush<LodLevel>(arena, numLevels, MAP_SLICE_ALIGNMENT);
+		map->lodLevels.length = numLevels;
+		map->lodLines.data = arenaPush<LodLine>(arena, numLines, MAP_SLICE_ALIGNMENT);
+		map->lodLines.length = numLines;
+
+		i32 firstline = 0;
+
+		for (usize level = 0; level < numLevels; ++level) {
+			const LodBuild& build = builds[MAP_LOD_LEVELS - 1 - level];
+
+			map->lodLevels.data[level] = { build.tolerance, firstline, build.numLines };
+
+			for (i32 i = 0; i < build.numLines; ++i) {
+				map->lodLines.data[firstline + i] = build.lines[i];
+			}
+
+			firstline += build.numLines;
+		}
+	}
+}
+
+
+const LodLevel* chooseLodLevel(Map* map, f32 zoom) {
+	for (usize i = 0; i < map->lodLevels.length; ++i) {
+		const LodLevel& level = map->lodLevels.data[i];
+
+		if (level.tolerance * zoom <= LOD_MAX_ERROR_PIXELS) return &level;
+	}
+
+	return 0;
+}
+
+
+// First line in the level whose seg is at or after the given one
+static i32 lowerBoundLine(Map* map, const LodLevel& level, i32 seg) {
+	i32 low = level.firstline;
+	i32 high = level.firstline + level.numlines;
+
+	while (low < high) {
+		i32 middle = low + (high - low) / 2;
+
+		if (map->lodLines.data[middle].seg < seg) low = middle + 1;
+		else high = middle;
+	}
+
+	return low;
+}
+
+
+void findLodLines(Map* map, const LodLevel& level, i32 firstseg, i32 lastseg, i32* first, i32* last) {
+	*first = lowerBoundLine(map, level, firstseg);
+	*last = lowerBoundLine(map, level, lastseg);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "types.h"
+#include "map.h"
+#include "memory.h"
+
+// Zoomed out, most segs are far shorter than a pixel. Each detail level
+// keeps just enough of the map's lines to draw it to within half a pixel at
+// the zooms it is used for. Connected segs of the same kind in a subsector
+// are simplified as one chain, and node children smaller than the tolerance
+// shrink to a single dot. Lines stay in seg order, so culling and
+// highlighting work on seg ranges exactly as they do at full detail.
+
+const i32 MAP_LOD_LEVELS = 8;
+
+// Room for every level's lines to add up to one per seg. Simplified levels
+// are usually far smaller, any that don't fit are left out, finest first.
+usize lodMemoryRequired(usize numSegs);
+
+// Builds the levels on the job system and stores them in the map's arena
+void buildMapLod(Map* map, MemoryArena* arena);
+
+// Coarsest level that stays within half a pixel at the given zoom, null if
+// the map should be drawn at full detail
+const LodLevel* chooseLodLevel(Map* map, f32 zoom);
+
+// The level's lines standing in for segs [firstseg, lastseg), which have to
+// start and end on subsector boundaries
+void findLodLines(Map* map, const LodLevel& level, i32 firstseg, i32 lastseg, i32* first, i32* last);
@@ -5,11 +5,19 @@
 #include "map.h"
 #include "renderer.h"
 #include "vectors.h"
+#include "jobs.h"
+#include "mapcache.h"
+#include "bench.h"
+#include "export.h"
+#include "profiler.h"
+#include "memtrace.h"
 
 #define SDL_MAIN_HANDLED
 #include <SDL.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 static f32 camerax, cameray;
 static f32 zoom;
@@ -19,18 +27,75 @@ static SDL_Window* window = 0;
 static Slice<char> titleBuffer = {};
 
 
+// Renders into the given part of the screen and pushes just that part to the
+// window. Overlays go on top, redrawn whole every frame.
+static void drawFrame(SDL_Surface* screen, DrawContext& drawContext, Map* map, View& view, RenderState& renderState, ClipRect clip, bool showProfile, bool showMemory) {
+	ProfileScope profile(ProfileStage::Frame);
+
+	if(SDL_LockSurface(screen) != 0) {
+		fatalError("Failed to lock surface");
+	}
+
+	drawContext.clip = clip;
+	renderMap(map, view, drawContext, renderState);
+
+	SDL_Rect rects[3];
+	i32 numRects = 0;
+
+	rects[numRects++] = { clip.x1, clip.y1, clip.x2 - clip.x1, clip.y2 - clip.y1 };
+
+	drawContext.clip = fullClipRect(drawContext);
+
+	if (showProfile) {
+		ClipRect area = drawProfileOverlay(drawContext);
+		rects[numRects++] = { area.x1, area.y1, area.x2 - area.x1, area.y2 - area.y1 };
+	}
+
+	if (showMemory) {
+		ClipRect area = drawMemoryOverlay(drawContext);
+		rects[numRects++] = { area.x1, area.y1, area.x2 - area.x1, area.y2 - area.y1 };
+	}
+
+	SDL_UnlockSurface(screen);
+
+	SDL_UpdateWindowSurfaceRects(window, rects, numRects);
+}
+
+
+static const char* usage = "Usage: drag wad files on to exe or run from command line with the paths to the wads you'd like to inspect nodes from, later wads override earlier ones";
+
+
 int main(int argc, char** argv) {
+	initLogger();
+
 	if (argc == 1) {
-		logMessage("Usage: drag wad file on to exe or run from command line with the first argument being the path to the wad you'd like to inspect nodes from");
+		logMessage("%s", usage);
 		return 1;
 	}
 
 	logMessage("Initializing memory");
 	initMemory();
 
+	logMessage("Initializing job system");
+	initJobs();
+
 	logMessage("Initializing wad files");
 	initWads();
 
+	if (strcmp(argv[1], "--export") == 0) {
+		return runExport(argc - 2, argv + 2);
+	}
+
+	if (strcmp(argv[1], "--bench") == 0) {
+		return runBenchmarkSuite(argc - 2, argv + 2);
+	}
+
+	if (strcmp(argv[1], "--bench-convert") == 0) {
+		usize numSegs = argc > 2 ? (usize)atoi(argv[2]) : 200000;
+		runConversionBenchmark(numSegs);
+		return 0;
+	}
+
 	if(SDL_Init(SDL_INIT_VIDEO|SDL_INIT_TIMER|SDL_INIT_EVENTS) < 0) {
 		fatalError("Failed to init SDL");
 	}
@@ -40,7 +105,7 @@ int main(int argc, char** argv) {
 		fatalError("Failed to open window");
 	}
 
-	titleBuffer.data = (char*)memoryAlloc(permanent, sizeof(char) * 1024);
+	titleBuffer.data = arenaPush<char>(permanent, 1024);
 	titleBuffer.length = 1024;
 
 	bool isRunning = true;
@@ -50,8 +115,10 @@ int main(int argc, char** argv) {
 	if(!screen) {
 		fatalError("Failed to get window surface");
 	}
-	if(screen->format->BitsPerPixel != 32) {
-		fatalError("Failed to set 32-bit color");
+
+	PixelFormat pixelFormat;
+	if(!choosePixelFormat(screen->format->BitsPerPixel, screen->format->Rmask, screen->format->Gmask, screen->format->Bmask, &pixelFormat)) {
+		fatalError("Unsupported %d-bit screen format", screen->format->BitsPerPixel);
 	}
 
 	DrawContext drawContext = {
@@ -60,30 +127,79 @@ int main(int argc, char** argv) {
 		screen->w / 2,
 		screen->h / 2,
 		screen->pitch,
-		4,
+		screen->format->BytesPerPixel,
 		(u8*)screen->pixels,
-		screen->format->Rshift, screen->format->Gshift, screen->format->Bshift,
-		screen->format->Rmask, screen->format->Gmask, screen->format->Bmask
+		pixelFormat
 	};
+	drawContext.clip = fullClipRect(drawContext);
+	drawContext.scratch = temporary;
 
 	logMessage("Initializing renderer");
 	initRenderer(drawContext);
 
-	const u64 timeSamples = 10;
-	u64 times[timeSamples] = {};
-	i32 tick = 0;
+	Slice<const char*> wadNames;
+	wadNames.data = arenaPush<const char*>(permanent, argc);
+	wadNames.length = 0;
+
+	usize mapCacheBudget = MEGABYTES(256);
+	bool mapCacheFiles = false;
+	bool continuous = false;
+	RenderBackend renderBackend = RenderBackend::Tiled;
+	const char* traceFile = 0;
+	const char* memoryTraceDir = 0;
+
+	for (i32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc) {
+			const char* text = argv[++i];
+			char* end;
+			long megabytes = strtol(text, &end, 10);
+
+			if (end == text || *end || megabytes < 1 || (unsigned long)megabytes > (usize)-1 / MEGABYTES((usize)1)) {
+				logError("--cache-mb needs a positive number of megabytes");
+				logMessage("%s", usage);
+				return 1;
+			}
+
+			mapCacheBudget = (usize)megabytes * MEGABYTES((usize)1);
+		}
+		else if (strcmp(argv[i], "--map-cache") == 0) {
+			mapCacheFiles = true;
+		}
+		else if (strcmp(argv[i], "--continuous") == 0) {
+			continuous = true;
+		}
+		else if (strcmp(argv[i], "--renderer") == 0 && i + 1 < argc) {
+			renderBackend = strcmp(argv[++i], "direct") == 0 ? RenderBackend::Direct : RenderBackend::Tiled;
+		}
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			traceFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "--memory-trace") == 0 && i + 1 < argc) {
+			memoryTraceDir = argv[++i];
+		}
+		else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+			const char* level = argv[++i];
+			setLogLevel(strcmp(level, "error") == 0 ? LogLevel::Error : strcmp(level, "warning") == 0 ? LogLevel::Warning : LogLevel::Info);
+		}
+		else {
+			logMessage("Loading wad file %s...", argv[i]);
+			wadNames.data[wadNames.length++] = argv[i];
+		}
+	}
+
+	drawContext.backend = renderBackend;
 
-	u64 frameStart = SDL_GetPerformanceCounter(), lastTime;
-	u64 counterFreq = SDL_GetPerformanceFrequency();
+	if (memoryTraceDir) initMemoryTrace(memoryTraceDir);
 
-	logMessage("Loading wad file %s...", argv[1]);
+	// Before any maps start loading so their stages are caught too
+	initProfiler(traceFile != 0);
 
-	WadResult wadResult = loadWadFile(argv[1]);
+	WadResult wadResult = loadWadFiles(wadNames.data, wadNames.length);
 	if (wadResult == WadResult::Failure) {
 		fatalError("Failed to load wad");
 	}
 
-	Array<LumpNum> mapLumps = findMapLumps();
+	Array<MapEntry> mapLumps = findMapLumps();
 	if (mapLumps.length == 0) {
 		fatalError("Wad contains no map lumps");
 	}
@@ -91,8 +207,12 @@ int main(int argc, char** argv) {
 		logMessage("Wad contains %i map lumps", mapLumps.length);
 	}
 
+	initMapCache(mapLumps, mapCacheBudget, mapCacheFiles);
+
 	i32 mapIndex = 0;
-	MapLoad mapLoad = loadMap(mapLumps[mapIndex]);
+	i32 pendingMapIndex = -1;
+	MapLoad mapLoad = *waitForCachedMap(mapIndex);
+	setCurrentMap(mapIndex);
 
 	RenderState renderState = {
 		mapLoad.map->nodes.length - 1,
@@ -104,18 +224,42 @@ int main(int argc, char** argv) {
 	bool pagedownPressed;
 	bool pageupPressed;
 
-	while (isRunning) {
-		lastTime = frameStart;
-		frameStart = SDL_GetPerformanceCounter();
-
-		f32 secondsElapsed = (f32)(frameStart - lastTime) / (f32)counterFreq;
+	// What is currently on screen, so a frame is only drawn when something
+	// changed. A change of highlighted side alone only redraws the selected
+	// node's area.
+	bool redrawAll = true;
+	Map* drawnMap = 0;
+	View drawnView = {};
+	RenderState drawnState = {};
+	bool showProfile = false;
+	bool showMemory = false;
 
+	while (isRunning) {
 		mouseClick = false;
 		escapePressed = false;
 		pagedownPressed = false;
 		pageupPressed = false;
 
-		while (SDL_PollEvent(&event)) {
+		// Sleep until something happens. While a map is decoding in the
+		// background keep waking up to check on it. Continuous mode never
+		// sleeps and redraws every frame.
+		bool haveEvent;
+
+		if (continuous) {
+			haveEvent = SDL_PollEvent(&event);
+		}
+		else if (pendingMapIndex != -1) {
+			haveEvent = SDL_WaitEventTimeout(&event, 10);
+		}
+		else {
+			haveEvent = SDL_WaitEvent(&event);
+		}
+
+		// Time spent asleep waiting isn't part of the frame
+		beginProfileFrame();
+		u64 eventsStart = SDL_GetPerformanceCounter();
+
+		for (; haveEvent; haveEvent = SDL_PollEvent(&event)) {
 			switch (event.type) {
 				case SDL_QUIT: {
 					isRunning = false;
@@ -130,18 +274,29 @@ int main(int argc, char** argv) {
 					else if (event.key.keysym.sym == SDLK_PAGEUP) {
 						pageupPressed = true;
 					}
+					else if (event.key.keysym.sym == SDLK_F3) {
+						showProfile = !showProfile;
+						redrawAll = true;
+					}
+					else if (event.key.keysym.sym == SDLK_F4) {
+						showMemory = !showMemory;
+						redrawAll = true;
+					}
 				} break;
 				case SDL_MOUSEBUTTONDOWN: {
 					if (event.button.button == SDL_BUTTON_LEFT) {
 						mouseClick = true;
 					}
 				} break;
+				case SDL_WINDOWEVENT: {
+					if (event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+						redrawAll = true;
+					}
+				} break;
 			}
 		}
 
-		if(SDL_LockSurface(screen) != 0) {
-			fatalError("Failed to lock surface");
-		}
+		recordProfileStage(ProfileStage::Events, eventsStart, SDL_GetPerformanceCounter());
 
 		if (mapLoad.result == MapResult::Success) {
 			auto map = mapLoad.map;
@@ -155,7 +310,7 @@ int main(int argc, char** argv) {
 			renderState.highlightedSide = pointOnLineSide(worldx, worldy, mapLoad.map->nodes[renderState.selectedNode]);
 
 			if (mouseClick) {
-				i16 newNode = map->nodes[renderState.selectedNode].children[renderState.highlightedSide];
+				i32 newNode = map->nodes[renderState.selectedNode].children[renderState.highlightedSide];
 
 				if (!(newNode & SubsectorChildFlag)) {
 					renderState.selectedNode = newNode;
@@ -177,64 +332,65 @@ int main(int argc, char** argv) {
 				renderState.highlightedSide = pointOnLineSide(worldx, worldy, map->nodes[renderState.selectedNode]);
 			}
 			else if (pagedownPressed) {
-				mapIndex = (mapIndex + 1) % mapLumps.length;
-				MapLoad mapLoad = loadMap(mapLumps[mapIndex]);
+				i32 from = pendingMapIndex == -1 ? mapIndex : pendingMapIndex;
+				pendingMapIndex = (from + 1) % mapLumps.length;
+			}
+			else if (pageupPressed) {
+				i32 from = pendingMapIndex == -1 ? mapIndex : pendingMapIndex;
+				pendingMapIndex = from == 0 ? mapLumps.length - 1 : from - 1;
+			}
 
-				if (mapLoad.result != MapResult::Success) continue;
+			// Keep showing the current map until the one asked for has been
+			// decoded in the background
+			if (pendingMapIndex != -1) {
+				const MapLoad* pendingLoad = getCachedMap(pendingMapIndex);
 
-				map = mapLoad.map;
-				renderState.selectedNode = map->nodes.length - 1;
-				view = calculateView(map, drawContext, renderState.selectedNode);
+				if (pendingLoad && pendingLoad->result != MapResult::Success) {
+					logWarning("Failed to load map %i", pendingMapIndex);
+					pendingMapIndex = -1;
+				}
+				else if (pendingLoad) {
+					mapIndex = pendingMapIndex;
+					pendingMapIndex = -1;
+					setCurrentMap(mapIndex);
+
+					mapLoad = *pendingLoad;
+					map = mapLoad.map;
+					renderState.selectedNode = map->nodes.length - 1;
+					view = calculateView(map, drawContext, renderState.selectedNode);
 
-				f32 worldx = (x - drawContext.xcenter - view.offset.x) / view.zoom;
-				f32 worldy = (drawContext.ycenter - y + view.offset.y) / view.zoom;
+					f32 worldx = (x - drawContext.xcenter - view.offset.x) / view.zoom;
+					f32 worldy = (drawContext.ycenter - y + view.offset.y) / view.zoom;
 
-				renderState.highlightedSide = pointOnLineSide(worldx, worldy, map->nodes[renderState.selectedNode]);
+					renderState.highlightedSide = pointOnLineSide(worldx, worldy, map->nodes[renderState.selectedNode]);
+				}
 			}
-			else if (pageupPressed) {
-				mapIndex = mapIndex == 0 ? mapLumps.length - 1 : mapIndex - 1;
-				MapLoad mapLoad = loadMap(mapLumps[mapIndex]);
 
-				if (mapLoad.result != MapResult::Success) continue;
+			bool viewChanged = view.offset.x != drawnView.offset.x || view.offset.y != drawnView.offset.y || view.zoom != drawnView.zoom;
 
-				map = mapLoad.map;
-				renderState.selectedNode = map->nodes.length - 1;
-				view = calculateView(map, drawContext, renderState.selectedNode);
-
-				f32 worldx = (x - drawContext.xcenter - view.offset.x) / view.zoom;
-				f32 worldy = (drawContext.ycenter - y + view.offset.y) / view.zoom;
+			if (continuous || redrawAll || map != drawnMap || viewChanged || renderState.selectedNode != drawnState.selectedNode) {
+				drawFrame(screen, drawContext, map, view, renderState, fullClipRect(drawContext), showProfile, showMemory);
+				endProfileFrame();
+			}
+			else if (renderState.highlightedSide != drawnState.highlightedSide) {
+				ClipRect dirty = calculateNodeRect(map, view, drawContext, renderState.selectedNode);
 
-				renderState.highlightedSide = pointOnLineSide(worldx, worldy, map->nodes[renderState.selectedNode]);
+				if (dirty.x2 > dirty.x1 && dirty.y2 > dirty.y1) {
+					drawFrame(screen, drawContext, map, view, renderState, dirty, showProfile, showMemory);
+					endProfileFrame();
+				}
 			}
 
-			renderMap(map, view, drawContext, renderState);
+			redrawAll = false;
+			drawnMap = map;
+			drawnView = view;
+			drawnState = renderState;
 		}
 		else {
 			// Show error to user?
 		}
 
-		SDL_UnlockSurface(screen);
-		SDL_UpdateWindowSurface(window);
-
 		resetArena(temporary);
-
-		times[tick % timeSamples] = SDL_GetPerformanceCounter() - frameStart;
-
-		if (tick % timeSamples == timeSamples - 1) {
-			f64 totalTicks = 0;
-			for (int i = 0; i < timeSamples; ++i) {
-				totalTicks += times[i];
-			}
-
-			/*if (keyboard_state[SDL_SCANCODE_SPACE]) {
-				f64 avgFrameTime = ((f64)totalTicks / timeSamples) * 1000;
-				f64 avgMilliseconds = avgFrameTime / counterFreq;
-				f64 avgFPS = 1000.0 / avgMilliseconds;
-				logMessage("Average MS: %f (%f FPS)", avgFrameTime / counterFreq, avgFPS);
-			}*/
-		}
-
-		++tick;
 	}
 
 	SDL_DestroyWindow(window);
@@ -242,5 +398,10 @@ int main(int argc, char** argv) {
 
 	reportMemoryStats();
 
+	if (traceFile) {
+		if (writeProfileTrace(traceFile)) logMessage("Wrote trace to %s", traceFile);
+		else logError("Failed to write trace to %s", traceFile);
+	}
+
 	return 0;
 }
@@ -1,70 +1,464 @@
 #include "map.h"
+#include "mapformat.h"
+#include "convert.h"
 #include "wad.h"
 #include "system.h"
 #include "memory.h"
+#include "jobs.h"
+#include "extnodes.h"
+#include "lod.h"
+#include "profiler.h"
+#include "memtrace.h"
 
 #include "string.h"
+#include "stdio.h"
 #include "math.h"
 
+#include <atomic>
 
-struct MapSector {
-	i16 floorheight, ceilingheight;
-	i8  floorpic[8], ceilingpic[8];
 
-	i16 lightlevel;
-	i16 special;
-	i16 tag;
-};
+// Each slice can need padding up to the alignment before it
+static usize sliceBytes(usize elementSize, usize count) {
+	return elementSize * count + MAP_SLICE_ALIGNMENT;
+}
 
-struct MapVertex {
-	i16 x, y;
-};
 
-struct MapSideDef {
-	i16 xoffset, yoffset;
-	i8 topTexture[8], bottomTexture[8], midTexture[8];
-	i16 sector;
-};
+static usize baseMemoryRequired(const MapEntry& entry) {
+	usize result = sliceBytes(sizeof(Map), 1);
+
+	result += sliceBytes(sizeof(Sector),    entry.lumpSizes[(int)MapLumps::Sectors]    / sizeof(MapSector));
+	result += sliceBytes(sizeof(Vertex),    entry.lumpSizes[(int)MapLumps::Vertexes]   / sizeof(MapVertex));
+	result += sliceBytes(sizeof(SideDef),   entry.lumpSizes[(int)MapLumps::Sidedefs]   / sizeof(MapSideDef));
+	result += sliceBytes(sizeof(LineDef),   entry.lumpSizes[(int)MapLumps::Linedefs]   / sizeof(MapLine));
+
+	return result;
+}
+
+
+static usize vanillaNodesMemoryRequired(const MapEntry& entry) {
+	usize result = 0;
+
+	result += sliceBytes(sizeof(Seg),       entry.lumpSizes[(int)MapLumps::Segs]       / sizeof(MapSeg));
+	result += sliceBytes(sizeof(SubSector), entry.lumpSizes[(int)MapLumps::SubSectors] / sizeof(MapSubsector));
+	result += sliceBytes(sizeof(Node),      entry.lumpSizes[(int)MapLumps::Nodes]      / sizeof(MapNode));
+
+	return result;
+}
+
 
-struct MapLine {
-	i16 v1, v2;
-	i16 flags;
-	i16 special, tag;
-	i16 sidenum[2];
+// Arenas only reserve address space for what they might need, so extended
+// nodes get room for the most their stream could hold rather than inflating
+// it to count them on whichever thread asks. Compressed streams could in
+// theory hold far more than any map needs, so the room is capped.
+const usize MAP_RESERVE_LIMIT = sizeof(void*) == 8 ? GIGABYTES((usize)4) : MEGABYTES((usize)256);
+
+usize mapMemoryRequired(const MapEntry& entry) {
+	usize result = baseMemoryRequired(entry);
+
+	ExtendedNodeCounts limits;
+	if (!extendedNodeLimits(entry.lump, &limits)) {
+		usize numSegs = entry.lumpSizes[(int)MapLumps::Segs] / sizeof(MapSeg);
+
+		return result + vanillaNodesMemoryRequired(entry) + lodMemoryRequired(numSegs);
+	}
+
+	result += sizeof(Vertex) * (u64)limits.newVertexes;
+	result += sliceBytes(sizeof(SubSector), limits.subsectors);
+	result += sliceBytes(sizeof(Seg),       limits.segs);
+	result += sliceBytes(sizeof(Node),      limits.nodes);
+	result += lodMemoryRequired(limits.segs);
+
+	return result < MAP_RESERVE_LIMIT ? result : MAP_RESERVE_LIMIT;
+}
+
+
+// Decoding runs as a small dependency graph on the job system. Sectors,
+// vertexes, sides, lines and nodes only read their own lump, segs need
+// vertexes, lines and sides, and subsectors need segs. Every lump is also
+// split into chunks so big maps spread across all the workers. Extended nodes
+// are read from their stream on the calling thread while the first stage
+// runs, then only need their segs and subsectors resolved.
+struct MapDecode {
+	Map*                map;
+	Slice<MapSector>    mapSectors;
+	Slice<MapVertex>    mapVertexes;
+	Slice<MapSideDef>   mapSides;
+	Slice<MapLine>      mapLines;
+	Slice<MapSeg>       mapSegs;
+	Slice<MapSubsector> mapSubSectors;
+	Slice<MapNode>      mapNodes;
+	bool                extendedNodes;
+	std::atomic<bool>   failed;
 };
 
-struct MapSubsector {
-	i16 numSegs;
-	i16 firstSeg;
+typedef void DecodeFunction(MapDecode& decode, usize first, usize last);
+
+struct DecodeJob {
+	DecodeFunction* function;
+	MapDecode*      decode;
+	usize           first;
+	usize           last;
 };
 
-struct MapSeg {
-	i16 v1, v2;
-	i16 angle;
-	i16 linedef;
-	i16 side;
-	i16 xoffset;
+const usize DECODE_CHUNK_SIZE = 4096;
+const usize DECODE_CHUNKS_PER_LUMP = 32;
+const i32 MAX_DECODE_JOBS = DECODE_CHUNKS_PER_LUMP * 7;
+
+struct DecodeJobs {
+	DecodeJob jobs[MAX_DECODE_JOBS];
+	i32       count;
 };
 
-struct MapNode {
-	i16 x, y;
-	i16 dx, dy;
-	i16 bbox[2][4];
-	i16 children[2];
+
+static void decodeSectors(MapDecode& decode, usize first, usize last) {
+	for (usize i = first; i < last; ++i) {
+		Sector*    sec    = decode.map->sectors.data + i;
+		MapSector* mapsec = decode.mapSectors.data + i;
+
+		sec->ceilingheight = mapsec->ceilingheight;
+		sec->floorheight = mapsec->floorheight;
+		sec->floortex = -1;
+		sec->ceilingtex = -1;
+		sec->special = mapsec->special;
+		sec->tag = mapsec->tag;
+	}
+}
+
+
+static void decodeVertexes(MapDecode& decode, usize first, usize last) {
+	convertVertexes(decode.map->vertexes.data + first, decode.mapVertexes.data + first, last - first);
+}
+
+
+static void decodeSides(MapDecode& decode, usize first, usize last) {
+	for (usize i = first; i < last; ++i) {
+		MapSideDef* mapside = decode.mapSides.data + i;
+		SideDef*    side = decode.map->sides.data + i;
+
+		side->xoffset = mapside->xoffset;
+		side->yoffset = mapside->yoffset;
+		side->sector = mapside->sector;
+		side->topTexture = -1;
+		side->bottomTexture = -1;
+		side->midTexture = -1;
+	}
+}
+
+
+static void decodeLines(MapDecode& decode, usize first, usize last) {
+	for (usize i = first; i < last; ++i) {
+		MapLine* ml = decode.mapLines.data + i;
+		LineDef* l  = decode.map->lines.data + i;
+
+		l->v1 = ml->v1;
+		l->v2 = ml->v2;
+		l->special = ml->special;
+		l->flags = ml->flags;
+		l->tag = ml->tag;
+		l->sidenum[0] = ml->sidenum[0] == MapNoSide ? -1 : ml->sidenum[0];
+		l->sidenum[1] = ml->sidenum[1] == MapNoSide ? -1 : ml->sidenum[1];
+	}
+}
+
+
+// Fills in everything about a seg that comes from its line
+static void resolveSegs(MapDecode& decode, usize first, usize last) {
+	Map* map = decode.map;
+
+	for (usize i = first; i < last; ++i) {
+		Seg *s = map->segs.data + i;
+
+		if ((usize)s->v1 >= map->vertexes.length || (usize)s->v2 >= map->vertexes.length) {
+			logWarning("Seg %i vertex out of range", i);
+			decode.failed = true;
+			return;
+		}
+
+		if (s->linedef < 0) {
+			s->frontsector = -1;
+			s->backsector = -1;
+			continue;
+		}
+
+		if (s->side < 0 || s->side > 1) {
+			logWarning("Seg %i side out of range (value: %i)", i, s->side);
+			decode.failed = true;
+			return;
+		}
+
+		if ((usize)s->linedef >= map->lines.length || map->lines[s->linedef].sidenum[s->side] < 0) {
+			logWarning("Seg %i line out of range (value: %i)", i, s->linedef);
+			decode.failed = true;
+			return;
+		}
+
+		LineDef* line = map->lines.data + s->linedef;
+
+		s->frontsector = map->sides[line->sidenum[s->side]].sector;
+		if (line->flags & (i32)LineFlags::TwoSided && line->sidenum[s->side ^ 1] != -1) {
+			s->backsector = map->sides[line->sidenum[s->side ^ 1]].sector;
+		}
+		else {
+			s->backsector = -1;
+		}
+
+		// Extended segs have no offset, it is the distance along the line
+		if (decode.extendedNodes) {
+			const Vertex& start = map->vertexes[s->side ? line->v2 : line->v1];
+			const Vertex& v1 = map->vertexes[s->v1];
+
+			f32 dx = v1.x - start.x;
+			f32 dy = v1.y - start.y;
+			s->xoffset = sqrtf(dx * dx + dy * dy);
+		}
+	}
+
+	computeSegLengths(map->segs.data + first, last - first, map->vertexes.data);
+}
+
+
+static void decodeSegs(MapDecode& decode, usize first, usize last) {
+	Map* map = decode.map;
+
+	for (usize i = first; i < last; ++i) {
+		MapSeg *ms = decode.mapSegs.data + i;
+		Seg *s = map->segs.data + i;
+
+		s->v1 = ms->v1;
+		s->v2 = ms->v2;
+		s->xoffset = ms->xoffset;
+		s->linedef = ms->linedef;
+		s->side = ms->side;
+	}
+
+	resolveSegs(decode, first, last);
+}
+
+
+// Gl subsectors can start with a miniseg, so the sector comes from the first
+// seg that has a line
+static void resolveSubSectors(MapDecode& decode, usize first, usize last) {
+	Map* map = decode.map;
+
+	for (usize i = first; i < last; ++i) {
+		SubSector *ssec = map->subsectors.data + i;
+
+		if (ssec->firstseg < 0 || ssec->numsegs < 0 || (usize)ssec->firstseg + ssec->numsegs > map->segs.length) {
+			logWarning("Subsector %i segs out of range", i);
+			decode.failed = true;
+			return;
+		}
+
+		ssec->sector = -1;
+
+		for (i32 s = 0; s < ssec->numsegs && ssec->sector == -1; ++s) {
+			ssec->sector = map->segs[ssec->firstseg + s].frontsector;
+		}
+	}
+}
+
+
+static void decodeSubSectors(MapDecode& decode, usize first, usize last) {
+	Map* map = decode.map;
+
+	for (usize i = first; i < last; ++i) {
+		SubSector *ssec = map->subsectors.data + i;
+		MapSubsector *mssec = decode.mapSubSectors.data + i;
+
+		ssec->firstseg = mssec->firstSeg;
+		ssec->numsegs = mssec->numSegs;
+	}
+
+	resolveSubSectors(decode, first, last);
+}
+
+
+static void decodeNodes(MapDecode& decode, usize first, usize last) {
+	convertNodes(decode.map->nodes.data + first, decode.mapNodes.data + first, last - first);
+}
+
+
+static void decodeJob(void* data) {
+	auto job = (DecodeJob*)data;
+
+	ProfileScope profile(ProfileStage::Decode);
+	job->function(*job->decode, job->first, job->last);
+}
+
+
+static void addDecodeJobs(DecodeJobs& jobs, JobGroup* group, DecodeFunction* function, MapDecode* decode, usize count) {
+	usize chunk = (count + DECODE_CHUNKS_PER_LUMP - 1) / DECODE_CHUNKS_PER_LUMP;
+	if (chunk < DECODE_CHUNK_SIZE) chunk = DECODE_CHUNK_SIZE;
+
+	for (usize first = 0; first < count; first += chunk) {
+		DecodeJob* job = jobs.jobs + jobs.count++;
+
+		job->function = function;
+		job->decode = decode;
+		job->first = first;
+		job->last = first + chunk < count ? first + chunk : count;
+
+		addJob(group, decodeJob, job);
+	}
+}
+
+
+// Looks up one of the map's lumps and checks it is the lump expected
+template<typename T>
+static bool findMapLump(LumpNum lumpNum, MapLumps lump, const char* name, Slice<T>& slice) {
+	auto lookup = getLumpByNum(lumpNum, (int)lump);
+	if (lookup.result != WadResult::Success || strncmp(lookup.name, name, 8) != 0) return false;
+
+	slice.data = (T*)lookup.lump.data;
+	slice.length = lookup.lump.length / sizeof(T);
+
+	return true;
+}
+
+
+template<typename T>
+static void allocSlice(MemoryArena* arena, Slice<T>& slice, usize length, const char* tag) {
+	MemoryTag memoryTag("map", tag);
+
+	slice.data = arenaPush<T>(arena, length, MAP_SLICE_ALIGNMENT);
+	slice.length = length;
+}
+
+
+struct LayoutStep {
+	i32 node;
+	i32 side;
+	i32 firstseg;
 };
 
-struct MapThing {
-	i16 x, y;
-	i16 angle;
-	i16 type;
-	i16 options;
+struct DepthFirstLayout {
+	Map*       map;
+	Seg*       segs;
+	SubSector* subsectors;
+	i32*       remap;
+	i32        segCursor;
+	i32        subsectorCursor;
+	bool       valid;
 };
 
 
-MapLoad loadMap(LumpNum lumpNum) {
+static void emitSubsector(DepthFirstLayout& layout, i32 index) {
+	if (index < 0 || (usize)index >= layout.map->subsectors.length || layout.remap[index] != -1) {
+		layout.valid = false;
+		return;
+	}
+
+	SubSector& ssec = layout.subsectors[layout.subsectorCursor];
+	ssec = layout.map->subsectors[index];
+
+	memcpy(layout.segs + layout.segCursor, layout.map->segs.data + ssec.firstseg, sizeof(Seg) * ssec.numsegs);
+	ssec.firstseg = layout.segCursor;
+
+	layout.segCursor += ssec.numsegs;
+	layout.remap[index] = layout.subsectorCursor++;
+}
+
+
+// Rewrites subsectors and segs in the order a depth first walk of the tree
+// reaches them and records each node child's seg range. The new order is
+// built in the thread's scratch memory and only copied back if the tree is
+// sound.
+static bool layoutDepthFirst(Map* map) {
+	usize numNodes = map->nodes.length;
+	usize numSubsectors = map->subsectors.length;
+	usize numSegs = map->segs.length;
+
+	if (numNodes == 0) return false;
+
+	MemoryTag memoryTag("map", "layout");
+	MemoryArena* scratch = threadTemporary();
+	ArenaScope scope(scratch);
+
+	DepthFirstLayout layout = {};
+	layout.map = map;
+	layout.segs = arenaPush<Seg>(scratch, numSegs);
+	layout.subsectors = arenaPush<SubSector>(scratch, numSubsectors);
+	layout.remap = arenaPush<i32>(scratch, numSubsectors);
+	layout.valid = true;
+
+	auto stack = arenaPush<LayoutStep>(scratch, numNodes + 1);
+
+	for (usize i = 0; i < numSubsectors; ++i) layout.remap[i] = -1;
+
+	i32 depth = 1;
+	stack[0] = { (i32)numNodes - 1, 0, 0 };
+
+	while (depth > 0 && layout.valid) {
+		LayoutStep& step = stack[depth - 1];
+		Node& node = map->nodes.data[step.node];
+
+		// Both children done, close off this node's range in its parent
+		if (step.side == 2) {
+			depth--;
+
+			if (depth > 0) {
+				LayoutStep& parent = stack[depth - 1];
+				Node& parentNode = map->nodes.data[parent.node];
+
+				parentNode.firstseg[parent.side] = parent.firstseg;
+				parentNode.numsegs[parent.side] = layout.segCursor - parent.firstseg;
+				parent.side++;
+			}
+
+			continue;
+		}
+
+		step.firstseg = layout.segCursor;
+		i32 child = node.children[step.side];
+
+		if (child & SubsectorChildFlag) {
+			emitSubsector(layout, child & ~SubsectorChildFlag);
+
+			node.firstseg[step.side] = step.firstseg;
+			node.numsegs[step.side] = layout.segCursor - step.firstseg;
+			step.side++;
+		}
+		else if (child < 0 || (usize)child >= numNodes || (usize)depth > numNodes) {
+			layout.valid = false;
+		}
+		else {
+			stack[depth++] = { child, 0, 0 };
+		}
+	}
+
+	// Anything the tree never reaches goes on the end
+	for (usize i = 0; i < numSubsectors && layout.valid; ++i) {
+		if (layout.remap[i] == -1) emitSubsector(layout, (i32)i);
+	}
+
+	if (layout.valid) {
+		memcpy(map->segs.data, layout.segs, sizeof(Seg) * numSegs);
+		memcpy(map->subsectors.data, layout.subsectors, sizeof(SubSector) * numSubsectors);
+
+		for (usize i = 0; i < numNodes; ++i) {
+			Node& node = map->nodes.data[i];
+
+			for (int side = 0; side < 2; ++side) {
+				if (node.children[side] & SubsectorChildFlag) {
+					node.children[side] = layout.remap[node.children[side] & ~SubsectorChildFlag] | SubsectorChildFlag;
+				}
+			}
+		}
+	}
+
+	return layout.valid;
+}
+
+
+MapLoad loadMap(const MapEntry& entry, MemoryArena* arena) {
+	ProfileScope profile(ProfileStage::LoadMap);
+	MemoryTag memoryTag("map");
+
 	MapLoad result = {};
+	LumpNum lumpNum = entry.lump;
 
-	resetArena(level);
+	usize traceMark = memoryTraceMark();
+	resetArena(arena);
 
 	LumpResult mapMarker = getLumpByNum(lumpNum, 0);
 	if(mapMarker.result != WadResult::Success) {
@@ -74,224 +468,289 @@ MapLoad loadMap(LumpNum lumpNum) {
 
 	result.result = MapResult::InvalidMap;
 
-	auto map = (Map*)memoryAlloc(level, sizeof(Map));
-
 	logMessage("Loading map %.8s...", mapMarker.name);
 
-	// Sectors
-	{
-		auto sectors = getLumpByNum(lumpNum, (int)MapLumps::Sectors);
-		if (sectors.result == WadResult::Failure || strncmp(sectors.name, "SECTORS", 8) != 0) return result;
-
-		Slice<MapSector> mapSectors;
-		mapSectors.data = (MapSector*)sectors.lump.data;
-		mapSectors.length = sectors.lump.length / sizeof(MapSector);
-
-		map->sectors.data = (Sector*)memoryAlloc(level, sizeof(Sector) * mapSectors.length);
-		map->sectors.length = mapSectors.length;
-
-		for (int i = 0; i < mapSectors.length; ++i) {
-			Sector*    sec    = map->sectors.data + i;
-			MapSector* mapsec = mapSectors.data + i;
-
-			sec->ceilingheight = mapsec->ceilingheight;
-			sec->floorheight = mapsec->floorheight;
-			sec->floortex = -1;
-			sec->ceilingtex = -1;
-			sec->special = mapsec->special;
-			sec->tag = mapsec->tag;
+	MapDecode decode = {};
+
+	if (!findMapLump(lumpNum, MapLumps::Sectors,    "SECTORS",  decode.mapSectors))    return result;
+	if (!findMapLump(lumpNum, MapLumps::Vertexes,   "VERTEXES", decode.mapVertexes))   return result;
+	if (!findMapLump(lumpNum, MapLumps::Sidedefs,   "SIDEDEFS", decode.mapSides))      return result;
+	if (!findMapLump(lumpNum, MapLumps::Linedefs,   "LINEDEFS", decode.mapLines))      return result;
+	if (!findMapLump(lumpNum, MapLumps::Segs,       "SEGS\0",   decode.mapSegs))       return result;
+	if (!findMapLump(lumpNum, MapLumps::SubSectors, "SSECTORS", decode.mapSubSectors)) return result;
+	if (!findMapLump(lumpNum, MapLumps::Nodes,      "NODES",    decode.mapNodes))      return result;
+
+	// The stream's own allocations are checked as they happen, only the
+	// vertexes it adds need to be known up front
+	ExtendedNodeReader reader;
+	ExtendedNodeCounts counts = {};
+	usize required = baseMemoryRequired(entry);
+
+	decode.extendedNodes = openExtendedNodes(&reader, lumpNum);
+
+	if (decode.extendedNodes) {
+		logMessage("\tUsing %s nodes", nodeFormatName(reader.format));
+
+		if (!readExtendedVertexCounts(&reader, &counts) || counts.originalVertexes > decode.mapVertexes.length) {
+			logWarning("%s nodes do not match the VERTEXES lump", nodeFormatName(reader.format));
+			closeExtendedNodes(&reader);
+			return result;
 		}
 
-		logMessage("\tLoaded %i sectors", sectors.lump.length);
+		decode.mapVertexes.length = counts.originalVertexes;
+		decode.mapSegs.length = 0;
+		decode.mapSubSectors.length = 0;
+		decode.mapNodes.length = 0;
+
+		required += sizeof(Vertex) * counts.newVertexes;
+	}
+	else {
+		required += vanillaNodesMemoryRequired(entry);
 	}
 
-	// Vertexes
-	{
-		auto vertexesLookup = getLumpByNum(lumpNum, (int)MapLumps::Vertexes);
-		if (vertexesLookup.result == WadResult::Failure || strncmp(vertexesLookup.name, "VERTEXES", 8) != 0) return result;
+	if (required > arenaBytesFree(arena)) {
+		logError("Map needs %i kb of level storage, only %i kb available", required / 1024, arenaBytesFree(arena) / 1024);
+		if (decode.extendedNodes) closeExtendedNodes(&reader);
+		return result;
+	}
 
-		Slice<MapVertex> mapVertexes;
-		mapVertexes.data = (MapVertex*)vertexesLookup.lump.data;
-		mapVertexes.length = vertexesLookup.lump.length / sizeof(MapVertex);
+	// Everything the jobs write is allocated before they start
+	auto map = arenaPush<Map>(arena, 1, MAP_SLICE_ALIGNMENT);
+	decode.map = map;
 
-		map->vertexes.data = (Vertex*)memoryAlloc(level, sizeof(Vertex) * mapVertexes.length);
-		map->vertexes.length = mapVertexes.length;
+	allocSlice(arena, map->sectors,    decode.mapSectors.length, "sectors");
+	allocSlice(arena, map->vertexes,   decode.mapVertexes.length + counts.newVertexes, "vertexes");
+	allocSlice(arena, map->sides,      decode.mapSides.length, "sides");
+	allocSlice(arena, map->lines,      decode.mapLines.length, "lines");
+	allocSlice(arena, map->segs,       decode.mapSegs.length, "segs");
+	allocSlice(arena, map->subsectors, decode.mapSubSectors.length, "subsectors");
+	allocSlice(arena, map->nodes,      decode.mapNodes.length, "nodes");
 
-		for (int i = 0; i < mapVertexes.length; ++i) {
-			Vertex*    v  = map->vertexes.data + i;
-			MapVertex* mv = mapVertexes.data + i;
+	DecodeJobs jobs;
+	jobs.count = 0;
 
-			v->x = mv->x;
-			v->y = mv->y;
-		}
+	JobGroup segInputs = {};
+	JobGroup independent = {};
+
+	addDecodeJobs(jobs, &segInputs,   decodeVertexes, &decode, decode.mapVertexes.length);
+	addDecodeJobs(jobs, &segInputs,   decodeSides,    &decode, map->sides.length);
+	addDecodeJobs(jobs, &segInputs,   decodeLines,    &decode, map->lines.length);
+	addDecodeJobs(jobs, &independent, decodeSectors,  &decode, map->sectors.length);
+	addDecodeJobs(jobs, &independent, decodeNodes,    &decode, map->nodes.length);
 
-		logMessage("\tLoaded %i vertexes", vertexesLookup.lump.length);
+	if (decode.extendedNodes) {
+		ProfileScope extendedProfile(ProfileStage::ExtendedNodes);
+
+		if (!readExtendedNodes(&reader, &counts, map, arena)) decode.failed = true;
+		closeExtendedNodes(&reader);
 	}
 
-	// Sides
-	{
-		auto sidesLookup = getLumpByNum(lumpNum, (int)MapLumps::Sidedefs);
-		if (sidesLookup.result == WadResult::Failure || strncmp(sidesLookup.name, "SIDEDEFS", 8) != 0) return result;
-
-		Slice<MapSideDef> mapSides;
-		mapSides.data = (MapSideDef*)sidesLookup.lump.data;
-		mapSides.length = sidesLookup.lump.length / sizeof(MapSideDef);
-
-		map->sides.data = (SideDef*)memoryAlloc(level, sizeof(SideDef) * mapSides.length);
-		map->sides.length = mapSides.length;
-
-		for (int i = 0; i < mapSides.length; ++i) {
-			MapSideDef* mapside = mapSides.data + i;
-			SideDef*    side = map->sides.data + i;
-
-			side->xoffset = mapside->xoffset;
-			side->yoffset = mapside->yoffset;
-			side->sector = mapside->sector;
-			side->topTexture = -1;
-			side->bottomTexture = -1;
-			side->midTexture = -1;
-		}
+	waitForJobs(&segInputs);
 
-		logMessage("\tLoaded %i sides", sidesLookup.lump.length);
+	if (!decode.failed) {
+		JobGroup segs = {};
+		addDecodeJobs(jobs, &segs, decode.extendedNodes ? resolveSegs : decodeSegs, &decode, map->segs.length);
+		waitForJobs(&segs);
 	}
 
-	// Lines
-	{
-		auto linesLookup = getLumpByNum(lumpNum, (int)MapLumps::Linedefs);
-		if (linesLookup.result == WadResult::Failure || strncmp(linesLookup.name, "LINEDEFS", 8) != 0) return result;
-
-		Slice<MapLine> mapLines;
-		mapLines.data = (MapLine*)linesLookup.lump.data;
-		mapLines.length = linesLookup.lump.length / sizeof(MapLine);
-
-		map->lines.data = (LineDef*)memoryAlloc(level, sizeof(LineDef) * mapLines.length);
-		map->lines.length = mapLines.length;
-
-		for (int i = 0; i < mapLines.length; ++i) {
-			MapLine* ml = mapLines.data + i;
-			LineDef* l  = map->lines.data + i;
-
-			l->v1 = ml->v1;
-			l->v2 = ml->v2;
-			l->special = ml->special;
-			l->flags = ml->flags;
-			l->tag = ml->tag;
-			l->sidenum[0] = ml->sidenum[0];
-			l->sidenum[1] = ml->sidenum[1];
-		}
+	if (!decode.failed) {
+		JobGroup subsectors = {};
+		addDecodeJobs(jobs, &subsectors, decode.extendedNodes ? resolveSubSectors : decodeSubSectors, &decode, map->subsectors.length);
+		waitForJobs(&subsectors);
+	}
+
+	waitForJobs(&independent);
 
-		logMessage("\tLoaded %i lines", linesLookup.lump.length);
+	if (decode.failed) return result;
+
+	u64 layoutStart = getPerformanceCounter();
+	bool laidOut = layoutDepthFirst(map);
+	recordProfileStage(ProfileStage::Layout, layoutStart, getPerformanceCounter());
+
+	if (!laidOut) {
+		logWarning("BSP tree does not cover the map");
+		return result;
 	}
 
-	// Segs
 	{
-		auto segsLookup = getLumpByNum(lumpNum, (int)MapLumps::Segs);
-		if (segsLookup.result != WadResult::Success || strncmp(segsLookup.name, "SEGS\0", 8) != 0) return result;
+		ProfileScope lodProfile(ProfileStage::Lod);
+		buildMapLod(map, arena);
+	}
 
-		Slice<MapSeg> mapSegs;
-		mapSegs.data = (MapSeg*)segsLookup.lump.data;
-		mapSegs.length = segsLookup.lump.length / sizeof(MapSeg);
+	logMessage("\tLoaded %i sectors", map->sectors.length);
+	logMessage("\tLoaded %i vertexes", map->vertexes.length);
+	logMessage("\tLoaded %i sides", map->sides.length);
+	logMessage("\tLoaded %i lines", map->lines.length);
+	logMessage("\tLoaded %i segs", map->segs.length);
+	logMessage("\tLoaded %i subsectors", map->subsectors.length);
+	logMessage("\tLoaded %i nodes", map->nodes.length);
+	logMessage("\tBuilt %i detail levels", map->lodLevels.length);
 
-		map->segs.data = (Seg*)memoryAlloc(level, sizeof(Seg) * mapSegs.length);
-		map->segs.length = mapSegs.length;
+	if (memoryTracing) {
+		char mapName[9] = {};
+		memcpy(mapName, mapMarker.name, 8);
 
-		for (int i = 0; i < mapSegs.length; ++i) {
-			MapSeg *ms = mapSegs.data + i;
-			Seg *s = map->segs.data + i;
+		writeMapMemoryTrace(getWadName(lumpNum), mapName, arena, traceMark);
+	}
 
-			s->v1 = ms->v1;
-			s->v2 = ms->v2;
-			s->xoffset = ms->xoffset;
-			s->linedef = ms->linedef;
-			s->side = ms->side;
+	result.result = MapResult::Success;
+	result.map = map;
 
-			if (s->side < 0 || s->side > 1) {
-				logMessage("Seg %i side out of range (value: %i)", i, s->side);
-				return result;
-			}
+	return result;
+}
 
-			{
-				Vertex *v1, *v2;
-				v1 = map->vertexes.data + s->v1;
-				v2 = map->vertexes.data + s->v2;
 
-				f32 dx = (v2->x - v1->x);
-				f32 dy = (v2->y - v1->y);
+LineKind getLineKind(Map* map, const Seg& seg) {
+	if (seg.backsector == -1) return LineKind::OneSided;
 
-				s->length = sqrtf(dx * dx + dy * dy);
-			}
+	auto frontsector = map->sectors.data + seg.frontsector;
+	auto backsector = map->sectors.data + seg.backsector;
 
-			LineDef* line = map->lines.data + s->linedef;
+	if (frontsector->floorheight != backsector->floorheight) return LineKind::Ledge;
+	if (frontsector->ceilingheight != backsector->ceilingheight) return LineKind::Door;
 
-			s->frontsector = map->sides[line->sidenum[s->side]].sector;
-			if (line->flags & (i32)LineFlags::TwoSided && line->sidenum[s->side ^ 1] != -1) {
-				s->backsector = map->sides[line->sidenum[s->side ^ 1]].sector;
-			}
-			else {
-				s->backsector = -1;
-			}
-		}
+	return LineKind::Unmarked;
+}
 
-		logMessage("\tLoaded %i segs", segsLookup.lump.length);
-	}
 
-	// Subsectors
-	{
-		auto ssecLookup = getLumpByNum(lumpNum, (int)MapLumps::SubSectors);
-		if (ssecLookup.result != WadResult::Success || strncmp(ssecLookup.name, "SSECTORS", 8) != 0) return result;
+// Cache files hold the decoded map exactly as it sits in memory. Each slice is
+// stored as an offset from the start of the file, so once the file is mapped
+// the slices only need pointing at base + offset.
+struct MapCacheSlice {
+	u64 offset;
+	u64 length;
+};
 
-		Slice<MapSubsector> mapSubSectors;
-		mapSubSectors.data = (MapSubsector*)ssecLookup.lump.data;
-		mapSubSectors.length = ssecLookup.lump.length / sizeof(MapSubsector);
+struct MapSliceRef {
+	void** data;
+	usize* length;
+	usize  elementSize;
+};
 
-		map->subsectors.data = (SubSector*)memoryAlloc(level, sizeof(SubSector) * mapSubSectors.length);
-		map->subsectors.length = mapSubSectors.length;
+const i32 MAP_CACHE_SLICES = 9;
 
-		for (int i = 0; i < mapSubSectors.length; ++i) {
-			SubSector *ssec = map->subsectors.data + i;
-			MapSubsector *mssec = mapSubSectors.data + i;
+struct MapCacheHeader {
+	u8            magic[4];
+	u32           version;
+	u64           key;
+	MapCacheSlice slices[MAP_CACHE_SLICES];
+};
 
-			ssec->firstseg = mssec->firstSeg;
-			ssec->numsegs = mssec->numSegs;
+// Bump whenever the layout of the decoded map changes
+static const u32 MAP_CACHE_VERSION = 4;
+static const usize MAP_CACHE_ALIGNMENT = MAP_SLICE_ALIGNMENT;
+
+
+static void getMapSlices(Map* map, MapSliceRef refs[MAP_CACHE_SLICES]) {
+	refs[0] = { (void**)&map->sectors.data,    &map->sectors.length,    sizeof(Sector) };
+	refs[1] = { (void**)&map->vertexes.data,   &map->vertexes.length,   sizeof(Vertex) };
+	refs[2] = { (void**)&map->sides.data,      &map->sides.length,      sizeof(SideDef) };
+	refs[3] = { (void**)&map->lines.data,      &map->lines.length,      sizeof(LineDef) };
+	refs[4] = { (void**)&map->segs.data,       &map->segs.length,       sizeof(Seg) };
+	refs[5] = { (void**)&map->nodes.data,      &map->nodes.length,      sizeof(Node) };
+	refs[6] = { (void**)&map->subsectors.data, &map->subsectors.length, sizeof(SubSector) };
+	refs[7] = { (void**)&map->lodLevels.data,  &map->lodLevels.length,  sizeof(LodLevel) };
+	refs[8] = { (void**)&map->lodLines.data,   &map->lodLines.length,   sizeof(LodLine) };
+}
 
-			Seg* seg = map->segs.data + ssec->firstseg;
-			ssec->sector = seg->frontsector;
-		}
 
-		logMessage("\tLoaded %i subsectors", ssecLookup.lump.length);
+u64 mapCacheKey(const MapEntry& entry) {
+	u64 key = getWadContentKey(entry.lump) ^ ((u64)entry.lump * 0x9E3779B97F4A7C15ull);
+
+	return key ^ ((u64)MAP_CACHE_VERSION << 56);
+}
+
+
+void getMapCacheFileName(const MapEntry& entry, char* buffer, usize size) {
+	LumpResult marker = getLumpByNum(entry.lump);
+
+	snprintf(buffer, size, "%s.%.8s.dnvmap", getWadName(entry.lump), marker.name);
+}
+
+
+bool writeMapCacheFile(Map* map, const char* fileName, u64 key) {
+	MapSliceRef refs[MAP_CACHE_SLICES];
+	getMapSlices(map, refs);
+
+	MapCacheHeader header = {};
+	memcpy(header.magic, "DNVM", 4);
+	header.version = MAP_CACHE_VERSION;
+	header.key = key;
+
+	u64 offset = sizeof(MapCacheHeader);
+
+	for (i32 i = 0; i < MAP_CACHE_SLICES; ++i) {
+		offset = (offset + MAP_CACHE_ALIGNMENT - 1) & ~(u64)(MAP_CACHE_ALIGNMENT - 1);
+
+		header.slices[i].offset = offset;
+		header.slices[i].length = *refs[i].length;
+
+		offset += *refs[i].length * refs[i].elementSize;
 	}
 
-	// Nodes
-	{
-		auto nodesLookup = getLumpByNum(lumpNum, (int)MapLumps::Nodes);
-		if (nodesLookup.result != WadResult::Success || strncmp(nodesLookup.name, "NODES", 8) != 0) return result;
+	FILE* f;
+	if (fopen_s(&f, fileName, "wb") != 0) return false;
 
-		Slice<MapNode> mapNodes;
-		mapNodes.data = (MapNode*)nodesLookup.lump.data;
-		mapNodes.length = nodesLookup.lump.length / sizeof(MapNode);
+	bool success = fwrite(&header, sizeof(header), 1, f) == 1;
+	u64 written = sizeof(header);
 
-		map->nodes.data = (Node*)memoryAlloc(level, sizeof(Node) * mapNodes.length);
-		map->nodes.length = mapNodes.length;
+	for (i32 i = 0; i < MAP_CACHE_SLICES && success; ++i) {
+		static const u8 padding[MAP_CACHE_ALIGNMENT] = {};
 
-		for (int i = 0; i < mapNodes.length; ++i) {
-			MapNode* mn = mapNodes.data + i;
-			Node*    n = map->nodes.data + i;
+		usize padSize = header.slices[i].offset - written;
+		usize size = *refs[i].length * refs[i].elementSize;
 
-			n->x = (f32)mn->x;
-			n->y = (f32)mn->y;
-			n->dx = (f32)mn->dx;
-			n->dy = (f32)mn->dy;
+		success = fwrite(padding, 1, padSize, f) == padSize
+			&& fwrite(*refs[i].data, 1, size, f) == size;
 
-			for (int j = 0; j < 2; ++j) {
-				n->children[j] = mn->children[j];
+		written += padSize + size;
+	}
 
-				for (int k = 0; k < 4; ++k) {
-					n->bbox[j][k] = (f32)mn->bbox[j][k];
-				}
-			}
+	fclose(f);
+
+	if (!success) remove(fileName);
+
+	return success;
+}
+
+
+MapLoad loadMapCacheFile(const char* fileName, u64 key, MemoryArena* arena, MappedFile* mapping) {
+	MapLoad result = {};
+	result.result = MapResult::NotFound;
+
+	if (!mapFile(fileName, mapping)) return result;
+
+	result.result = MapResult::InvalidMap;
+
+	auto header = (MapCacheHeader*)mapping->data;
+
+	bool valid = mapping->size >= sizeof(MapCacheHeader)
+		&& memcmp(header->magic, "DNVM", 4) == 0
+		&& header->version == MAP_CACHE_VERSION
+		&& header->key == key;
+
+	if (!valid) {
+		unmapFile(mapping);
+		return result;
+	}
+
+	resetArena(arena);
+
+	auto map = arenaPush<Map>(arena, 1, MAP_SLICE_ALIGNMENT);
+
+	MapSliceRef refs[MAP_CACHE_SLICES];
+	getMapSlices(map, refs);
+
+	for (i32 i = 0; i < MAP_CACHE_SLICES; ++i) {
+		auto& slice = header->slices[i];
+
+		if (slice.offset > mapping->size || slice.length > (mapping->size - slice.offset) / refs[i].elementSize) {
+			unmapFile(mapping);
+			return result;
 		}
 
-		logMessage("\tLoaded %i nodes", nodesLookup.lump.length);
+		*refs[i].data = mapping->data + slice.offset;
+		*refs[i].length = slice.length;
 	}
 
 	result.result = MapResult::Success;
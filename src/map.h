@@ -1,6 +1,9 @@
 #pragma once
 
 #include "types.h"
+#include "wad.h"
+#include "memory.h"
+#include "system.h"
 
 enum class MapResult {
 	Success,
@@ -27,10 +30,10 @@ struct SideDef {
 };
 
 struct LineDef {
-	i16 v1, v2;
+	i32 v1, v2;
 	i16 flags;
 	i16 special, tag;
-	i16 sidenum[2];
+	i32 sidenum[2];
 };
 enum class LineFlags {
 	Blocking = 0x1,
@@ -44,16 +47,18 @@ enum class LineFlags {
 	Mapped = 0x100
 };
 
+// Minisegs from gl nodes have no linedef and are never drawn
 struct Seg {
-	i16 v1, v2;
+	i32 v1, v2;
 	f32 length, xoffset;
-	i16 linedef, side;
+	i32 linedef;
+	i16 side;
 	i16 frontsector, backsector;
 };
 
 struct SubSector {
 	i16 sector;
-	i16 firstseg, numsegs;
+	i32 firstseg, numsegs;
 };
 
 const i32 BoxTop = 0;
@@ -61,13 +66,36 @@ const i32 BoxBottom = 1;
 const i32 BoxLeft = 2;
 const i32 BoxRight = 3;
 
-const i16 SubsectorChildFlag = 0x8000;
+// Children are stored with 32 bit indices whatever the node format was,
+// vanilla children get their 0x8000 flag moved up to the top bit
+const i32 SubsectorChildFlag = (i32)0x80000000;
+// Segs are laid out depth first once a map is loaded, so everything under
+// each child is the contiguous run [firstseg, firstseg + numsegs)
 struct Node {
 	f32 x, y, dx, dy;
 	f32 bbox[2][4];
-	i16 children[2];
+	i32 children[2];
+	i32 firstseg[2], numsegs[2];
 };
 
+// Simplified stand-in for a run of segs in a zoomed out view, built by
+// lod.cpp. seg is the first seg it covers, which also gives its colour, so a
+// level's lines are in seg order.
+struct LodLine {
+	i32 v1, v2;
+	i32 seg;
+};
+
+// Lines may be up to tolerance map units away from the segs they replace
+struct LodLevel {
+	f32 tolerance;
+	i32 firstline, numlines;
+};
+
+// Every slice of a loaded map starts on this boundary, so simd kernels can
+// use aligned loads. Cached maps are written with the same alignment.
+const usize MAP_SLICE_ALIGNMENT = 16;
+
 struct Map {
 	Slice<Sector> sectors;
 	Slice<Vertex> vertexes;
@@ -76,11 +104,39 @@ struct Map {
 	Slice<Seg> segs;
 	Slice<Node> nodes;
 	Slice<SubSector> subsectors;
+	// Coarsest level first, all of the levels' lines share one slice
+	Slice<LodLevel> lodLevels;
+	Slice<LodLine> lodLines;
 };
 
+// How a seg shows up on the automap
+enum class LineKind {
+	OneSided,
+	Ledge,
+	Door,
+	Unmarked
+};
+
+LineKind getLineKind(Map* map, const Seg& seg);
+
 struct MapLoad {
 	MapResult result;
 	Map* map;
 };
 
-MapLoad loadMap(LumpNum lumpNum);
+// Level storage needed to decode the map, worked out from the lump sizes in
+// the catalog so it can be reserved before loading starts
+usize mapMemoryRequired(const MapEntry& entry);
+// Resets the arena and decodes the map into it
+MapLoad loadMap(const MapEntry& entry, MemoryArena* arena);
+
+
+// Decoded maps can be written out to a cache file and mapped straight back in
+// later without any conversion. The key ties the file to the exact wad and map
+// it was built from.
+u64 mapCacheKey(const MapEntry& entry);
+void getMapCacheFileName(const MapEntry& entry, char* buffer, usize size);
+bool writeMapCacheFile(Map* map, const char* fileName, u64 key);
+// The map's slices point into the mapping, so it has to stay mapped for as
+// long as the map is in use
+MapLoad loadMapCacheFile(const char* fileName, u64 key, MemoryArena* arena, MappedFile* mapping);
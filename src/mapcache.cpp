@@ -0,0 +1,250 @@
+#include "mapcache.h"
+#include "memory.h"
+#include "system.h"
+#include "jobs.h"
+
+#include <atomic>
+#include <thread>
+
+#include <stdlib.h>
+
+enum class SlotState {
+	Empty,
+	Loading,
+	Ready
+};
+
+struct MapSlot {
+	MemoryArena*           arena;
+	i32                    mapIndex;
+	u64                    lastUsed;
+	std::atomic<SlotState> state;
+	MapLoad                load;
+	MappedFile             mapping;
+	// What the map takes up, set by its load job before it is ready. Maps from
+	// cache files count their mapping too.
+	usize                  bytes;
+};
+
+
+const i32 MAX_CACHED_MAPS = 64;
+
+static Array<MapEntry> cachedMaps = {};
+static MapSlot         slots[MAX_CACHED_MAPS];
+static i32             currentMap = -1;
+
+static usize           budget = 0;
+static u64             useCounter = 0;
+static bool            useCacheFiles = false;
+
+// Never waited on, prefetches just run whenever a worker is free
+static JobGroup        prefetchJobs = {};
+
+
+void initMapCache(Array<MapEntry> maps, usize memoryBudget, bool cacheFiles) {
+	cachedMaps = maps;
+	useCacheFiles = cacheFiles;
+	currentMap = -1;
+	budget = memoryBudget;
+
+	for (i32 i = 0; i < MAX_CACHED_MAPS; ++i) {
+		slots[i].arena = 0;
+		slots[i].mapIndex = -1;
+		slots[i].lastUsed = 0;
+		slots[i].state = SlotState::Empty;
+		slots[i].load = {};
+		slots[i].mapping = {};
+		slots[i].bytes = 0;
+	}
+}
+
+
+// A map read from its cache file points straight into the mapping, so its
+// arena only has to hold the Map itself
+const usize CACHE_FILE_ARENA_SIZE = KILOBYTES(4);
+
+// The arena is only made once it is known where the map is coming from
+static void loadMapJob(void* data) {
+	auto slot = (MapSlot*)data;
+	auto& entry = cachedMaps.data[slot->mapIndex];
+
+	char fileName[1024];
+	u64 key = 0;
+	bool cached = false;
+
+	if (useCacheFiles) {
+		getMapCacheFileName(entry, fileName, sizeof(fileName));
+		key = mapCacheKey(entry);
+
+		slot->arena = createArena(CACHE_FILE_ARENA_SIZE, "map");
+		slot->load = loadMapCacheFile(fileName, key, slot->arena, &slot->mapping);
+
+		cached = slot->load.result == MapResult::Success;
+		if (!cached) destroyArena(slot->arena);
+	}
+
+	if (cached) {
+		slot->bytes = arenaBytesUsed(slot->arena) + slot->mapping.size;
+	}
+	else {
+		slot->arena = createArena(mapMemoryRequired(entry) + KILOBYTES(4), "map");
+		slot->load = loadMap(entry, slot->arena);
+
+		if (useCacheFiles && slot->load.result == MapResult::Success) {
+			writeMapCacheFile(slot->load.map, fileName, key);
+		}
+
+		slot->bytes = arenaBytesUsed(slot->arena);
+	}
+
+	slot->state.store(SlotState::Ready, std::memory_order_release);
+}
+
+
+static MapSlot* findSlot(i32 mapIndex) {
+	for (i32 i = 0; i < MAX_CACHED_MAPS; ++i) {
+		if (slots[i].state.load(std::memory_order_relaxed) != SlotState::Empty && slots[i].mapIndex == mapIndex) {
+			return slots + i;
+		}
+	}
+
+	return 0;
+}
+
+
+// Least recently used map that can be thrown away. The map on screen and maps
+// still being decoded by a job are off limits.
+static MapSlot* findEvictableSlot() {
+	MapSlot* result = 0;
+
+	for (i32 i = 0; i < MAX_CACHED_MAPS; ++i) {
+		MapSlot* slot = slots + i;
+
+		if (slot->state.load(std::memory_order_acquire) != SlotState::Ready) continue;
+		if (slot->mapIndex == currentMap) continue;
+
+		if (!result || slot->lastUsed < result->lastUsed) {
+			result = slot;
+		}
+	}
+
+	return result;
+}
+
+
+// Arenas are only sized for the most a map might need, so the budget counts
+// what the maps that have finished loading really use
+static usize cacheBytesUsed() {
+	usize result = 0;
+
+	for (i32 i = 0; i < MAX_CACHED_MAPS; ++i) {
+		if (slots[i].state.load(std::memory_order_acquire) == SlotState::Ready) result += slots[i].bytes;
+	}
+
+	return result;
+}
+
+
+static void evictSlot(MapSlot* slot) {
+	destroyArena(slot->arena);
+	unmapFile(&slot->mapping);
+
+	slot->arena = 0;
+	slot->mapIndex = -1;
+	slot->load = {};
+	slot->bytes = 0;
+	slot->state.store(SlotState::Empty, std::memory_order_relaxed);
+}
+
+
+// Prefetches give up when the budget is full, a map that has been asked for
+// to go on screen always gets a slot
+static MapSlot* requestMap(i32 mapIndex, bool prefetch) {
+	MapSlot* slot = findSlot(mapIndex);
+
+	if (slot) {
+		slot->lastUsed = ++useCounter;
+		return slot;
+	}
+
+	auto& entry = cachedMaps.data[mapIndex];
+
+	// A decoded map is bigger than its lumps, so they are the least room it
+	// will need. What it really uses is counted once it has loaded.
+	usize expected = 0;
+	for (i32 l = 0; l < (i32)MapLumps::Count; ++l) expected += entry.lumpSizes[l];
+
+	// Make room within the budget, though a map is always allowed to load if
+	// nothing else can be evicted, even if it is larger than the budget alone
+	usize used = cacheBytesUsed();
+
+	while (used + expected > budget) {
+		MapSlot* victim = findEvictableSlot();
+		if (!victim) break;
+
+		evictSlot(victim);
+		used = cacheBytesUsed();
+	}
+
+	if (prefetch && used + expected > budget && used > 0) return 0;
+
+	for (i32 i = 0; i < MAX_CACHED_MAPS && !slot; ++i) {
+		if (slots[i].state.load(std::memory_order_relaxed) == SlotState::Empty) slot = slots + i;
+	}
+
+	if (!slot) {
+		MapSlot* victim = findEvictableSlot();
+		if (!victim) return 0;
+
+		evictSlot(victim);
+		slot = victim;
+	}
+
+	slot->arena = 0;
+	slot->bytes = 0;
+
+	slot->mapIndex = mapIndex;
+	slot->lastUsed = ++useCounter;
+	slot->load = {};
+	slot->state.store(SlotState::Loading, std::memory_order_relaxed);
+
+	addJob(&prefetchJobs, loadMapJob, slot);
+
+	return slot;
+}
+
+
+const MapLoad* getCachedMap(i32 mapIndex) {
+	MapSlot* slot = requestMap(mapIndex, false);
+
+	if (slot && slot->state.load(std::memory_order_acquire) == SlotState::Ready) {
+		return &slot->load;
+	}
+
+	return 0;
+}
+
+
+const MapLoad* waitForCachedMap(i32 mapIndex) {
+	const MapLoad* result;
+
+	while (!(result = getCachedMap(mapIndex))) {
+		std::this_thread::yield();
+	}
+
+	return result;
+}
+
+
+void setCurrentMap(i32 mapIndex) {
+	currentMap = mapIndex;
+
+	i32 count = (i32)cachedMaps.length;
+
+	requestMap((mapIndex + 1) % count, true);
+	requestMap((mapIndex + count - 1) % count, true);
+
+	// Touch the current map last so prefetching its neighbours never makes it
+	// the least recently used
+	requestMap(mapIndex, false);
+}
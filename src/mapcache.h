@@ -0,0 +1,24 @@
+#pragma once
+
+#include "types.h"
+#include "map.h"
+#include "wad.h"
+
+// Keeps decoded maps resident, each in its own arena, and decodes maps on the
+// job system in the background, so switching to a recently viewed or
+// neighbouring map is just a pointer swap. Once the arenas add up to more than
+// the budget the least recently used maps are thrown away. With cacheFiles set,
+// decoded maps are also written to .dnvmap files next to their wad and mapped
+// straight back in next time.
+void initMapCache(Array<MapEntry> maps, usize memoryBudget, bool cacheFiles);
+
+// Returns the map if it has finished loading, successfully or not. Otherwise
+// starts loading it in the background if needed and returns 0.
+const MapLoad* getCachedMap(i32 mapIndex);
+
+// Same as getCachedMap but blocks until the map has loaded
+const MapLoad* waitForCachedMap(i32 mapIndex);
+
+// Marks the map as the one on screen so it is never evicted, and starts
+// prefetching the maps either side of it
+void setCurrentMap(i32 mapIndex);
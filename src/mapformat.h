@@ -0,0 +1,61 @@
+#pragma once
+
+#include "types.h"
+
+// Map lumps as they are laid out in the wad. Indices are unsigned so maps
+// with more than 32k of anything still load.
+
+struct MapSector {
+	i16 floorheight, ceilingheight;
+	i8  floorpic[8], ceilingpic[8];
+
+	i16 lightlevel;
+	i16 special;
+	i16 tag;
+};
+
+struct MapVertex {
+	i16 x, y;
+};
+
+struct MapSideDef {
+	i16 xoffset, yoffset;
+	i8 topTexture[8], bottomTexture[8], midTexture[8];
+	i16 sector;
+};
+
+const u16 MapNoSide = 0xFFFF;
+struct MapLine {
+	u16 v1, v2;
+	i16 flags;
+	i16 special, tag;
+	u16 sidenum[2];
+};
+
+struct MapSubsector {
+	u16 numSegs;
+	u16 firstSeg;
+};
+
+struct MapSeg {
+	u16 v1, v2;
+	i16 angle;
+	u16 linedef;
+	i16 side;
+	i16 xoffset;
+};
+
+const u16 MapSubsectorChildFlag = 0x8000;
+struct MapNode {
+	i16 x, y;
+	i16 dx, dy;
+	i16 bbox[2][4];
+	u16 children[2];
+};
+
+struct MapThing {
+	i16 x, y;
+	i16 angle;
+	i16 type;
+	i16 options;
+};
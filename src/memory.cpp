@@ -1,94 +1,314 @@
 #include "memory.h"
 #include "types.h"
 #include "system.h"
+#include "memtrace.h"
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <new>
 
-struct MemoryBook {
-	u8*   data;
-	usize size;
-};
-
+// Every arena sits in its own reservation of address space. Memory is only
+// committed as the free pointer reaches it, so an arena can be given far
+// more room than it is expected to need.
 struct MemoryArena {
-	u8*   data;
-	usize size;
-	u8*   freePtr;
+	u8*               data;
+	usize             size;
+	std::atomic<u8*>  freePtr;
+	// Everything in the reservation before this has memory behind it
+	std::atomic<u8*>  committedEnd;
+	std::atomic<bool> committing;
+	u8*               reservation;
+	usize             reservedSize;
+	const char*       name;
+	// Most used by any reset in the current run of resets
+	u8*               resetMost;
+	i32               resetCount;
 };
 
 
-const usize MAIN_BLOCK_SIZE = MEGABYTES(128);
-static MemoryBook mainMemoryBlock = {};
+// Plenty for the biggest wads, it is only address space until it is used.
+// 32-bit builds have to share a couple of gigabytes between every arena.
+const usize PERMANENT_RESERVE = sizeof(void*) == 8 ? GIGABYTES((usize)1) : MEGABYTES((usize)128);
+const usize TEMPORARY_RESERVE = sizeof(void*) == 8 ? GIGABYTES((usize)4) : MEGABYTES((usize)256);
+const usize THREAD_TEMPORARY_RESERVE = sizeof(void*) == 8 ? GIGABYTES((usize)1) : MEGABYTES((usize)32);
+
+// Memory is committed this much at a time, so small allocations don't each
+// need a call into the os
+const usize COMMIT_STEP = KILOBYTES((usize)64);
+
+// Resets that used something before memory past the most any of them used
+// is handed back
+const i32 DECOMMIT_RESETS = 64;
+
+static usize commitStep = 0;
 
 static MemoryArena permanentStorage = {};
-static MemoryArena levelStorage = {};
 static MemoryArena temporaryStorage = {};
 
 MemoryArena* permanent = 0;
-MemoryArena* level = 0;
 MemoryArena* temporary = 0;
 
+static thread_local MemoryArena* threadTemporaryArena = 0;
+
 static i64 mostTemporaryStorageUsed = 0;
 
+// Arenas are created, grown and destroyed from any thread
+static std::atomic<usize> createdArenaBytes(0);
+static std::atomic<usize> mostCreatedArenaBytes(0);
 
-void initMemory() {
-	auto block = (u8*)malloc(MAIN_BLOCK_SIZE);
+static std::atomic<usize> committedBytes(0);
+static std::atomic<usize> mostCommittedBytes(0);
 
-	if (!block) {
-		fatalError("Failed to allocate main block of memory.");
+
+static void updateMost(std::atomic<usize>& most, usize value) {
+	usize current = most.load(std::memory_order_relaxed);
+
+	while (value > current && !most.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+}
+
+
+static usize roundUp(usize size, usize step) {
+	return (size + step - 1) / step * step;
+}
+
+
+static u8* reserveOrFail(usize size) {
+	u8* reservation = reserveMemory(size);
+
+	if (!reservation) {
+		fatalError("Failed to reserve %i kb of address space", size / 1024);
+	}
+
+	return reservation;
+}
+
+
+static void commitOrFail(u8* address, usize size) {
+	if (!commitMemory(address, size)) {
+		fatalError("Failed to commit %i kb of arena memory", size / 1024);
 	}
 
-	mainMemoryBlock.data = block;
-	mainMemoryBlock.size = MAIN_BLOCK_SIZE;
+	usize total = committedBytes.fetch_add(size, std::memory_order_relaxed) + size;
+	updateMost(mostCommittedBytes, total);
+}
+
 
-	usize offset = 0;
+static void initArena(MemoryArena* arena, const char* name, u8* reservation, usize reservedSize, u8* committedEnd, u8* data, usize size) {
+	arena->name = name;
+	arena->data = arena->freePtr = data;
+	arena->size = size;
+	arena->committedEnd = committedEnd;
+	arena->committing = false;
+	arena->reservation = reservation;
+	arena->reservedSize = reservedSize;
+	arena->resetMost = data;
+	arena->resetCount = 0;
+}
 
-	permanentStorage.data = permanentStorage.freePtr = block + offset;
-	permanentStorage.size = MEGABYTES(32);
 
-	offset += permanentStorage.size;
+// Only called once an allocation runs past the committed memory. Threads
+// that get there together take turns, the later ones usually find their
+// memory was committed by the one before.
+static void commitArena(MemoryArena* arena, u8* end) {
+	while (arena->committing.exchange(true, std::memory_order_acquire)) {
+		std::this_thread::yield();
+	}
 
-	levelStorage.data = levelStorage.freePtr = block + offset;
-	levelStorage.size = MEGABYTES(32);
+	u8* committed = arena->committedEnd.load(std::memory_order_relaxed);
 
-	offset += levelStorage.size;
+	if (end > committed) {
+		usize target = roundUp(end - arena->reservation, commitStep);
+		if (target > arena->reservedSize) target = arena->reservedSize;
 
-	temporaryStorage.data = temporaryStorage.freePtr = block + offset;
-	temporaryStorage.size = mainMemoryBlock.size - offset;
+		commitOrFail(committed, (arena->reservation + target) - committed);
+
+		arena->committedEnd.store(arena->reservation + target, std::memory_order_release);
+	}
+
+	arena->committing.store(false, std::memory_order_release);
+}
+
+
+static void decommitArena(MemoryArena* arena, u8* end) {
+	u8* committed = arena->committedEnd.load(std::memory_order_relaxed);
+	u8* keep = arena->reservation + roundUp(end - arena->reservation, commitStep);
+
+	if (keep >= committed) return;
+
+	decommitMemory(keep, committed - keep);
+	committedBytes.fetch_sub(committed - keep, std::memory_order_relaxed);
+
+	arena->committedEnd.store(keep, std::memory_order_relaxed);
+}
+
+
+void initMemory() {
+	commitStep = roundUp(COMMIT_STEP, getPageSize());
+
+	u8* permanentBlock = reserveOrFail(PERMANENT_RESERVE);
+	initArena(&permanentStorage, "permanent", permanentBlock, PERMANENT_RESERVE, permanentBlock, permanentBlock, PERMANENT_RESERVE);
+
+	u8* temporaryBlock = reserveOrFail(TEMPORARY_RESERVE);
+	initArena(&temporaryStorage, "temporary", temporaryBlock, TEMPORARY_RESERVE, temporaryBlock, temporaryBlock, TEMPORARY_RESERVE);
 
 	permanent = &permanentStorage;
 	temporary = &temporaryStorage;
-	level = &levelStorage;
 }
 
 
+// The arena's own header goes at the start of its reservation
+static MemoryArena* makeArena(usize size, const char* name) {
+	usize reservedSize = roundUp(sizeof(MemoryArena) + size, getPageSize());
+	u8* reservation = reserveOrFail(reservedSize);
+
+	usize headerCommit = commitStep < reservedSize ? commitStep : reservedSize;
+	commitOrFail(reservation, headerCommit);
+
+	auto arena = new (reservation) MemoryArena;
+	initArena(arena, name, reservation, reservedSize, reservation + headerCommit, reservation + sizeof(MemoryArena), size);
+
+	return arena;
+}
+
+
+MemoryArena* createArena(usize size, const char* name) {
+	MemoryArena* arena = makeArena(size, name);
+
+	usize total = createdArenaBytes.fetch_add(size, std::memory_order_relaxed) + size;
+	updateMost(mostCreatedArenaBytes, total);
+
+	return arena;
+}
+
+
+void destroyArena(MemoryArena *arena) {
+	if (memoryTracing) traceMemoryEvent(arena, MemoryEventKind::Destroy, 0);
+
+	createdArenaBytes.fetch_sub(arena->size, std::memory_order_relaxed);
+	committedBytes.fetch_sub(arena->committedEnd.load() - arena->reservation, std::memory_order_relaxed);
+
+	u8* reservation = arena->reservation;
+	usize reservedSize = arena->reservedSize;
+
+	arena->~MemoryArena();
+	releaseMemory(reservation, reservedSize);
+}
+
+
+// Memory past the most used by the last run of resets is handed back, so a
+// one off spike doesn't stay resident while an arena reset every frame keeps
+// the memory it needs each time
 void resetArena(MemoryArena *arena) {
-	if (arena == temporary && arena->freePtr - arena->data > mostTemporaryStorageUsed) {
-		mostTemporaryStorageUsed = arena->freePtr - arena->data;
+	u8* used = arena->freePtr;
+
+	if (arena == temporary && used - arena->data > mostTemporaryStorageUsed) {
+		mostTemporaryStorageUsed = used - arena->data;
 	}
 
 	arena->freePtr = arena->data;
+
+	if (memoryTracing) traceMemoryEvent(arena, MemoryEventKind::Reset, used - arena->data);
+
+	// Passes that used nothing, like the main loop waiting for events, say
+	// nothing about what the next frame needs
+	if (used == arena->data) return;
+
+	if (used > arena->resetMost) arena->resetMost = used;
+	if (++arena->resetCount < DECOMMIT_RESETS) return;
+
+	decommitArena(arena, arena->resetMost);
+
+	arena->resetMost = arena->data;
+	arena->resetCount = 0;
 }
 
 
 u8* memoryAlloc(MemoryArena *arena, usize size) {
-	if (!arena || (arena->freePtr - arena->data) + size >= arena->size) {
-		fatalError("Failed to allocate from arena");
+	return memoryAllocAligned(arena, size, 1);
+}
+
+
+// Safe to call from several threads on the same arena
+u8* memoryAllocAligned(MemoryArena *arena, usize size, usize alignment) {
+	if (!arena) fatalError("Failed to allocate from arena");
+
+	u8* current = arena->freePtr.load(std::memory_order_relaxed);
+	u8* result;
+
+	do {
+		result = (u8*)(((uintptr_t)current + alignment - 1) & ~(uintptr_t)(alignment - 1));
+
+		if ((result - arena->data) + size >= arena->size) {
+			fatalError("Failed to allocate from arena");
+		}
+	} while (!arena->freePtr.compare_exchange_weak(current, result + size, std::memory_order_relaxed));
+
+	if (result + size > arena->committedEnd.load(std::memory_order_acquire)) {
+		commitArena(arena, result + size);
 	}
 
-	u8* result = arena->freePtr;
-	arena->freePtr += size;
+	if (memoryTracing) traceMemoryEvent(arena, MemoryEventKind::Alloc, size);
 
 	return result;
 }
 
 
+ArenaMarker saveArena(MemoryArena *arena) {
+	return { arena, (usize)(arena->freePtr.load(std::memory_order_relaxed) - arena->data) };
+}
+
+
+// Memory stays committed, the same scope tends to run again soon
+void restoreArena(ArenaMarker marker) {
+	marker.arena->freePtr.store(marker.arena->data + marker.used, std::memory_order_relaxed);
+
+	if (memoryTracing) traceMemoryEvent(marker.arena, MemoryEventKind::Restore, marker.used);
+}
+
+
+// Made the first time each thread asks, and kept for the life of the thread.
+// Only the memory it touches is ever committed.
+MemoryArena* threadTemporary() {
+	if (!threadTemporaryArena) threadTemporaryArena = makeArena(THREAD_TEMPORARY_RESERVE, "thread scratch");
+
+	return threadTemporaryArena;
+}
+
+
+usize arenaSize(MemoryArena *arena) {
+	return arena->size;
+}
+
+
+usize arenaBytesFree(MemoryArena *arena) {
+	return arena->size - (arena->freePtr - arena->data);
+}
+
+
+usize arenaBytesUsed(MemoryArena *arena) {
+	return arena->freePtr - arena->data;
+}
+
+
+const char* arenaName(MemoryArena *arena) {
+	return arena->name;
+}
+
+
+usize memoryBytesCommitted() {
+	return committedBytes.load(std::memory_order_relaxed);
+}
+
+
 void reportMemoryStats() {
 	if (temporary->freePtr - temporary->data > mostTemporaryStorageUsed) {
 		mostTemporaryStorageUsed = temporary->freePtr - temporary->data;
 	}
 
-	logMessage("Main Memory Block: %i kb", mainMemoryBlock.size / 1024);
 	logMessage("Permanent storage: %i of %i kb used", (permanentStorage.freePtr - permanentStorage.data) / 1024, permanentStorage.size / 1024);
-	logMessage("Level storage: %i of %i kb used", (levelStorage.freePtr - levelStorage.data) / 1024, levelStorage.size / 1024);
+	logMessage("Most level storage allocated: %i kb", mostCreatedArenaBytes.load() / 1024);
 	logMessage("Most temporary storage used: %i of %i kb", mostTemporaryStorageUsed / 1024, temporaryStorage.size / 1024);
-}
\ No newline at end of file
+	logMessage("Most memory committed: %i kb", mostCommittedBytes.load() / 1024);
+}
@@ -13,10 +13,72 @@ void initMemory();
 struct MemoryArena;
 
 extern MemoryArena *permanent;
-extern MemoryArena *level;
 extern MemoryArena *temporary;
 
+// Arenas with their own block of memory, used to give every resident map its
+// own level storage. The name only labels the arena in memory traces.
+MemoryArena* createArena(usize size, const char* name = "level");
+void destroyArena(MemoryArena *arena);
+
 u8* memoryAlloc(MemoryArena *arena, usize size);
+// Alignment has to be a power of two
+u8* memoryAllocAligned(MemoryArena *arena, usize size, usize alignment);
 void resetArena(MemoryArena *arena);
+usize arenaSize(MemoryArena *arena);
+usize arenaBytesFree(MemoryArena *arena);
+usize arenaBytesUsed(MemoryArena *arena);
+const char* arenaName(MemoryArena *arena);
+
+// Across every arena
+usize memoryBytesCommitted();
+
+// Room for count Ts, aligned for T unless asked for more
+template<typename T>
+T* arenaPush(MemoryArena* arena, usize count = 1, usize alignment = alignof(T)) {
+	return (T*)memoryAllocAligned(arena, sizeof(T) * count, alignment);
+}
+
+
+// Everything allocated after saving a marker is freed again by restoring it.
+// Nothing else can allocate from the arena in between.
+struct ArenaMarker {
+	MemoryArena* arena;
+	usize        used;
+};
+
+ArenaMarker saveArena(MemoryArena *arena);
+void restoreArena(ArenaMarker marker);
+
+// Restores the arena when it goes out of scope
+struct ArenaScope {
+	ArenaMarker marker;
+
+	ArenaScope(MemoryArena* arena) : marker(saveArena(arena)) {}
+	~ArenaScope() { restoreArena(marker); }
+};
+
+// Scratch memory belonging to the calling thread, so jobs can use it without
+// sharing temporary. Nothing resets it, take an ArenaScope before using it.
+MemoryArena* threadTemporary();
 
 void reportMemoryStats();
+
+
+// Appends to an array, doubling its storage when full. The old storage is
+// left behind in the arena, so build growable arrays in a short lived arena.
+template<typename T>
+void arrayPush(MemoryArena* arena, Array<T>& array, const T& value) {
+	if (array.length == array.capacity) {
+		usize capacity = array.capacity ? array.capacity * 2 : 16;
+		T* data = arenaPush<T>(arena, capacity);
+
+		for (usize i = 0; i < array.length; ++i) {
+			data[i] = array.data[i];
+		}
+
+		array.data = data;
+		array.capacity = capacity;
+	}
+
+	array.data[array.length++] = value;
+}
@@ -0,0 +1,434 @@
+#include "memtrace.h"
+#include "renderer.h"
+#include "system.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
+bool memoryTracing = false;
+
+static thread_local const char* tagCategory = 0;
+static thread_local const char* tagName = 0;
+
+
+MemoryTag::MemoryTag(const char* category, const char* name) {
+	savedCategory = tagCategory;
+	savedName = tagName;
+
+	tagCategory = category;
+	tagName = name;
+}
+
+
+MemoryTag::~MemoryTag() {
+	tagCategory = savedCategory;
+	tagName = savedName;
+}
+
+
+struct MemoryEvent {
+	u64             time;
+	MemoryArena*    arena;
+	const char*     category;
+	const char*     name;
+	usize           bytes;
+	MemoryEventKind kind;
+};
+
+// Live bytes for one tag in one arena. Entries go back to being free when
+// their arena is destroyed.
+struct TagEntry {
+	MemoryArena* arena;
+	const char*  arenaName;
+	const char*  category;
+	const char*  name;
+	usize        live;
+	usize        total;
+	usize        count;
+};
+
+// Entries are found by hashing, this has to be a power of two
+const i32 MAX_TAG_ENTRIES = 1024;
+
+// The log is a ring that keeps the latest events, it only commits memory as
+// it first fills
+const usize EVENT_LOG_SLOTS = sizeof(void*) == 8 ? 1 << 20 : 1 << 18;
+
+static MemoryArena* eventArena = 0;
+static MemoryEvent* events = 0;
+// Every event ever logged, event i is in slot i % EVENT_LOG_SLOTS
+static usize numEvents = 0;
+static bool eventsDropped = false;
+
+static TagEntry entries[MAX_TAG_ENTRIES];
+static bool entriesFull = false;
+
+static const char* outputDirectory = 0;
+static u64 traceStart = 0;
+
+// Tracing is a debugging aid, a lock around the bookkeeping is fine
+static std::atomic<bool> traceLock(false);
+
+
+static void lockTrace() {
+	while (traceLock.exchange(true, std::memory_order_acquire)) {
+		std::this_thread::yield();
+	}
+}
+
+
+static void unlockTrace() {
+	traceLock.store(false, std::memory_order_release);
+}
+
+
+void initMemoryTrace(const char* outputDir) {
+	eventArena = createArena(EVENT_LOG_SLOTS * sizeof(MemoryEvent) + 64, "memory trace");
+	events = arenaPush<MemoryEvent>(eventArena, 0);
+	numEvents = 0;
+
+	outputDirectory = outputDir;
+	traceStart = getPerformanceCounter();
+
+	memoryTracing = true;
+}
+
+
+static u32 tagHash(MemoryArena* arena, const char* category, const char* name) {
+	u64 hash = (u64)(uintptr_t)arena * 0x9E3779B97F4A7C15ull;
+	hash = (hash ^ (u64)(uintptr_t)category) * 0x9E3779B97F4A7C15ull;
+	hash = (hash ^ (u64)(uintptr_t)name) * 0x9E3779B97F4A7C15ull;
+
+	return (u32)(hash >> 32);
+}
+
+
+// Open addressing, probing on from the hashed slot. Entries are only freed
+// by rebuilding the table, so the first free slot ends the search.
+static TagEntry* findTagEntry(MemoryArena* arena, const char* category, const char* name) {
+	u32 slot = tagHash(arena, category, name);
+
+	for (i32 i = 0; i < MAX_TAG_ENTRIES; ++i, ++slot) {
+		TagEntry& entry = entries[slot & (MAX_TAG_ENTRIES - 1)];
+
+		if (entry.arena == arena && entry.category == category && entry.name == name) return &entry;
+
+		if (!entry.arena) {
+			entry = { arena, arenaName(arena), category, name, 0, 0, 0 };
+			return &entry;
+		}
+	}
+
+	if (!entriesFull) {
+		entriesFull = true;
+		logWarning("Memory trace has run out of tag entries, the overlay will be missing some");
+	}
+
+	return 0;
+}
+
+
+// Drops a destroyed arena's entries, putting the rest back where a search
+// will find them
+static void removeTagEntries(MemoryArena* arena) {
+	static TagEntry kept[MAX_TAG_ENTRIES];
+	i32 numKept = 0;
+
+	for (i32 i = 0; i < MAX_TAG_ENTRIES; ++i) {
+		if (entries[i].arena && entries[i].arena != arena) kept[numKept++] = entries[i];
+		entries[i].arena = 0;
+	}
+
+	for (i32 i = 0; i < numKept; ++i) {
+		*findTagEntry(kept[i].arena, kept[i].category, kept[i].name) = kept[i];
+	}
+}
+
+
+void traceMemoryEvent(MemoryArena* arena, MemoryEventKind kind, usize bytes) {
+	if (arena == eventArena) return;
+
+	lockTrace();
+
+	// Pushed one at a time onto an arena nothing else uses, so they stay
+	// back to back until the ring is full
+	MemoryEvent* event;
+
+	if (numEvents < EVENT_LOG_SLOTS) {
+		event = arenaPush<MemoryEvent>(eventArena);
+	}
+	else {
+		event = events + numEvents % EVENT_LOG_SLOTS;
+
+		if (!eventsDropped) {
+			eventsDropped = true;
+			logWarning("Memory trace event log is full, dropping the oldest events");
+		}
+	}
+
+	*event = { getPerformanceCounter(), arena, tagCategory, tagName, bytes, kind };
+	numEvents++;
+
+	if (kind == MemoryEventKind::Alloc) {
+		TagEntry* entry = findTagEntry(arena, tagCategory, tagName);
+
+		if (entry) {
+			entry->live += bytes;
+			entry->total += bytes;
+			entry->count++;
+		}
+	}
+	else if (kind == MemoryEventKind::Destroy) {
+		removeTagEntries(arena);
+	}
+	else {
+		// Only a reset or a restore to the very start is known to free every
+		// tag, restoring part way leaves the tags counted until then
+		bool freesAll = kind != MemoryEventKind::Restore || bytes == 0;
+
+		for (i32 i = 0; i < MAX_TAG_ENTRIES && freesAll; ++i) {
+			if (entries[i].arena == arena) entries[i].live = 0;
+		}
+	}
+
+	unlockTrace();
+}
+
+
+usize memoryTraceMark() {
+	if (!memoryTracing) return 0;
+
+	lockTrace();
+	usize result = numEvents;
+	unlockTrace();
+
+	return result;
+}
+
+
+// Tags hold wad paths, which can have backslashes in them
+static void writeJsonString(FILE* f, const char* s) {
+	fputc('"', f);
+
+	for (const char* c = s; *c; ++c) {
+		if (*c == '"' || *c == '\\') fputc('\\', f);
+		fputc(*c, f);
+	}
+
+	fputc('"', f);
+}
+
+
+static void writeTag(FILE* f, const char* category, const char* name) {
+	char tag[256];
+	snprintf(tag, sizeof(tag), "%s%s%s", category ? category : "untagged", name ? ":" : "", name ? name : "");
+
+	writeJsonString(f, tag);
+}
+
+
+static const char* eventKindName(MemoryEventKind kind) {
+	switch (kind) {
+		case MemoryEventKind::Alloc:   return "alloc";
+		case MemoryEventKind::Reset:   return "reset";
+		case MemoryEventKind::Restore: return "restore";
+		default:                       return "destroy";
+	}
+}
+
+
+// One map's arena from the mark on, every event plus bytes by tag. Other
+// arenas the load used along the way are left out.
+void writeMapMemoryTrace(const char* wadName, const char* mapName, MemoryArena* arena, usize mark) {
+	if (!memoryTracing || !outputDirectory) return;
+
+	char fileName[1024];
+	snprintf(fileName, sizeof(fileName), "%s/%s.%s.json", outputDirectory, pathBaseName(wadName), mapName);
+
+	FILE* f;
+	if (fopen_s(&f, fileName, "wb") != 0) {
+		logError("Failed to write memory trace %s", fileName);
+		return;
+	}
+
+	lockTrace();
+	usize numTraced = numEvents;
+	unlockTrace();
+
+	MemoryArena* scratch = threadTemporary();
+	ArenaScope scope(scratch);
+
+	// Allocating traces too, so the room for this arena's events is made
+	// before taking the lock again to copy them out of the ring. Jobs can
+	// keep tracing while the copy is written out.
+	usize wanted = numTraced - mark < EVENT_LOG_SLOTS ? numTraced - mark : EVENT_LOG_SLOTS;
+	MemoryEvent* mapEvents = arenaPush<MemoryEvent>(scratch, wanted);
+	usize numMapEvents = 0;
+
+	lockTrace();
+
+	usize oldest = numEvents > EVENT_LOG_SLOTS ? numEvents - EVENT_LOG_SLOTS : 0;
+	usize from = mark > oldest ? mark : oldest;
+
+	for (usize i = from; i < numTraced; ++i) {
+		const MemoryEvent& event = events[i % EVENT_LOG_SLOTS];
+		if (event.arena == arena) mapEvents[numMapEvents++] = event;
+	}
+
+	unlockTrace();
+
+	if (from > mark) {
+		logWarning("Memory trace of %s in %s is missing events the log had already dropped", mapName, wadName);
+	}
+
+	// Summed from the events rather than the live tag entries, which count
+	// from when the arena was created rather than from the mark
+	TagEntry* tags = arenaPush<TagEntry>(scratch, MAX_TAG_ENTRIES);
+	i32 numTags = 0;
+
+	for (usize i = 0; i < numMapEvents; ++i) {
+		const MemoryEvent& event = mapEvents[i];
+		if (event.kind != MemoryEventKind::Alloc) continue;
+
+		i32 t = 0;
+		while (t < numTags && (tags[t].category != event.category || tags[t].name != event.name)) ++t;
+
+		if (t == numTags) {
+			if (numTags == MAX_TAG_ENTRIES) continue;
+			tags[numTags++] = { arena, 0, event.category, event.name, 0, 0, 0 };
+		}
+
+		tags[t].total += event.bytes;
+		tags[t].count++;
+	}
+
+	f64 usPerTick = 1000000.0 / (f64)getPerformanceFrequency();
+
+	fprintf(f, "{\n\"wad\":");
+	writeJsonString(f, wadName);
+	fprintf(f, ",\n\"map\":");
+	writeJsonString(f, mapName);
+	fprintf(f, ",\n\"arenaSize\":%llu,\n\"used\":%llu,\n\"tags\":[", arenaSize(arena), arenaBytesUsed(arena));
+
+	for (i32 t = 0; t < numTags; ++t) {
+		fprintf(f, "%s\n\t{\"tag\":", t == 0 ? "" : ",");
+		writeTag(f, tags[t].category, tags[t].name);
+		fprintf(f, ",\"bytes\":%llu,\"count\":%llu}", tags[t].total, tags[t].count);
+	}
+
+	fprintf(f, "\n],\n\"events\":[");
+
+	for (usize i = 0; i < numMapEvents; ++i) {
+		const MemoryEvent& event = mapEvents[i];
+
+		fprintf(f, "%s\n\t{\"us\":%.1f,\"kind\":\"%s\",\"tag\":", i == 0 ? "" : ",",
+			(f64)(event.time - traceStart) * usPerTick, eventKindName(event.kind));
+		writeTag(f, event.category, event.name);
+		fprintf(f, ",\"bytes\":%llu}", event.bytes);
+	}
+
+	fprintf(f, "\n]\n}\n");
+	fclose(f);
+}
+
+
+struct OverlayRow {
+	const char* arenaName;
+	const char* category;
+	const char* name;
+	usize       live;
+};
+
+const i32 OVERLAY_ROWS = 24;
+const i32 OVERLAY_MARGIN = 4;
+const i32 OVERLAY_COLUMNS = 44;
+
+static Color OverlayBackground = { 16, 16, 16 };
+static Color OverlayText = { 220, 220, 220 };
+
+
+// Map arenas share a name, so every resident map adds up into one row per tag
+ClipRect drawMemoryOverlay(DrawContext& context) {
+	OverlayRow rows[OVERLAY_ROWS];
+	i32 numRows = 0;
+
+	if (memoryTracing) {
+		static OverlayRow merged[MAX_TAG_ENTRIES];
+		i32 numMerged = 0;
+
+		lockTrace();
+
+		for (i32 i = 0; i < MAX_TAG_ENTRIES; ++i) {
+			const TagEntry& entry = entries[i];
+			if (!entry.arena || entry.live == 0) continue;
+
+			i32 m = 0;
+
+			while (m < numMerged && !(strcmp(merged[m].arenaName, entry.arenaName) == 0
+				&& merged[m].category == entry.category && merged[m].name == entry.name)) {
+				++m;
+			}
+
+			if (m == numMerged) merged[numMerged++] = { entry.arenaName, entry.category, entry.name, 0 };
+
+			merged[m].live += entry.live;
+		}
+
+		unlockTrace();
+
+		// Biggest first, only as many as fit
+		for (i32 m = 0; m < numMerged; ++m) {
+			if (numRows == OVERLAY_ROWS && rows[numRows - 1].live >= merged[m].live) continue;
+
+			i32 at = numRows < OVERLAY_ROWS ? numRows++ : OVERLAY_ROWS - 1;
+
+			while (at > 0 && rows[at - 1].live < merged[m].live) {
+				rows[at] = rows[at - 1];
+				--at;
+			}
+
+			rows[at] = merged[m];
+		}
+	}
+
+	i32 width = OVERLAY_MARGIN * 2 + OVERLAY_COLUMNS * TEXT_ADVANCE;
+
+	ClipRect area = {
+		context.w - width, 0,
+		context.w,
+		OVERLAY_MARGIN * 2 + (numRows + 1) * TEXT_LINE_HEIGHT
+	};
+
+	if (area.x1 < 0) area.x1 = 0;
+	if (area.y2 > context.h) area.y2 = context.h;
+
+	fillRect(context, area, OverlayBackground);
+
+	char line[128];
+	i32 x = area.x1 + OVERLAY_MARGIN;
+	i32 y = OVERLAY_MARGIN;
+
+	if (memoryTracing) {
+		snprintf(line, sizeof(line), "Committed %12llu kb", memoryBytesCommitted() / 1024);
+	}
+	else {
+		snprintf(line, sizeof(line), "Memory tracing is off");
+	}
+
+	drawText(context, x, y, line, OverlayText);
+	y += TEXT_LINE_HEIGHT;
+
+	for (i32 i = 0; i < numRows; ++i) {
+		char tag[64];
+		snprintf(tag, sizeof(tag), "%s%s%s", rows[i].category ? rows[i].category : "untagged", rows[i].name ? ":" : "", rows[i].name ? pathBaseName(rows[i].name) : "");
+
+		snprintf(line, sizeof(line), "%-14.14s %-18.18s %8llu kb", rows[i].arenaName, tag, (u64)rows[i].live / 1024);
+		drawText(context, x, y, line, OverlayText);
+		y += TEXT_LINE_HEIGHT;
+	}
+
+	return area;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "types.h"
+#include "memory.h"
+
+struct DrawContext;
+struct ClipRect;
+
+// Optional record of what arena memory is used for. Every allocation, reset
+// and restore is logged with the innermost MemoryTag on its thread, and live
+// bytes are kept per arena and tag for the overlay. The log only keeps the
+// latest events.
+
+// Only true after initMemoryTrace, allocations are free of tracing otherwise
+extern bool memoryTracing;
+
+// Labels allocations made on this thread until it goes out of scope, shown
+// as category:name. The strings are not copied and have to outlive the trace.
+struct MemoryTag {
+	const char* savedCategory;
+	const char* savedName;
+
+	MemoryTag(const char* category, const char* name = 0);
+	~MemoryTag();
+};
+
+enum class MemoryEventKind {
+	Alloc,
+	Reset,
+	// Bytes is how much is still in use after restoring a marker
+	Restore,
+	Destroy
+};
+
+// Call before the wads load so they are caught too. With an output directory
+// every map load is also written out as json.
+void initMemoryTrace(const char* outputDir);
+
+void traceMemoryEvent(MemoryArena* arena, MemoryEventKind kind, usize bytes);
+
+// Position in the event log, to pick out one map load's events afterwards
+usize memoryTraceMark();
+void writeMapMemoryTrace(const char* wadName, const char* mapName, MemoryArena* arena, usize mark);
+
+// Live bytes by arena and tag in the top right corner, returns the area it
+// covered
+ClipRect drawMemoryOverlay(DrawContext& context);
@@ -0,0 +1,233 @@
+#include "profiler.h"
+#include "renderer.h"
+#include "memory.h"
+#include "jobs.h"
+
+#include <stdio.h>
+#include <atomic>
+#include <new>
+
+static const char* stageNames[(int)ProfileStage::Count] = {
+	"Events",
+	"Frame",
+	"Transform",
+	"Walk",
+	"Clear",
+	"Bin",
+	"Raster",
+	"Load map",
+	"Decode",
+	"Extended nodes",
+	"Layout",
+	"Lod",
+};
+
+static const char* counterNames[(int)ProfileCounter::Count] = {
+	"Lines",
+	"Tile lines",
+};
+
+
+struct TraceEvent {
+	u64          start, end;
+	ProfileStage stage;
+};
+
+// Totals only grow and are only written by their own thread, so they are
+// read with plain loads and stores rather than locked adds
+struct ProfileThread {
+	std::atomic<u64>   stageTicks[(int)ProfileStage::Count];
+	std::atomic<u64>   counters[(int)ProfileCounter::Count];
+	TraceEvent*        events;
+	std::atomic<usize> numEvents;
+};
+
+const usize TRACE_EVENTS_PER_THREAD = 65536;
+
+static ProfileThread* threads = 0;
+static i32 numThreads = 0;
+static bool tracing = false;
+static u64 traceStart = 0;
+
+static u64 frameStart = 0;
+static u64 frameStageTicks[(int)ProfileStage::Count];
+static u64 frameCounters[(int)ProfileCounter::Count];
+static ProfileFrame lastFrame = {};
+
+
+void initProfiler(bool trace) {
+	numThreads = getNumWorkers() + 1;
+	tracing = trace;
+	traceStart = getPerformanceCounter();
+
+	threads = arenaPush<ProfileThread>(permanent, numThreads);
+
+	// Event buffers are too big for the permanent arena with many workers
+	MemoryArena* traceArena = trace ? createArena(sizeof(TraceEvent) * TRACE_EVENTS_PER_THREAD * numThreads + 64, "profile trace") : 0;
+
+	for (i32 i = 0; i < numThreads; ++i) {
+		ProfileThread* thread = new (threads + i) ProfileThread;
+
+		for (auto& ticks : thread->stageTicks) ticks = 0;
+		for (auto& count : thread->counters) count = 0;
+
+		thread->events = trace ? arenaPush<TraceEvent>(traceArena, TRACE_EVENTS_PER_THREAD) : 0;
+		thread->numEvents = 0;
+	}
+}
+
+
+void recordProfileStage(ProfileStage stage, u64 start, u64 end) {
+	if (!threads) return;
+
+	ProfileThread& thread = threads[getThreadIndex()];
+	auto& ticks = thread.stageTicks[(int)stage];
+
+	ticks.store(ticks.load(std::memory_order_relaxed) + (end - start), std::memory_order_relaxed);
+
+	if (tracing) {
+		usize index = thread.numEvents.load(std::memory_order_relaxed);
+
+		// Once a thread's buffer is full the rest of its events are dropped
+		if (index < TRACE_EVENTS_PER_THREAD) {
+			thread.events[index] = { start, end, stage };
+			thread.numEvents.store(index + 1, std::memory_order_release);
+		}
+	}
+}
+
+
+void countProfile(ProfileCounter counter, u64 amount) {
+	if (!threads) return;
+
+	auto& count = threads[getThreadIndex()].counters[(int)counter];
+
+	count.store(count.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+
+static void sumThreads(u64 stageTicks[(int)ProfileStage::Count], u64 counters[(int)ProfileCounter::Count]) {
+	for (i32 s = 0; s < (int)ProfileStage::Count; ++s) stageTicks[s] = 0;
+	for (i32 c = 0; c < (int)ProfileCounter::Count; ++c) counters[c] = 0;
+
+	for (i32 i = 0; i < numThreads; ++i) {
+		for (i32 s = 0; s < (int)ProfileStage::Count; ++s) stageTicks[s] += threads[i].stageTicks[s].load(std::memory_order_relaxed);
+		for (i32 c = 0; c < (int)ProfileCounter::Count; ++c) counters[c] += threads[i].counters[c].load(std::memory_order_relaxed);
+	}
+}
+
+
+void beginProfileFrame() {
+	if (!threads) return;
+
+	frameStart = getPerformanceCounter();
+	sumThreads(frameStageTicks, frameCounters);
+}
+
+
+void endProfileFrame() {
+	if (!threads) return;
+
+	u64 stageTicks[(int)ProfileStage::Count];
+	u64 counters[(int)ProfileCounter::Count];
+	sumThreads(stageTicks, counters);
+
+	f64 msPerTick = 1000.0 / (f64)getPerformanceFrequency();
+
+	lastFrame.frameMs = (f64)(getPerformanceCounter() - frameStart) * msPerTick;
+
+	for (i32 s = 0; s < (int)ProfileStage::Count; ++s) lastFrame.stageMs[s] = (f64)(stageTicks[s] - frameStageTicks[s]) * msPerTick;
+	for (i32 c = 0; c < (int)ProfileCounter::Count; ++c) lastFrame.counters[c] = counters[c] - frameCounters[c];
+}
+
+
+const ProfileFrame& getProfileFrame() {
+	return lastFrame;
+}
+
+
+const i32 OVERLAY_MARGIN = 4;
+const i32 OVERLAY_COLUMNS = 24;
+
+static Color OverlayBackground = { 16, 16, 16 };
+static Color OverlayText = { 220, 220, 220 };
+
+
+ClipRect drawProfileOverlay(DrawContext& context) {
+	const ProfileFrame& frame = lastFrame;
+
+	i32 numLines = 1 + (int)ProfileStage::Count + (int)ProfileCounter::Count;
+
+	ClipRect area = {
+		0, 0,
+		OVERLAY_MARGIN * 2 + OVERLAY_COLUMNS * TEXT_ADVANCE,
+		OVERLAY_MARGIN * 2 + numLines * TEXT_LINE_HEIGHT
+	};
+
+	if (area.x2 > context.w) area.x2 = context.w;
+	if (area.y2 > context.h) area.y2 = context.h;
+
+	fillRect(context, area, OverlayBackground);
+
+	char line[64];
+	i32 x = OVERLAY_MARGIN;
+	i32 y = OVERLAY_MARGIN;
+
+	snprintf(line, sizeof(line), "Wall %8.3f ms", frame.frameMs);
+	drawText(context, x, y, line, OverlayText);
+	y += TEXT_LINE_HEIGHT;
+
+	for (i32 s = 0; s < (int)ProfileStage::Count; ++s) {
+		snprintf(line, sizeof(line), "%-14s %8.3f", stageNames[s], frame.stageMs[s]);
+		drawText(context, x, y, line, OverlayText);
+		y += TEXT_LINE_HEIGHT;
+	}
+
+	for (i32 c = 0; c < (int)ProfileCounter::Count; ++c) {
+		snprintf(line, sizeof(line), "%-14s %8llu", counterNames[c], frame.counters[c]);
+		drawText(context, x, y, line, OverlayText);
+		y += TEXT_LINE_HEIGHT;
+	}
+
+	return area;
+}
+
+
+// Chrome's trace event format, one complete event per stage with times in
+// microseconds from when the profiler started
+bool writeProfileTrace(const char* fileName) {
+	if (!tracing) return false;
+
+	FILE* f;
+	if (fopen_s(&f, fileName, "wb") != 0) return false;
+
+	f64 usPerTick = 1000000.0 / (f64)getPerformanceFrequency();
+	bool first = true;
+
+	fprintf(f, "{\"traceEvents\":[\n");
+
+	for (i32 i = 0; i < numThreads; ++i) {
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+			first ? "" : ",\n", i, i == numThreads - 1 ? "Main" : "Worker", i);
+		first = false;
+
+		usize numEvents = threads[i].numEvents.load(std::memory_order_acquire);
+
+		for (usize e = 0; e < numEvents; ++e) {
+			const TraceEvent& event = threads[i].events[e];
+
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				stageNames[(int)event.stage], i,
+				(f64)(event.start - traceStart) * usPerTick,
+				(f64)(event.end - event.start) * usPerTick);
+		}
+
+		if (numEvents == TRACE_EVENTS_PER_THREAD) {
+			logWarning("Trace buffer for thread %i filled up, later events were dropped", i);
+		}
+	}
+
+	fprintf(f, "\n]}\n");
+
+	return fclose(f) == 0;
+}
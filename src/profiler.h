@@ -0,0 +1,66 @@
+#pragma once
+
+#include "types.h"
+#include "system.h"
+
+struct DrawContext;
+struct ClipRect;
+
+// Times named stages on every thread. Totals feed the on-screen overlay, and
+// with tracing on each stage is also kept as an event for a Chrome trace
+// (chrome://tracing or ui.perfetto.dev).
+enum class ProfileStage {
+	Events,
+	Frame,
+	Transform,
+	Walk,
+	Clear,
+	Bin,
+	Raster,
+	LoadMap,
+	Decode,
+	ExtendedNodes,
+	Layout,
+	Lod,
+	Count
+};
+
+enum class ProfileCounter {
+	LinesDrawn,
+	TileLines,
+	Count
+};
+
+// Call after initJobs, it keeps a slot for every thread that can run jobs
+void initProfiler(bool trace);
+
+void recordProfileStage(ProfileStage stage, u64 start, u64 end);
+void countProfile(ProfileCounter counter, u64 amount = 1);
+
+// Times the enclosing scope
+struct ProfileScope {
+	ProfileStage stage;
+	u64          start;
+
+	ProfileScope(ProfileStage stage) : stage(stage), start(getPerformanceCounter()) {}
+	~ProfileScope() { recordProfileStage(stage, start, getPerformanceCounter()); }
+};
+
+
+// Stages and counters summed over every thread between beginning and ending
+// a frame, so jobs count at their cpu time rather than wall time
+struct ProfileFrame {
+	f64 frameMs;
+	f64 stageMs[(int)ProfileStage::Count];
+	u64 counters[(int)ProfileCounter::Count];
+};
+
+void beginProfileFrame();
+void endProfileFrame();
+const ProfileFrame& getProfileFrame();
+
+// Draws the last finished frame's numbers in the top left corner and returns
+// the area it covered
+ClipRect drawProfileOverlay(DrawContext& context);
+
+bool writeProfileTrace(const char* fileName);
@@ -3,6 +3,11 @@
 #include "system.h"
 #include "memory.h"
 #include "vectors.h"
+#include "jobs.h"
+#include "convert.h"
+#include "lod.h"
+#include "profiler.h"
+#include "memtrace.h"
 
 #include "math.h"
 
@@ -19,97 +24,294 @@ i32 pointOnLineSide(f32 testx, f32 testy, f32 linex, f32 liney, f32 dx, f32 dy)
 }
 
 
-void drawLine(DrawContext &context, i32 x1, i32 y1, i32 x2, i32 y2, Color color) {
-	i32 dx = x2 - x1;
-	i32 dy = y2 - y1;
+struct LineCommand {
+	f32   x1, y1, x2, y2;
+	Color color;
+};
 
-	if (abs(dx) >= abs(dy)) {
-		if (x2 < x1) {
-			i32 temp = x2;
-			x2 = x1;
-			x1 = temp;
+struct LineList {
+	Array<LineCommand> commands;
+	MemoryArena*       arena;
+};
 
-			temp = y2;
-			y2 = y1;
-			y1 = temp;
 
-			dx = x2 - x1;
-			dy = y2 - y1;
-		}
+static void recordLine(DrawContext &context, f32 x1, f32 y1, f32 x2, f32 y2, Color color) {
+	arrayPush(context.lines->arena, context.lines->commands, { x1, y1, x2, y2, color });
+}
 
-		if (x2 < 0 || x1 >= context.w) return;
-		if ((y2 < 0 && y1 < 0) || (y2 >= context.h && y1 >= context.h)) return;
-		
-		i32 clipx = x1 < 0 ? -x1 : 0;
 
-		f32 ystep = (f32)dy / (f32)dx;
-		f32 yf = y1 + clipx * ystep;
+// One writer per pixel format. The colour is packed once per line, after
+// that every pixel is a single store.
+template<PixelFormat format> struct PixelWriter;
 
-		if (x2 >= context.w) x2 = context.w - 1;
+template<> struct PixelWriter<PixelFormat::BGRA32> {
+	typedef u32 Pixel;
 
-		for (i32 x = x1 < 0 ? 0 : x1; x <= x2; ++x) {
-			i32 y = (i32)yf;
+	static Pixel pack(Color color) {
+		return (color.r << 16) | (color.g << 8) | color.b;
+	}
 
-			if (y >= 0 && y < context.h) {
-				u32* dest = (u32*)(context.pixels + (y * context.pitch)) + x;
+	static void write(u8* row, i32 x, Pixel pixel) {
+		((u32*)row)[x] = pixel;
+	}
+};
 
-				*dest = (color.r << context.rshift)
-					| (color.g << context.gshift)
-					| (color.b << context.bshift);
-			}
+template<> struct PixelWriter<PixelFormat::RGBA32> {
+	typedef u32 Pixel;
 
-			yf += ystep;
-		}
+	static Pixel pack(Color color) {
+		return (color.b << 16) | (color.g << 8) | color.r;
 	}
-	else {
-		if (y2 < y1) {
-			i32 temp = x2;
-			x2 = x1;
-			x1 = temp;
 
-			temp = y2;
-			y2 = y1;
-			y1 = temp;
+	static void write(u8* row, i32 x, Pixel pixel) {
+		((u32*)row)[x] = pixel;
+	}
+};
+
+// No 24-bit integer type, so these are three byte stores
+template<> struct PixelWriter<PixelFormat::BGR24> {
+	struct Pixel { u8 bytes[3]; };
+
+	static Pixel pack(Color color) {
+		return { { color.b, color.g, color.r } };
+	}
+
+	static void write(u8* row, i32 x, Pixel pixel) {
+		*(Pixel*)(row + x * 3) = pixel;
+	}
+};
+
+template<> struct PixelWriter<PixelFormat::RGB24> {
+	struct Pixel { u8 bytes[3]; };
+
+	static Pixel pack(Color color) {
+		return { { color.r, color.g, color.b } };
+	}
+
+	static void write(u8* row, i32 x, Pixel pixel) {
+		*(Pixel*)(row + x * 3) = pixel;
+	}
+};
+
+template<> struct PixelWriter<PixelFormat::RGB565> {
+	typedef u16 Pixel;
+
+	static Pixel pack(Color color) {
+		return (u16)(((color.r >> 3) << 11) | ((color.g >> 2) << 5) | (color.b >> 3));
+	}
+
+	static void write(u8* row, i32 x, Pixel pixel) {
+		((u16*)row)[x] = pixel;
+	}
+};
+
+
+bool choosePixelFormat(i32 bitsPerPixel, u32 rmask, u32 gmask, u32 bmask, PixelFormat* format) {
+	if (bitsPerPixel == 32 && rmask == 0xFF0000 && gmask == 0xFF00 && bmask == 0xFF) *format = PixelFormat::BGRA32;
+	else if (bitsPerPixel == 32 && rmask == 0xFF && gmask == 0xFF00 && bmask == 0xFF0000) *format = PixelFormat::RGBA32;
+	else if (bitsPerPixel == 24 && rmask == 0xFF0000 && gmask == 0xFF00 && bmask == 0xFF) *format = PixelFormat::BGR24;
+	else if (bitsPerPixel == 24 && rmask == 0xFF && gmask == 0xFF00 && bmask == 0xFF0000) *format = PixelFormat::RGB24;
+	else if (bitsPerPixel == 16 && rmask == 0xF800 && gmask == 0x7E0 && bmask == 0x1F) *format = PixelFormat::RGB565;
+	else return false;
+
+	return true;
+}
+
+
+// Positions along the minor axis are fixed32. Lines are cut down to the
+// screen before converting, which keeps them in range for screens up to 32k
+// pixels across.
+
+
+static i64 floorDiv(i64 a, i64 b) {
+	i64 result = a / b;
+	if (a % b != 0 && (a < 0) != (b < 0)) result--;
+	return result;
+}
+
+
+static i64 ceilDiv(i64 a, i64 b) {
+	i64 result = a / b;
+	if (a % b != 0 && (a < 0) == (b < 0)) result++;
+	return result;
+}
+
 
-			dx = x2 - x1;
-			dy = y2 - y1;
+// Liang-Barsky, cuts the line down to the part inside the box. False if
+// none of it is.
+static bool clipLineToBox(f64* x1, f64* y1, f64* x2, f64* y2, f64 left, f64 top, f64 right, f64 bottom) {
+	f64 dx = *x2 - *x1;
+	f64 dy = *y2 - *y1;
+
+	f64 p[4] = { -dx, dx, -dy, dy };
+	f64 q[4] = { *x1 - left, right - *x1, *y1 - top, bottom - *y1 };
+
+	f64 t1 = 0.0;
+	f64 t2 = 1.0;
+
+	for (int i = 0; i < 4; ++i) {
+		if (p[i] == 0.0) {
+			if (q[i] < 0.0) return false;
+			continue;
 		}
 
-		if (y2 < 0 || y1 >= context.h) return;
-		if ((x2 < 0 && x1 < 0) || (x2 >= context.w && x1 >= context.w)) return;
+		f64 t = q[i] / p[i];
 
-		i32 clipy = y1 < 0 ? -y1 : 0;
-		f32 xstep = (f32)dx / (f32)dy;
-		f32 xf = x1 + clipy * xstep;
+		if (p[i] < 0.0) {
+			if (t > t2) return false;
+			if (t > t1) t1 = t;
+		}
+		else {
+			if (t < t1) return false;
+			if (t < t2) t2 = t;
+		}
+	}
+
+	f64 startx = *x1;
+	f64 starty = *y1;
 
-		if (y2 >= context.h) y2 = context.h - 1;
+	*x1 = startx + t1 * dx;
+	*y1 = starty + t1 * dy;
+	*x2 = startx + t2 * dx;
+	*y2 = starty + t2 * dy;
 
-		for (i32 y = y1 < 0 ? 0 : y1; y <= y2; ++y) {
-			i32 x = (int)xf;
+	return true;
+}
 
-			if (x >= 0 && x < context.w) {
-				u32* dest = (u32*)(context.pixels + (y * context.pitch)) + x;
 
-				*dest = (color.r << context.rshift)
-					| (color.g << context.gshift)
-					| (color.b << context.bshift);
-			}
+// Walks the major axis a one pixel at a time, each pixel taking the minor
+// axis b at its centre. Where the minor position lands depends only on the
+// line and the screen size, never on the clip rectangle, so a line lands on
+// the same pixels however it is clipped. The clip rectangle just narrows the
+// range of steps, worked out exactly up front instead of testing each pixel.
+template<PixelFormat format, bool steep>
+static void stepLine(DrawContext &context, f64 a1, f64 b1, f64 a2, f64 b2, typename PixelWriter<format>::Pixel pixel) {
+	typedef PixelWriter<format> Writer;
+
+	const ClipRect& clip = context.clip;
+
+	if (a2 < a1) {
+		f64 temp = a2;
+		a2 = a1;
+		a1 = temp;
+
+		temp = b2;
+		b2 = b1;
+		b1 = temp;
+	}
+
+	i32 first = (i32)floor(a1);
+	i32 last = (i32)floor(a2);
+
+	f64 slope = a2 > a1 ? (b2 - b1) / (a2 - a1) : 0.0;
+
+	fixed32 step = (fixed32)lrint(slope * fixedUnit);
+	fixed32 start = (fixed32)lrint((b1 + (first + 0.5 - a1) * slope) * fixedUnit);
+
+	i64 amin = steep ? clip.y1 : clip.x1;
+	i64 amax = (steep ? clip.y2 : clip.x2) - 1;
+
+	// Minor positions that land inside the clip rectangle
+	i64 lowest = (i64)(steep ? clip.x1 : clip.y1) << fracBits;
+	i64 highest = ((i64)(steep ? clip.x2 : clip.y2) << fracBits) - 1;
+
+	i64 from = first > amin ? first : amin;
+	i64 to = last < amax ? last : amax;
+
+	if (step > 0) {
+		i64 enter = first + ceilDiv(lowest - start, step);
+		i64 leave = first + floorDiv(highest - start, step);
+
+		if (enter > from) from = enter;
+		if (leave < to) to = leave;
+	}
+	else if (step < 0) {
+		i64 enter = first + ceilDiv(highest - start, step);
+		i64 leave = first + floorDiv(lowest - start, step);
+
+		if (enter > from) from = enter;
+		if (leave < to) to = leave;
+	}
+	else if (start < lowest || start > highest) {
+		return;
+	}
+
+	if (from > to) return;
+
+	fixed32 b = (fixed32)(start + (from - first) * step);
 
-			xf += xstep;
+	for (i32 a = (i32)from; a <= (i32)to; ++a) {
+		if (steep) {
+			Writer::write(context.pixels + (a * context.pitch), b >> fracBits, pixel);
 		}
+		else {
+			Writer::write(context.pixels + ((b >> fracBits) * context.pitch), a, pixel);
+		}
+
+		b += step;
+	}
+}
+
+
+template<PixelFormat format>
+static void rasterizeLine(DrawContext &context, f32 x1, f32 y1, f32 x2, f32 y2, Color color) {
+	typedef PixelWriter<format> Writer;
+
+	f64 ax = x1;
+	f64 ay = y1;
+	f64 bx = x2;
+	f64 by = y2;
+
+	bool steep = fabs(by - ay) > fabs(bx - ax);
+
+	f64 right = context.w + 1.0;
+	f64 bottom = context.h + 1.0;
+
+	// The guard box is the same for every clip rectangle, so clipping to it
+	// doesn't move any pixels. Most lines are already inside it.
+	bool inside = ax >= -1.0 && ax <= right && bx >= -1.0 && bx <= right
+		&& ay >= -1.0 && ay <= bottom && by >= -1.0 && by <= bottom;
+
+	if (!inside && !clipLineToBox(&ax, &ay, &bx, &by, -1.0, -1.0, right, bottom)) return;
+
+	typename Writer::Pixel pixel = Writer::pack(color);
+
+	if (steep) stepLine<format, true>(context, ay, ax, by, bx, pixel);
+	else stepLine<format, false>(context, ax, ay, bx, by, pixel);
+}
+
+
+static void rasterizeAnyLine(DrawContext &context, f32 x1, f32 y1, f32 x2, f32 y2, Color color) {
+	switch (context.format) {
+		case PixelFormat::BGRA32: rasterizeLine<PixelFormat::BGRA32>(context, x1, y1, x2, y2, color); break;
+		case PixelFormat::RGBA32: rasterizeLine<PixelFormat::RGBA32>(context, x1, y1, x2, y2, color); break;
+		case PixelFormat::BGR24:  rasterizeLine<PixelFormat::BGR24>(context, x1, y1, x2, y2, color); break;
+		case PixelFormat::RGB24:  rasterizeLine<PixelFormat::RGB24>(context, x1, y1, x2, y2, color); break;
+		case PixelFormat::RGB565: rasterizeLine<PixelFormat::RGB565>(context, x1, y1, x2, y2, color); break;
 	}
 }
 
 
+void drawLine(DrawContext &context, f32 x1, f32 y1, f32 x2, f32 y2, Color color) {
+	countProfile(ProfileCounter::LinesDrawn);
+
+	if (context.lines) {
+		recordLine(context, x1, y1, x2, y2, color);
+		return;
+	}
+
+	rasterizeAnyLine(context, x1, y1, x2, y2, color);
+}
+
+
 void drawWorldLine(View &view, DrawContext &context, f32 fx1, f32 fy1, f32 fx2, f32 fy2, Color color) {
 	f32 x_offset = context.xcenter - view.offset.x;
 	f32 y_offset = context.ycenter + view.offset.y;
 
-	// TODO: The casting should really be done inside drawLine so sub-pixel calculations can be done
-	i32 x1 = (i32)(x_offset + (fx1 * view.zoom));
-	i32 x2 = (i32)(x_offset + (fx2 * view.zoom));
-	i32 y1 = (i32)(y_offset - (fy1 * view.zoom));
-	i32 y2 = (i32)(y_offset - (fy2 * view.zoom));
+	f32 x1 = x_offset + (fx1 * view.zoom);
+	f32 x2 = x_offset + (fx2 * view.zoom);
+	f32 y1 = y_offset - (fy1 * view.zoom);
+	f32 y2 = y_offset - (fy2 * view.zoom);
 
 	drawLine(context, x1, y1, x2, y2, color);
 }
@@ -143,60 +345,221 @@ static Color AutoMapLedge = { 135, 38, 8 };
 static Color AutoMapUnmarked = { 131, 131, 131 };
 
 
-static void renderSubSector(View &view, DrawContext &context, Map *map, i16 subsector, bool highlighted) {
-	auto ss = map->subsectors[subsector];
+// What the frame draws segs with. Vertexes are projected once for the frame,
+// along with their outcodes, when the context has scratch memory, otherwise
+// segs are projected one at a time. Zoomed out, lod swaps the segs for a
+// simplified level.
+struct FrameGeometry {
+	ScreenVertex*   screen;
+	u8*             outcodes;
+	const LodLevel* lod;
+};
 
-	for (i16 i = 0; i < ss.numsegs; ++i) {
-		auto seg = map->segs[i + ss.firstseg];
 
-		auto v1 = map->vertexes[seg.v1];
-		auto v2 = map->vertexes[seg.v2];
+static FrameGeometry prepareFrameGeometry(Map* map, View &view, DrawContext &context) {
+	ProfileScope profile(ProfileStage::Transform);
 
-		Color lineColor;
+	FrameGeometry result = {};
 
-		if (highlighted) {
-			if (seg.backsector == -1)
-				lineColor = AutoMapOneSided;
-			else {
-				auto frontsector = map->sectors.data + seg.frontsector;
-				auto backsector = map->sectors.data + seg.backsector;
-
-				if (frontsector->floorheight != backsector->floorheight)
-					lineColor = AutoMapLedge;
-				else if (frontsector->ceilingheight != backsector->ceilingheight)
-					lineColor = AutoMapDoor;
-				else
-					lineColor = AutoMapUnmarked;
-			}
-		}
-		else {
-			lineColor = DimLine;
+	result.lod = chooseLodLevel(map, view.zoom);
+
+	if (!context.scratch) return result;
+
+	ScreenTransform transform;
+	transform.xoffset = context.xcenter - view.offset.x;
+	transform.yoffset = context.ycenter + view.offset.y;
+	transform.zoom = view.zoom;
+	// A line's end pixels can sit up to half a pixel past its end points
+	transform.clipx1 = context.clip.x1 - 1.0f;
+	transform.clipy1 = context.clip.y1 - 1.0f;
+	transform.clipx2 = context.clip.x2 + 1.0f;
+	transform.clipy2 = context.clip.y2 + 1.0f;
+
+	result.screen = arenaPush<ScreenVertex>(context.scratch, map->vertexes.length, MAP_SLICE_ALIGNMENT);
+	result.outcodes = memoryAlloc(context.scratch, map->vertexes.length);
+
+	transformVertexes(result.screen, result.outcodes, map->vertexes.data, map->vertexes.length, transform);
+
+	return result;
+}
+
+
+static Color lineColor(Map* map, const Seg& seg, bool highlighted) {
+	if (!highlighted) return DimLine;
+
+	switch (getLineKind(map, seg)) {
+		case LineKind::OneSided: return AutoMapOneSided;
+		case LineKind::Ledge:    return AutoMapLedge;
+		case LineKind::Door:     return AutoMapDoor;
+		default:                 return AutoMapUnmarked;
+	}
+}
+
+
+static void renderLine(View &view, DrawContext &context, Map *map, const FrameGeometry& frame, i32 v1, i32 v2, Color color) {
+	if (frame.screen) {
+		auto s1 = frame.screen[v1];
+		auto s2 = frame.screen[v2];
+
+		drawLine(context, s1.x, s1.y, s2.x, s2.y, color);
+	}
+	else {
+		auto w1 = map->vertexes[v1];
+		auto w2 = map->vertexes[v2];
+
+		drawWorldLine(view, context, w1.x, w1.y, w2.x, w2.y, color);
+	}
+}
+
+
+// Segs are laid out depth first, so a run of them is always a whole set of
+// subtrees and drawing it in order matches walking the tree
+static void renderSegs(View &view, DrawContext &context, Map *map, const FrameGeometry& frame, i32 first, i32 last, bool highlighted) {
+	if (frame.lod) {
+		i32 firstLine, lastLine;
+		findLodLines(map, *frame.lod, first, last, &firstLine, &lastLine);
+
+		for (i32 i = firstLine; i < lastLine; ++i) {
+			auto line = map->lodLines[i];
+
+			if (frame.outcodes && (frame.outcodes[line.v1] & frame.outcodes[line.v2])) continue;
+
+			renderLine(view, context, map, frame, line.v1, line.v2, lineColor(map, map->segs[line.seg], highlighted));
 		}
-		drawWorldLine(view, context, v1.x, v1.y, v2.x, v2.y, lineColor);
+
+		return;
+	}
+
+	for (i32 i = first; i < last; ++i) {
+		auto seg = map->segs[i];
+		if (seg.linedef < 0) continue;
+
+		// Both ends beyond the same edge, drawLine would reject it anyway
+		if (frame.outcodes && (frame.outcodes[seg.v1] & frame.outcodes[seg.v2])) continue;
+
+		renderLine(view, context, map, frame, seg.v1, seg.v2, lineColor(map, seg, highlighted));
 	}
 }
 
-static void renderBspNode(Map* map, View &view, DrawContext &context, i32 nodeNum, RenderState& state, bool highlighted = false) {
-	i32 cursor = nodeNum;
 
-	while(!(cursor & SubsectorChildFlag)) {
-		const Node& node = map->nodes[cursor];
+static void renderSegRange(View &view, DrawContext &context, Map *map, const FrameGeometry& frame, i32 first, i32 last, i32 highlightFirst, i32 highlightLast) {
+	i32 a = highlightFirst < first ? first : (highlightFirst > last ? last : highlightFirst);
+	i32 b = highlightLast < a ? a : (highlightLast > last ? last : highlightLast);
+
+	renderSegs(view, context, map, frame, first, a, false);
+	renderSegs(view, context, map, frame, a, b, true);
+	renderSegs(view, context, map, frame, b, last, false);
+}
+
+
+struct CullRect {
+	f32 left, right, bottom, top;
+};
+
+enum class BoxVisibility {
+	Outside,
+	Partial,
+	Inside
+};
+
+
+// World space area covered by the clip rectangle, padded by a pixel for the rounding
+// done when lines are projected
+static CullRect calculateCullRect(View &view, DrawContext &context) {
+	f32 x_offset = context.xcenter - view.offset.x;
+	f32 y_offset = context.ycenter + view.offset.y;
 
-		bool callHighlighted = highlighted;
+	CullRect result;
+	result.left = (context.clip.x1 - 1 - x_offset) / view.zoom;
+	result.right = (context.clip.x2 + 1 - x_offset) / view.zoom;
+	result.bottom = (y_offset - context.clip.y2 - 1) / view.zoom;
+	result.top = (y_offset - context.clip.y1 + 1) / view.zoom;
 
-		if (state.selectedNode == cursor) {
-			callHighlighted = state.highlightedSide == 0;
-			highlighted = state.highlightedSide == 1;
+	return result;
+}
+
+
+// Node boxes are whole map units while extended node vertexes can be
+// fractional, so boxes get a unit of slack
+static BoxVisibility classifyBox(const CullRect& rect, const f32 bbox[4]) {
+	f32 left = bbox[BoxLeft] - 1;
+	f32 right = bbox[BoxRight] + 1;
+	f32 bottom = bbox[BoxBottom] - 1;
+	f32 top = bbox[BoxTop] + 1;
+
+	if (right < rect.left || left > rect.right || top < rect.bottom || bottom > rect.top) return BoxVisibility::Outside;
+	if (left >= rect.left && right <= rect.right && bottom >= rect.bottom && top <= rect.top) return BoxVisibility::Inside;
+
+	return BoxVisibility::Partial;
+}
+
+
+struct CullStep {
+	i32 node;
+	i32 first, last;
+};
+
+const i32 MAX_CULL_STEPS = 256;
+
+// Walks down from the root skipping any child whose box is off screen. Fully
+// visible children and subsectors are drawn as one run. Steps come off the
+// stack in seg order, so segs are drawn in the same order as with no culling.
+static void renderVisibleSegs(View &view, DrawContext &context, Map *map, const FrameGeometry& frame, i32 highlightFirst, i32 highlightLast) {
+	ProfileScope profile(ProfileStage::Walk);
+
+	CullRect rect = calculateCullRect(view, context);
+
+	CullStep steps[MAX_CULL_STEPS];
+	i32 numSteps = 0;
+
+	const Node& root = map->nodes[map->nodes.length - 1];
+	i32 treeLast = root.firstseg[1] + root.numsegs[1];
+
+	steps[numSteps++] = { (i32)map->nodes.length - 1, 0, 0 };
+
+	while (numSteps > 0) {
+		CullStep step = steps[--numSteps];
+
+		if (step.node < 0) {
+			renderSegRange(view, context, map, frame, step.first, step.last, highlightFirst, highlightLast);
+			continue;
 		}
 
-		i32 side = 0;
-		renderBspNode(map, view, context, node.children[side], state, callHighlighted);
+		const Node& node = map->nodes[step.node];
+		CullStep childSteps[2];
+		i32 numChildSteps = 0;
 
-		side ^= 1;
-		cursor = node.children[side];
+		for (i32 side = 0; side < 2; ++side) {
+			BoxVisibility visibility = classifyBox(rect, node.bbox[side]);
+			if (visibility == BoxVisibility::Outside) continue;
+
+			i32 first = node.firstseg[side];
+			i32 last = first + node.numsegs[side];
+
+			if (visibility == BoxVisibility::Partial && !(node.children[side] & SubsectorChildFlag)) {
+				childSteps[numChildSteps++] = { node.children[side], first, last };
+			}
+			else {
+				childSteps[numChildSteps++] = { -1, first, last };
+			}
+		}
+
+		// Children go on in reverse so the first one comes off next. If the
+		// stack is full they are just drawn whole, nothing else is due first.
+		if (numSteps + numChildSteps <= MAX_CULL_STEPS) {
+			for (i32 i = numChildSteps - 1; i >= 0; --i) {
+				steps[numSteps++] = childSteps[i];
+			}
+		}
+		else {
+			for (i32 i = 0; i < numChildSteps; ++i) {
+				renderSegRange(view, context, map, frame, childSteps[i].first, childSteps[i].last, highlightFirst, highlightLast);
+			}
+		}
 	}
 
-	renderSubSector(view, context, map, cursor & ~SubsectorChildFlag, highlighted);
+	// Subsectors the tree never reaches were laid out after it
+	renderSegRange(view, context, map, frame, treeLast, (i32)map->segs.length, highlightFirst, highlightLast);
 }
 
 
@@ -232,24 +595,132 @@ View calculateView(Map* map, DrawContext& drawContext, i32 nodeNum) {
 }
 
 
-void clearScreen(DrawContext& drawContext) {
-	u32  src = ((0 << drawContext.rshift) & drawContext.rmask) |
-		((0 << drawContext.gshift) & drawContext.gmask) |
-		((0 << drawContext.bshift) & drawContext.bmask);
+ClipRect fullClipRect(DrawContext& drawContext) {
+	return { 0, 0, drawContext.w, drawContext.h };
+}
+
+
+ClipRect calculateNodeRect(Map* map, View& view, DrawContext& drawContext, i32 nodeNum) {
+	ClipRect result = {};
 
-	for (i32 y = 0; y < drawContext.h; ++y) {
-		u32* dest = (u32*)(drawContext.pixels + (y * drawContext.pitch));
+	if (map == 0 || (nodeNum & SubsectorChildFlag)) return result;
 
-		for (i32 x = 0; x < drawContext.w; ++x) {
-			*dest = src;
-			dest++;
+	auto node = map->nodes.data + nodeNum;
+
+	f32 left = fminf(node->bbox[0][BoxLeft], node->bbox[1][BoxLeft]);
+	f32 right = fmaxf(node->bbox[0][BoxRight], node->bbox[1][BoxRight]);
+	f32 bottom = fminf(node->bbox[0][BoxBottom], node->bbox[1][BoxBottom]);
+	f32 top = fmaxf(node->bbox[0][BoxTop], node->bbox[1][BoxTop]);
+
+	f32 x_offset = drawContext.xcenter - view.offset.x;
+	f32 y_offset = drawContext.ycenter + view.offset.y;
+
+	// Same slack as culling, plus a couple of pixels for rounding
+	f32 pad = view.zoom + 2;
+
+	f32 x1 = floorf(x_offset + left * view.zoom - pad);
+	f32 x2 = ceilf(x_offset + right * view.zoom + pad);
+	f32 y1 = floorf(y_offset - top * view.zoom - pad);
+	f32 y2 = ceilf(y_offset - bottom * view.zoom + pad);
+
+	result.x1 = x1 < 0 ? 0 : (x1 > drawContext.w ? drawContext.w : (i32)x1);
+	result.x2 = x2 < 0 ? 0 : (x2 > drawContext.w ? drawContext.w : (i32)x2);
+	result.y1 = y1 < 0 ? 0 : (y1 > drawContext.h ? drawContext.h : (i32)y1);
+	result.y2 = y2 < 0 ? 0 : (y2 > drawContext.h ? drawContext.h : (i32)y2);
+
+	return result;
+}
+
+
+template<PixelFormat format>
+static void clearRect(DrawContext& drawContext, Color color) {
+	typedef PixelWriter<format> Writer;
+
+	const ClipRect& clip = drawContext.clip;
+
+	typename Writer::Pixel pixel = Writer::pack(color);
+
+	for (i32 y = clip.y1; y < clip.y2; ++y) {
+		u8* row = drawContext.pixels + (y * drawContext.pitch);
+
+		for (i32 x = clip.x1; x < clip.x2; ++x) {
+			Writer::write(row, x, pixel);
 		}
 	}
 }
 
-void renderMap(Map* map, View& view, DrawContext& drawContext, RenderState& state) {
-	clearScreen(drawContext);
 
+void fillRect(DrawContext& drawContext, ClipRect rect, Color color) {
+	DrawContext area = drawContext;
+	area.clip.x1 = max(rect.x1, drawContext.clip.x1);
+	area.clip.y1 = max(rect.y1, drawContext.clip.y1);
+	area.clip.x2 = min(rect.x2, drawContext.clip.x2);
+	area.clip.y2 = min(rect.y2, drawContext.clip.y2);
+
+	switch (area.format) {
+		case PixelFormat::BGRA32: clearRect<PixelFormat::BGRA32>(area, color); break;
+		case PixelFormat::RGBA32: clearRect<PixelFormat::RGBA32>(area, color); break;
+		case PixelFormat::BGR24:  clearRect<PixelFormat::BGR24>(area, color); break;
+		case PixelFormat::RGB24:  clearRect<PixelFormat::RGB24>(area, color); break;
+		case PixelFormat::RGB565: clearRect<PixelFormat::RGB565>(area, color); break;
+	}
+}
+
+// 3x5 pixel glyphs, one row per entry with the left pixel in bit 2
+struct Glyph {
+	char c;
+	u8   rows[5];
+};
+
+static const Glyph glyphs[] = {
+	{ '0', { 7, 5, 5, 5, 7 } }, { '1', { 2, 6, 2, 2, 7 } }, { '2', { 7, 1, 7, 4, 7 } }, { '3', { 7, 1, 7, 1, 7 } },
+	{ '4', { 5, 5, 7, 1, 1 } }, { '5', { 7, 4, 7, 1, 7 } }, { '6', { 7, 4, 7, 5, 7 } }, { '7', { 7, 1, 1, 1, 1 } },
+	{ '8', { 7, 5, 7, 5, 7 } }, { '9', { 7, 5, 7, 1, 7 } }, { 'A', { 2, 5, 7, 5, 5 } }, { 'B', { 6, 5, 6, 5, 6 } },
+	{ 'C', { 3, 4, 4, 4, 3 } }, { 'D', { 6, 5, 5, 5, 6 } }, { 'E', { 7, 4, 6, 4, 7 } }, { 'F', { 7, 4, 6, 4, 4 } },
+	{ 'G', { 3, 4, 5, 5, 3 } }, { 'H', { 5, 5, 7, 5, 5 } }, { 'I', { 7, 2, 2, 2, 7 } }, { 'J', { 1, 1, 1, 5, 2 } },
+	{ 'K', { 5, 5, 6, 5, 5 } }, { 'L', { 4, 4, 4, 4, 7 } }, { 'M', { 5, 7, 7, 5, 5 } }, { 'N', { 6, 5, 5, 5, 5 } },
+	{ 'O', { 2, 5, 5, 5, 2 } }, { 'P', { 6, 5, 6, 4, 4 } }, { 'Q', { 2, 5, 5, 6, 3 } }, { 'R', { 6, 5, 6, 5, 5 } },
+	{ 'S', { 3, 4, 2, 1, 6 } }, { 'T', { 7, 2, 2, 2, 2 } }, { 'U', { 5, 5, 5, 5, 7 } }, { 'V', { 5, 5, 5, 5, 2 } },
+	{ 'W', { 5, 5, 7, 7, 5 } }, { 'X', { 5, 5, 2, 5, 5 } }, { 'Y', { 5, 5, 2, 2, 2 } }, { 'Z', { 7, 1, 2, 4, 7 } },
+	{ '.', { 0, 0, 0, 0, 2 } }, { ':', { 0, 2, 0, 2, 0 } }, { '-', { 0, 0, 7, 0, 0 } }, { '_', { 0, 0, 0, 0, 7 } },
+	{ '/', { 1, 1, 2, 4, 4 } },
+};
+
+
+// Letters are all drawn upper case, characters without a glyph are left blank
+void drawText(DrawContext& context, i32 x, i32 y, const char* text, Color color) {
+	for (const char* c = text; *c; ++c, x += TEXT_ADVANCE) {
+		char upper = (*c >= 'a' && *c <= 'z') ? *c - 'a' + 'A' : *c;
+
+		for (const Glyph& glyph : glyphs) {
+			if (glyph.c != upper) continue;
+
+			for (i32 row = 0; row < 5; ++row) {
+				for (i32 column = 0; column < 3; ++column) {
+					if (!(glyph.rows[row] & (4 >> column))) continue;
+
+					i32 px = x + column * TEXT_SCALE;
+					i32 py = y + row * TEXT_SCALE;
+
+					fillRect(context, { px, py, px + TEXT_SCALE, py + TEXT_SCALE }, color);
+				}
+			}
+
+			break;
+		}
+	}
+}
+
+
+
+void clearScreen(DrawContext& drawContext) {
+	ProfileScope profile(ProfileStage::Clear);
+
+	Color black = { 0, 0, 0 };
+	fillRect(drawContext, drawContext.clip, black);
+}
+
+static void drawMapLines(Map* map, View& view, DrawContext& drawContext, RenderState& state) {
 	Node* selectedNode = 0;
 
 	if (!(state.selectedNode & SubsectorChildFlag)) selectedNode = map->nodes.data + state.selectedNode;
@@ -260,7 +731,17 @@ void renderMap(Map* map, View& view, DrawContext& drawContext, RenderState& stat
 		drawWorldBox(view, drawContext, selectedNode->bbox[state.highlightedSide], LightBox);
 	}
 
-	renderBspNode(map, view, drawContext, (i32)map->nodes.length - 1, state);
+	// Everything under the highlighted child is highlighted, the rest is dim
+	i32 highlightFirst = 0;
+	i32 highlightLast = 0;
+
+	if (selectedNode) {
+		highlightFirst = selectedNode->firstseg[state.highlightedSide];
+		highlightLast = highlightFirst + selectedNode->numsegs[state.highlightedSide];
+	}
+
+	FrameGeometry frame = prepareFrameGeometry(map, view, drawContext);
+	renderVisibleSegs(view, drawContext, map, frame, highlightFirst, highlightLast);
 
 	if (selectedNode) {
 		f32 xextent = selectedNode->dx * 128;
@@ -269,4 +750,165 @@ void renderMap(Map* map, View& view, DrawContext& drawContext, RenderState& stat
 
 		drawWorldLine(view, drawContext, selectedNode->x, selectedNode->y, selectedNode->x + selectedNode->dx, selectedNode->y + selectedNode->dy, SplitLine);
 	}
-}
\ No newline at end of file
+}
+
+const i32 TILE_SIZE = 128;
+
+struct TileJob {
+	DrawContext* context;
+	LineCommand* commands;
+	i32*         indices;
+	i32          first, last;
+	ClipRect     rect;
+};
+
+
+// Screen tiles a line's pixels can land in. Pixels are placed at their
+// centres, which can put the end ones past the end points, so the box is
+// padded by one.
+static bool lineTileRange(const DrawContext& context, const LineCommand& line, ClipRect* tiles) {
+	const ClipRect& clip = context.clip;
+
+	f32 x1 = floorf(fminf(line.x1, line.x2)) - 1;
+	f32 x2 = floorf(fmaxf(line.x1, line.x2)) + 1;
+	f32 y1 = floorf(fminf(line.y1, line.y2)) - 1;
+	f32 y2 = floorf(fmaxf(line.y1, line.y2)) + 1;
+
+	// Clamped before converting, the ends can be far off screen
+	if (x1 < clip.x1) x1 = (f32)clip.x1;
+	if (y1 < clip.y1) y1 = (f32)clip.y1;
+	if (x2 >= clip.x2) x2 = (f32)(clip.x2 - 1);
+	if (y2 >= clip.y2) y2 = (f32)(clip.y2 - 1);
+
+	if (x1 > x2 || y1 > y2) return false;
+
+	tiles->x1 = (i32)x1 / TILE_SIZE;
+	tiles->y1 = (i32)y1 / TILE_SIZE;
+	tiles->x2 = (i32)x2 / TILE_SIZE;
+	tiles->y2 = (i32)y2 / TILE_SIZE;
+
+	return true;
+}
+
+
+// Lines can't be drawn out of order as later ones overwrite earlier ones, so
+// each tile keeps its lines in the order they were recorded
+static void rasterizeTile(void* data) {
+	auto job = (TileJob*)data;
+
+	DrawContext tile = *job->context;
+	tile.clip = job->rect;
+	tile.lines = 0;
+
+	clearScreen(tile);
+
+	ProfileScope profile(ProfileStage::Raster);
+
+	// Lines were counted as they were recorded, lines crossing tile edges
+	// are drawn once per tile on top of that
+	countProfile(ProfileCounter::TileLines, job->last - job->first);
+
+	for (i32 i = job->first; i < job->last; ++i) {
+		const LineCommand& line = job->commands[job->indices[i]];
+		rasterizeAnyLine(tile, line.x1, line.y1, line.x2, line.y2, line.color);
+	}
+}
+
+
+static void renderMapTiled(Map* map, View& view, DrawContext& drawContext, RenderState& state) {
+	MemoryArena* arena = drawContext.scratch;
+
+	LineList lines = {};
+	lines.arena = arena;
+	lines.commands.capacity = map->segs.length + 16;
+	lines.commands.data = arenaPush<LineCommand>(arena, lines.commands.capacity);
+
+	DrawContext recorder = drawContext;
+	recorder.lines = &lines;
+
+	drawMapLines(map, view, recorder, state);
+
+	const ClipRect& clip = drawContext.clip;
+	if (clip.x2 <= clip.x1 || clip.y2 <= clip.y1) return;
+
+	u64 binStart = getPerformanceCounter();
+
+	i32 tilesX = (drawContext.w + TILE_SIZE - 1) / TILE_SIZE;
+	i32 tilesY = (drawContext.h + TILE_SIZE - 1) / TILE_SIZE;
+	i32 numTiles = tilesX * tilesY;
+
+	// Count each tile's lines, then lay the index lists out back to back
+	auto offsets = arenaPush<i32>(arena, numTiles + 1);
+	auto cursors = arenaPush<i32>(arena, numTiles);
+
+	for (i32 t = 0; t <= numTiles; ++t) offsets[t] = 0;
+
+	for (usize i = 0; i < lines.commands.length; ++i) {
+		ClipRect range;
+		if (!lineTileRange(drawContext, lines.commands.data[i], &range)) continue;
+
+		for (i32 ty = range.y1; ty <= range.y2; ++ty) {
+			for (i32 tx = range.x1; tx <= range.x2; ++tx) {
+				offsets[ty * tilesX + tx + 1]++;
+			}
+		}
+	}
+
+	for (i32 t = 0; t < numTiles; ++t) {
+		offsets[t + 1] += offsets[t];
+		cursors[t] = offsets[t];
+	}
+
+	auto indices = arenaPush<i32>(arena, offsets[numTiles] + 1);
+
+	for (usize i = 0; i < lines.commands.length; ++i) {
+		ClipRect range;
+		if (!lineTileRange(drawContext, lines.commands.data[i], &range)) continue;
+
+		for (i32 ty = range.y1; ty <= range.y2; ++ty) {
+			for (i32 tx = range.x1; tx <= range.x2; ++tx) {
+				indices[cursors[ty * tilesX + tx]++] = (i32)i;
+			}
+		}
+	}
+
+	recordProfileStage(ProfileStage::Bin, binStart, getPerformanceCounter());
+
+	auto jobs = arenaPush<TileJob>(arena, numTiles);
+	JobGroup group = {};
+
+	for (i32 ty = clip.y1 / TILE_SIZE; ty <= (clip.y2 - 1) / TILE_SIZE; ++ty) {
+		for (i32 tx = clip.x1 / TILE_SIZE; tx <= (clip.x2 - 1) / TILE_SIZE; ++tx) {
+			i32 t = ty * tilesX + tx;
+			TileJob* job = jobs + t;
+
+			job->context = &drawContext;
+			job->commands = lines.commands.data;
+			job->indices = indices;
+			job->first = offsets[t];
+			job->last = offsets[t + 1];
+
+			job->rect.x1 = max(tx * TILE_SIZE, clip.x1);
+			job->rect.y1 = max(ty * TILE_SIZE, clip.y1);
+			job->rect.x2 = min((tx + 1) * TILE_SIZE, clip.x2);
+			job->rect.y2 = min((ty + 1) * TILE_SIZE, clip.y2);
+
+			addJob(&group, rasterizeTile, job);
+		}
+	}
+
+	waitForJobs(&group);
+}
+
+
+void renderMap(Map* map, View& view, DrawContext& drawContext, RenderState& state) {
+	MemoryTag memoryTag("frame");
+
+	if (drawContext.backend == RenderBackend::Tiled && drawContext.scratch) {
+		renderMapTiled(map, view, drawContext, state);
+		return;
+	}
+
+	clearScreen(drawContext);
+	drawMapLines(map, view, drawContext, state);
+}
@@ -3,6 +3,7 @@
 #include "types.h"
 #include "map.h"
 #include "vectors.h"
+#include "memory.h"
 
 struct View {
 	v2f offset;
@@ -10,10 +11,36 @@ struct View {
 };
 
 struct RenderState {
-	i16 selectedNode;
+	i32 selectedNode;
 	i32 highlightedSide;
 };
 
+// Screen area in pixels, x2 and y2 are exclusive
+struct ClipRect {
+	i32 x1, y1;
+	i32 x2, y2;
+};
+
+// Direct draws straight into the frame on the calling thread. Tiled records
+// the frame's lines, bins them into screen tiles and clears and rasterizes
+// the tiles in parallel on the job system. Both give identical pixels.
+enum class RenderBackend {
+	Direct,
+	Tiled
+};
+
+// Pixel layouts the renderer can draw into, named by byte order in memory.
+// The 32-bit formats leave the fourth byte zero.
+enum class PixelFormat {
+	BGRA32,
+	RGBA32,
+	BGR24,
+	RGB24,
+	RGB565
+};
+
+struct LineList;
+
 struct DrawContext {
 	i32 w;
 	i32 h;
@@ -22,17 +49,44 @@ struct DrawContext {
 	i32 pitch;
 	i32 bytesPerPixel;
 	u8* pixels;
-	u32 rshift, gshift, bshift;
-	u32 rmask, gmask, bmask;
+	PixelFormat format;
+	// Drawing never touches pixels outside this, set it to the whole screen
+	// unless only part of it needs redrawing
+	ClipRect clip;
+	RenderBackend backend;
+	// Per frame memory for the tiled backend, the caller resets it between
+	// frames. Without it frames are drawn directly.
+	MemoryArena* scratch;
+	// Set while the tiled backend records a frame
+	LineList* lines;
 };
+// Works out the format from a surface's channel masks, false if there is
+// no writer for it
+bool choosePixelFormat(i32 bitsPerPixel, u32 rmask, u32 gmask, u32 bmask, PixelFormat* format);
+
 View calculateView(Map* map, DrawContext& drawContext, i32 nodeNum);
+ClipRect fullClipRect(DrawContext& drawContext);
+// Screen area that can change when the highlighted side of the node flips,
+// empty if the node is entirely off screen
+ClipRect calculateNodeRect(Map* map, View& view, DrawContext& drawContext, i32 nodeNum);
 
 i32 pointOnLineSide(f32 x, f32 y, const Node& node);
 i32 pointOnLineSide(f32 testx, f32 testy, f32 linex, f32 liney, f32 dx, f32 dy);
 
-void drawLine(DrawContext& context, i32 x1, i32 y1, i32 x2, i32 y2, Color color);
+// Screen coordinates keep their fractions, pixel (x, y) covers x to x + 1
+void drawLine(DrawContext& context, f32 x1, f32 y1, f32 x2, f32 y2, Color color);
 void drawWorldLine(View& view, DrawContext& context, f32 fx1, f32 fy1, f32 fx2, f32 fy2, Color color);
 
+// Solid rectangle straight into the pixels, limited to the clip rectangle
+void fillRect(DrawContext& context, ClipRect rect, Color color);
+
+// Small built in font for overlays, x and y are the top left of the text
+const i32 TEXT_SCALE = 2;
+const i32 TEXT_ADVANCE = 4 * TEXT_SCALE;
+const i32 TEXT_LINE_HEIGHT = 7 * TEXT_SCALE;
+
+void drawText(DrawContext& context, i32 x, i32 y, const char* text, Color color);
+
 void initRenderer(DrawContext drawContext);
 
 void renderMap(Map* map, View& view, DrawContext& drawContext, RenderState& state);
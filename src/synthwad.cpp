@@ -0,0 +1,650 @@
+#include "synthwad.h"
+#include "mapformat.h"
+#include "memory.h"
+#include "system.h"
+#include "wad.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// Map units per cell. Polygons get bigger cells so their corners are still
+// distinct after rounding to whole units.
+const i32 GRID_CELL_SIZE = 64;
+const i32 POLYGON_CELL_SIZE = 256;
+
+// Vertexes and node partitions are 16 bit, so the whole map has to fit in
+// a square this size around the origin
+const i32 MAX_MAP_EXTENT = 32000;
+
+const u32 MIN_POLYGON_SIDES = 3;
+const u32 MAX_POLYGON_SIDES = 8;
+
+// Segs and sides use 0xFFFF for none, so that many lines or sides is too many
+const u32 MAX_LINES = 0xFFFF;
+// Polygon edges are split into more segs as the target goes up, so the
+// lines never run out
+const u32 POLYGON_SEGS_PER_SPLIT = 60000;
+
+// Marks vertexes no line uses while generating. They are numbered after all
+// the ones lines use, which are the only ones in VERTEXES with XNOD nodes.
+const u32 EXTRA_VERTEX = 0x80000000;
+const u32 SUBSECTOR_CHILD = 0x80000000;
+
+const f64 PI = 3.14159265358979323846;
+
+struct SynthVertex {
+	// 16.16 fixed point
+	i32 x, y;
+};
+
+struct SynthSeg {
+	u32 v1, v2;
+	u32 line;
+	u8  side;
+};
+
+struct SynthSubsector {
+	u32 firstSeg, numSegs;
+};
+
+struct SynthNode {
+	i16 x, y, dx, dy;
+	i16 bbox[2][4];
+	u32 children[2];
+};
+
+struct SynthMap {
+	const SynthWadSpec* spec;
+	Random random;
+
+	i32 cellSize;
+	i32 columns, rows;
+	i32 originX, originY;
+	u32 segsPerEdge;
+
+	// Vertex number of each grid corner
+	u32* gridPoints;
+
+	SynthVertex*    lineVertexes;
+	u32             numLineVertexes;
+	SynthVertex*    extraVertexes;
+	u32             numExtraVertexes;
+	MapLine*        lines;
+	u32             numLines;
+	MapSideDef*     sides;
+	u32             numSides;
+	SynthSeg*       segs;
+	u32             numSegs;
+	SynthSubsector* subsectors;
+	u32             numSubsectors;
+	SynthNode*      nodes;
+	u32             numNodes;
+	u32             depth;
+};
+
+struct SynthLump {
+	const char* name;
+	const void* data;
+	u32         size;
+};
+
+
+const char* synthLayoutName(SynthLayout layout) {
+	return layout == SynthLayout::Grid ? "grid" : "polygons";
+}
+
+
+const char* synthTreeName(SynthTree tree) {
+	return tree == SynthTree::Balanced ? "balanced" : "unbalanced";
+}
+
+
+static inline i32 toFixed(i32 units) {
+	return units * 65536;
+}
+
+
+static inline f64 randomUnit(Random& random) {
+	return (f64)(nextRandom(random) & 0xFFFFFF) / (f64)0x1000000;
+}
+
+
+static u32 addVertex(SynthMap& map, i32 x, i32 y, bool usedByLine) {
+	if (usedByLine) {
+		map.lineVertexes[map.numLineVertexes] = { x, y };
+		return map.numLineVertexes++;
+	}
+
+	map.extraVertexes[map.numExtraVertexes] = { x, y };
+	return EXTRA_VERTEX | map.numExtraVertexes++;
+}
+
+
+static u32 addLine(SynthMap& map, u32 v1, u32 v2, bool twoSided) {
+	MapLine& line = map.lines[map.numLines];
+	line = {};
+	line.v1 = (u16)v1;
+	line.v2 = (u16)v2;
+	line.flags = twoSided ? 4 : 1;
+	line.sidenum[0] = (u16)map.numSides;
+	line.sidenum[1] = twoSided ? (u16)(map.numSides + 1) : MapNoSide;
+
+	for (i32 s = 0; s < (twoSided ? 2 : 1); ++s) {
+		MapSideDef& side = map.sides[map.numSides++];
+		side = {};
+		side.topTexture[0] = '-';
+		side.bottomTexture[0] = '-';
+		side.midTexture[0] = '-';
+	}
+
+	return map.numLines++;
+}
+
+
+static void addSeg(SynthMap& map, u32 v1, u32 v2, u32 line, u8 side) {
+	map.segs[map.numSegs++] = { v1, v2, line, side };
+}
+
+
+static u32 gridPoint(SynthMap& map, i32 x, i32 y) {
+	return map.gridPoints[y * (map.columns + 1) + x];
+}
+
+
+// Grid lines run the full width or height of the map with their front side
+// facing in at the edges. Horizontal lines come first, numbered by row, then
+// vertical ones numbered by column.
+static void addGridLines(SynthMap& map) {
+	for (i32 y = 0; y <= map.rows; ++y) {
+		for (i32 x = 0; x <= map.columns; ++x) {
+			bool edge = x == 0 || y == 0 || x == map.columns || y == map.rows;
+			i32 px = toFixed(map.originX + x * map.cellSize);
+			i32 py = toFixed(map.originY + y * map.cellSize);
+
+			map.gridPoints[y * (map.columns + 1) + x] = addVertex(map, px, py, edge);
+		}
+	}
+
+	for (i32 y = 0; y <= map.rows; ++y) {
+		u32 left = gridPoint(map, 0, y);
+		u32 right = gridPoint(map, map.columns, y);
+
+		if (y == 0) addLine(map, right, left, false);
+		else addLine(map, left, right, y < map.rows);
+	}
+
+	for (i32 x = 0; x <= map.columns; ++x) {
+		u32 bottom = gridPoint(map, x, 0);
+		u32 top = gridPoint(map, x, map.rows);
+
+		if (x == map.columns) addLine(map, top, bottom, false);
+		else addLine(map, bottom, top, x > 0);
+	}
+}
+
+
+// Clockwise from the bottom left corner
+static void emitGridCell(SynthMap& map, i32 x, i32 y) {
+	u32 bottomLine = y;
+	u32 topLine = y + 1;
+	u32 leftLine = map.rows + 1 + x;
+	u32 rightLine = map.rows + 1 + x + 1;
+
+	addSeg(map, gridPoint(map, x, y), gridPoint(map, x, y + 1), leftLine, 0);
+	addSeg(map, gridPoint(map, x, y + 1), gridPoint(map, x + 1, y + 1), topLine, 0);
+	addSeg(map, gridPoint(map, x + 1, y + 1), gridPoint(map, x + 1, y), rightLine, x + 1 == map.columns ? 0 : 1);
+	addSeg(map, gridPoint(map, x + 1, y), gridPoint(map, x, y), bottomLine, y == 0 ? 0 : 1);
+}
+
+
+// Corners on a circle in clockwise order always make a convex polygon, the
+// angles are only nudged a little so they stay in order
+static void emitPolygonCell(SynthMap& map, i32 x, i32 y) {
+	Random& random = map.random;
+	i32 size = map.cellSize;
+
+	f64 cx = map.originX + x * size + size * 0.5 + (randomUnit(random) - 0.5) * size * 0.2;
+	f64 cy = map.originY + y * size + size * 0.5 + (randomUnit(random) - 0.5) * size * 0.2;
+	f64 radius = size * (0.25 + randomUnit(random) * 0.15);
+
+	u32 numSides = MIN_POLYGON_SIDES + nextRandom(random) % (MAX_POLYGON_SIDES - MIN_POLYGON_SIDES + 1);
+	f64 step = 2.0 * PI / numSides;
+	f64 start = randomUnit(random) * 2.0 * PI;
+
+	u32 corners[MAX_POLYGON_SIDES];
+
+	for (u32 i = 0; i < numSides; ++i) {
+		f64 angle = start - i * step + (randomUnit(random) - 0.5) * step * 0.5;
+
+		i32 px = (i32)lround(cx + radius * cos(angle));
+		i32 py = (i32)lround(cy + radius * sin(angle));
+
+		corners[i] = addVertex(map, toFixed(px), toFixed(py), true);
+	}
+
+	for (u32 i = 0; i < numSides; ++i) {
+		u32 first = corners[i];
+		u32 last = corners[(i + 1) % numSides];
+		u32 line = addLine(map, first, last, false);
+
+		SynthVertex from = map.lineVertexes[first];
+		SynthVertex to = map.lineVertexes[last];
+		u32 previous = first;
+
+		for (u32 s = 1; s <= map.segsPerEdge; ++s) {
+			u32 next = last;
+
+			if (s < map.segsPerEdge) {
+				i32 px = from.x + (i32)((i64)(to.x - from.x) * s / map.segsPerEdge);
+				i32 py = from.y + (i32)((i64)(to.y - from.y) * s / map.segsPerEdge);
+
+				next = addVertex(map, px, py, false);
+			}
+
+			addSeg(map, previous, next, line, 0);
+			previous = next;
+		}
+	}
+}
+
+
+static void setRegionBox(SynthMap& map, i16 box[4], i32 x0, i32 y0, i32 x1, i32 y1) {
+	box[0] = (i16)(map.originY + y1 * map.cellSize);
+	box[1] = (i16)(map.originY + y0 * map.cellSize);
+	box[2] = (i16)(map.originX + x0 * map.cellSize);
+	box[3] = (i16)(map.originX + x1 * map.cellSize);
+}
+
+
+// Splits the cells in [x0, x1) x [y0, y1) until each is its own subsector.
+// Children come before their parents, so the root ends up last.
+static u32 buildTree(SynthMap& map, i32 x0, i32 y0, i32 x1, i32 y1, u32 depth) {
+	if (x1 - x0 == 1 && y1 - y0 == 1) {
+		u32 firstSeg = map.numSegs;
+
+		if (map.spec->layout == SynthLayout::Grid) emitGridCell(map, x0, y0);
+		else emitPolygonCell(map, x0, y0);
+
+		if (depth > map.depth) map.depth = depth;
+
+		map.subsectors[map.numSubsectors] = { firstSeg, map.numSegs - firstSeg };
+		return SUBSECTOR_CHILD | map.numSubsectors++;
+	}
+
+	bool vertical = x1 - x0 >= y1 - y0;
+	bool balanced = map.spec->tree == SynthTree::Balanced;
+
+	SynthNode node = {};
+	u32 front, back;
+
+	if (vertical) {
+		i32 split = balanced ? (x0 + x1) / 2 : x0 + 1;
+
+		// Pointing up, so the right side is in front
+		node.x = (i16)(map.originX + split * map.cellSize);
+		node.y = (i16)(map.originY + y0 * map.cellSize);
+		node.dx = 0;
+		node.dy = (i16)((y1 - y0) * map.cellSize);
+
+		front = buildTree(map, split, y0, x1, y1, depth + 1);
+		back = buildTree(map, x0, y0, split, y1, depth + 1);
+
+		setRegionBox(map, node.bbox[0], split, y0, x1, y1);
+		setRegionBox(map, node.bbox[1], x0, y0, split, y1);
+	}
+	else {
+		i32 split = balanced ? (y0 + y1) / 2 : y0 + 1;
+
+		// Pointing left, so the upper side is in front
+		node.x = (i16)(map.originX + x1 * map.cellSize);
+		node.y = (i16)(map.originY + split * map.cellSize);
+		node.dx = (i16)(-(x1 - x0) * map.cellSize);
+		node.dy = 0;
+
+		front = buildTree(map, x0, split, x1, y1, depth + 1);
+		back = buildTree(map, x0, y0, x1, split, depth + 1);
+
+		setRegionBox(map, node.bbox[0], x0, split, x1, y1);
+		setRegionBox(map, node.bbox[1], x0, y0, x1, split);
+	}
+
+	node.children[0] = front;
+	node.children[1] = back;
+
+	map.nodes[map.numNodes] = node;
+	return map.numNodes++;
+}
+
+
+static inline u32 resolveVertex(const SynthMap& map, u32 vertex) {
+	return vertex & EXTRA_VERTEX ? map.numLineVertexes + (vertex & ~EXTRA_VERTEX) : vertex;
+}
+
+
+static SynthVertex getVertex(const SynthMap& map, u32 vertex) {
+	return vertex & EXTRA_VERTEX ? map.extraVertexes[vertex & ~EXTRA_VERTEX] : map.lineVertexes[vertex];
+}
+
+
+static MapVertex* buildVertexLump(MemoryArena* arena, const SynthMap& map, u32 count) {
+	auto result = arenaPush<MapVertex>(arena, count);
+
+	for (u32 i = 0; i < count; ++i) {
+		SynthVertex v = i < map.numLineVertexes ? map.lineVertexes[i] : map.extraVertexes[i - map.numLineVertexes];
+		result[i] = { (i16)(v.x >> 16), (i16)(v.y >> 16) };
+	}
+
+	return result;
+}
+
+
+static MapSeg* buildVanillaSegs(MemoryArena* arena, const SynthMap& map) {
+	auto result = arenaPush<MapSeg>(arena, map.numSegs);
+
+	for (u32 i = 0; i < map.numSegs; ++i) {
+		const SynthSeg& seg = map.segs[i];
+		const MapLine& line = map.lines[seg.line];
+
+		SynthVertex v1 = getVertex(map, seg.v1);
+		SynthVertex v2 = getVertex(map, seg.v2);
+		SynthVertex from = map.lineVertexes[seg.side ? line.v2 : line.v1];
+
+		// Binary angle, a full turn is 65536
+		f64 angle = atan2((f64)(v2.y - v1.y), (f64)(v2.x - v1.x));
+		f64 offset = hypot((f64)(v1.x - from.x), (f64)(v1.y - from.y)) / 65536.0;
+
+		result[i].v1 = (u16)resolveVertex(map, seg.v1);
+		result[i].v2 = (u16)resolveVertex(map, seg.v2);
+		result[i].angle = (i16)(u16)((i32)lround(angle * 32768.0 / PI) & 0xFFFF);
+		result[i].linedef = (u16)seg.line;
+		result[i].side = seg.side;
+		result[i].xoffset = (i16)lround(offset);
+	}
+
+	return result;
+}
+
+
+static MapSubsector* buildVanillaSubsectors(MemoryArena* arena, const SynthMap& map) {
+	auto result = arenaPush<MapSubsector>(arena, map.numSubsectors);
+
+	for (u32 i = 0; i < map.numSubsectors; ++i) {
+		result[i].numSegs = (u16)map.subsectors[i].numSegs;
+		result[i].firstSeg = (u16)map.subsectors[i].firstSeg;
+	}
+
+	return result;
+}
+
+
+static MapNode* buildVanillaNodes(MemoryArena* arena, const SynthMap& map) {
+	auto result = arenaPush<MapNode>(arena, map.numNodes);
+
+	for (u32 i = 0; i < map.numNodes; ++i) {
+		const SynthNode& node = map.nodes[i];
+
+		result[i].x = node.x;
+		result[i].y = node.y;
+		result[i].dx = node.dx;
+		result[i].dy = node.dy;
+		memcpy(result[i].bbox, node.bbox, sizeof(node.bbox));
+
+		for (i32 c = 0; c < 2; ++c) {
+			u32 child = node.children[c];
+			result[i].children[c] = child & SUBSECTOR_CHILD ? (u16)(MapSubsectorChildFlag | (child & ~SUBSECTOR_CHILD)) : (u16)child;
+		}
+	}
+
+	return result;
+}
+
+
+static u8* writeBytes(u8* dest, const void* src, usize size) {
+	memcpy(dest, src, size);
+	return dest + size;
+}
+
+
+// XNOD: the new vertexes in 16.16 fixed point, then the seg count of each
+// subsector, the segs and the nodes, each list after a 32 bit count
+static u8* buildExtendedNodes(MemoryArena* arena, const SynthMap& map, u32* size) {
+	*size = 4 + 4 + 4 + map.numExtraVertexes * 8
+		+ 4 + map.numSubsectors * 4
+		+ 4 + map.numSegs * 11
+		+ 4 + map.numNodes * 32;
+
+	u8* result = memoryAlloc(arena, *size);
+	u8* p = writeBytes(result, "XNOD", 4);
+
+	p = writeBytes(p, &map.numLineVertexes, 4);
+	p = writeBytes(p, &map.numExtraVertexes, 4);
+
+	for (u32 i = 0; i < map.numExtraVertexes; ++i) {
+		p = writeBytes(p, &map.extraVertexes[i].x, 4);
+		p = writeBytes(p, &map.extraVertexes[i].y, 4);
+	}
+
+	p = writeBytes(p, &map.numSubsectors, 4);
+
+	for (u32 i = 0; i < map.numSubsectors; ++i) {
+		p = writeBytes(p, &map.subsectors[i].numSegs, 4);
+	}
+
+	p = writeBytes(p, &map.numSegs, 4);
+
+	for (u32 i = 0; i < map.numSegs; ++i) {
+		const SynthSeg& seg = map.segs[i];
+		u32 v1 = resolveVertex(map, seg.v1);
+		u32 v2 = resolveVertex(map, seg.v2);
+		u16 line = (u16)seg.line;
+
+		p = writeBytes(p, &v1, 4);
+		p = writeBytes(p, &v2, 4);
+		p = writeBytes(p, &line, 2);
+		p = writeBytes(p, &seg.side, 1);
+	}
+
+	p = writeBytes(p, &map.numNodes, 4);
+
+	for (u32 i = 0; i < map.numNodes; ++i) {
+		const SynthNode& node = map.nodes[i];
+
+		p = writeBytes(p, &node.x, 2);
+		p = writeBytes(p, &node.y, 2);
+		p = writeBytes(p, &node.dx, 2);
+		p = writeBytes(p, &node.dy, 2);
+		p = writeBytes(p, node.bbox, sizeof(node.bbox));
+		p = writeBytes(p, node.children, sizeof(node.children));
+	}
+
+	return result;
+}
+
+
+static void addLump(Slice<SynthLump>& lumps, const char* name, const void* data, u32 size) {
+	lumps.data[lumps.length++] = { name, data, size };
+}
+
+
+static bool writeWad(const char* fileName, Slice<SynthLump> lumps) {
+	FILE* f;
+	if (fopen_s(&f, fileName, "wb") != 0) return false;
+
+	u32 header[3];
+	u32 position = sizeof(header);
+
+	for (usize i = 0; i < lumps.length; ++i) position += lumps.data[i].size;
+
+	memcpy(header, "PWAD", 4);
+	header[1] = (u32)lumps.length;
+	header[2] = position;
+
+	bool success = fwrite(header, sizeof(header), 1, f) == 1;
+
+	for (usize i = 0; i < lumps.length && success; ++i) {
+		auto& lump = lumps.data[i];
+		success = lump.size == 0 || fwrite(lump.data, lump.size, 1, f) == 1;
+	}
+
+	position = sizeof(header);
+
+	for (usize i = 0; i < lumps.length && success; ++i) {
+		auto& lump = lumps.data[i];
+
+		u8 entry[16] = {};
+		memcpy(entry, &position, 4);
+		memcpy(entry + 4, &lump.size, 4);
+		usize nameLength = strlen(lump.name);
+		memcpy(entry + 8, lump.name, nameLength < 8 ? nameLength : 8);
+
+		success = fwrite(entry, sizeof(entry), 1, f) == 1;
+		position += lump.size;
+	}
+
+	success = fclose(f) == 0 && success;
+
+	return success;
+}
+
+
+bool writeSynthWad(const char* fileName, const SynthWadSpec& spec, SynthWadStats* stats) {
+	MemoryArena* scratch = threadTemporary();
+	ArenaScope scope(scratch);
+
+	SynthMap map = {};
+	map.spec = &spec;
+	map.random = { spec.seed ? spec.seed : 1 };
+
+	u32 targetSegs = spec.targetSegs < 8 ? 8 : spec.targetSegs;
+	u32 cells;
+
+	if (spec.layout == SynthLayout::Grid) {
+		map.cellSize = GRID_CELL_SIZE;
+		map.segsPerEdge = 1;
+		cells = targetSegs / 4;
+	}
+	else {
+		// Polygons average five and a half sides
+		map.cellSize = POLYGON_CELL_SIZE;
+		map.segsPerEdge = 1 + targetSegs / POLYGON_SEGS_PER_SPLIT;
+		cells = targetSegs * 2 / (11 * map.segsPerEdge);
+	}
+
+	map.columns = (i32)ceil(sqrt((f64)cells));
+	if (map.columns < 2) map.columns = 2;
+	map.rows = (i32)((cells + map.columns - 1) / map.columns);
+	if (map.rows < 1) map.rows = 1;
+
+	i32 width = map.columns * map.cellSize;
+	i32 height = map.rows * map.cellSize;
+
+	if (width > MAX_MAP_EXTENT || height > MAX_MAP_EXTENT) {
+		logError("%u segs will not fit in a synthetic %s map", spec.targetSegs, synthLayoutName(spec.layout));
+		return false;
+	}
+
+	map.originX = -width / 2;
+	map.originY = -height / 2;
+
+	u32 numCells = (u32)(map.columns * map.rows);
+	u32 maxLines, maxVertexes, maxSegs;
+
+	if (spec.layout == SynthLayout::Grid) {
+		maxLines = map.columns + map.rows + 2;
+		maxVertexes = (map.columns + 1) * (map.rows + 1);
+		maxSegs = numCells * 4;
+		map.gridPoints = arenaPush<u32>(scratch, maxVertexes);
+	}
+	else {
+		maxLines = numCells * MAX_POLYGON_SIDES;
+		maxVertexes = maxLines * map.segsPerEdge;
+		maxSegs = maxVertexes;
+	}
+
+	map.lineVertexes = arenaPush<SynthVertex>(scratch, maxVertexes);
+	map.extraVertexes = arenaPush<SynthVertex>(scratch, maxVertexes);
+	map.lines = arenaPush<MapLine>(scratch, maxLines);
+	map.sides = arenaPush<MapSideDef>(scratch, maxLines * 2);
+	map.segs = arenaPush<SynthSeg>(scratch, maxSegs);
+	map.subsectors = arenaPush<SynthSubsector>(scratch, numCells);
+	map.nodes = arenaPush<SynthNode>(scratch, numCells);
+
+	if (spec.layout == SynthLayout::Grid) addGridLines(map);
+
+	buildTree(map, 0, 0, map.columns, map.rows, 0);
+
+	if (map.numLines >= MAX_LINES || map.numSides >= MAX_LINES) {
+		logError("%u segs needs too many lines for a synthetic %s map", spec.targetSegs, synthLayoutName(spec.layout));
+		return false;
+	}
+
+	u32 numVertexes = map.numLineVertexes + map.numExtraVertexes;
+
+	// Vanilla has 16 bit vertex and seg numbers, the top bit of a child
+	// marks a subsector and all vertexes are whole units
+	bool extended = numVertexes > 0xFFFF || map.numSegs > 0xFFFF
+		|| map.numSubsectors >= MapSubsectorChildFlag || map.numNodes >= MapSubsectorChildFlag
+		|| map.segsPerEdge > 1;
+
+	MapThing thing = {};
+	thing.x = (i16)(map.originX + map.cellSize / 2);
+	thing.y = (i16)(map.originY + map.cellSize / 2);
+	thing.type = 1;
+	thing.options = 7;
+
+	MapSector sector = {};
+	sector.ceilingheight = 128;
+	memcpy(sector.floorpic, "FLOOR4_8", 8);
+	memcpy(sector.ceilingpic, "CEIL3_5", 7);
+	sector.lightlevel = 160;
+
+	u32 numLumps = (u32)MapLumps::Count + spec.fillerLumps;
+	Slice<SynthLump> lumps = { 0, arenaPush<SynthLump>(scratch, numLumps) };
+
+	u32 numMapVertexes = extended ? map.numLineVertexes : numVertexes;
+
+	addLump(lumps, "MAP01", 0, 0);
+	addLump(lumps, "THINGS", &thing, sizeof(thing));
+	addLump(lumps, "LINEDEFS", map.lines, sizeof(MapLine) * map.numLines);
+	addLump(lumps, "SIDEDEFS", map.sides, sizeof(MapSideDef) * map.numSides);
+	addLump(lumps, "VERTEXES", buildVertexLump(scratch, map, numMapVertexes), sizeof(MapVertex) * numMapVertexes);
+
+	if (extended) {
+		u32 nodesSize;
+		u8* nodes = buildExtendedNodes(scratch, map, &nodesSize);
+
+		addLump(lumps, "SEGS", 0, 0);
+		addLump(lumps, "SSECTORS", 0, 0);
+		addLump(lumps, "NODES", nodes, nodesSize);
+	}
+	else {
+		addLump(lumps, "SEGS", buildVanillaSegs(scratch, map), sizeof(MapSeg) * map.numSegs);
+		addLump(lumps, "SSECTORS", buildVanillaSubsectors(scratch, map), sizeof(MapSubsector) * map.numSubsectors);
+		addLump(lumps, "NODES", buildVanillaNodes(scratch, map), sizeof(MapNode) * map.numNodes);
+	}
+
+	addLump(lumps, "SECTORS", &sector, sizeof(sector));
+	addLump(lumps, "REJECT", 0, 0);
+	addLump(lumps, "BLOCKMAP", 0, 0);
+
+	char* fillerNames = arenaPush<char>(scratch, spec.fillerLumps * 9 + 1);
+
+	for (u32 i = 0; i < spec.fillerLumps; ++i) {
+		char* name = fillerNames + i * 9;
+		snprintf(name, 9, "SYN%05u", i % 100000);
+		addLump(lumps, name, 0, 0);
+	}
+
+	if (stats) {
+		stats->segs = map.numSegs;
+		stats->subsectors = map.numSubsectors;
+		stats->nodes = map.numNodes;
+		stats->lines = map.numLines;
+		stats->vertexes = numVertexes;
+		stats->depth = map.depth;
+		stats->extendedNodes = extended;
+	}
+
+	return writeWad(fileName, lumps);
+}
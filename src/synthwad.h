@@ -0,0 +1,65 @@
+#pragma once
+
+#include "types.h"
+
+// Generates wads holding a single synthetic map, MAP01, for benchmarking.
+// The same spec always gives the same bytes. Maps that fit vanilla limits
+// get vanilla nodes, bigger ones XNOD nodes.
+
+// Small deterministic generator for synthetic data
+struct Random {
+	u32 state;
+};
+
+inline u32 nextRandom(Random& random) {
+	u32 x = random.state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	random.state = x;
+	return x;
+}
+
+
+enum class SynthLayout {
+	// Square cells, each a subsector of four segs. The grid lines run the
+	// whole width or height of the map, so lines are split into many segs.
+	Grid,
+	// A random convex polygon in each cell with empty space between them
+	Polygons
+};
+
+enum class SynthTree {
+	// Splits the longer side of each region in half
+	Balanced,
+	// Splits one row or column off each region, so the tree is as deep as
+	// the map is wide plus high
+	Unbalanced
+};
+
+struct SynthWadSpec {
+	SynthLayout layout;
+	SynthTree   tree;
+	u32         targetSegs;
+	u32         seed;
+	// Extra empty lumps after the map, so lump lookups have a directory
+	// the size of a real wad's to search
+	u32         fillerLumps;
+};
+
+struct SynthWadStats {
+	u32  segs;
+	u32  subsectors;
+	u32  nodes;
+	u32  lines;
+	u32  vertexes;
+	u32  depth;
+	bool extendedNodes;
+};
+
+const char* synthLayoutName(SynthLayout layout);
+const char* synthTreeName(SynthTree tree);
+
+// Returns false if the map would not fit in the wad format or the file could
+// not be written
+bool writeSynthWad(const char* fileName, const SynthWadSpec& spec, SynthWadStats* stats);
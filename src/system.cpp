@@ -1,34 +1,411 @@
+#include "system.h"
+
 #include "stdio.h"
 #include "stdarg.h"
 #include "assert.h"
 
-static const int size = 1024;
-static char fmtBuffer[size];
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <new>
 
+// A fixed ring of message slots shared by every thread. Each slot's
+// sequence number says whose turn it is: a producer claims the slot whose
+// sequence matches the write position, formats straight into it and bumps
+// the sequence to hand it to the writer, which hands it back a lap later.
+// Producers only ever race on one compare and swap.
+const usize LOG_SLOTS = 1024;
+const usize LOG_MESSAGE_SIZE = 1024;
 
-void logMessage(const char* format, ...) {
-	va_list aptr;
+enum class LogSlotLevel : u8 {
+	Info,
+	Warning,
+	Error,
+	Fatal
+};
+
+struct LogSlot {
+	std::atomic<usize> sequence;
+	u64                time;
+	LogSlotLevel       level;
+	char               text[LOG_MESSAGE_SIZE];
+};
+
+static LogSlot logSlots[LOG_SLOTS];
+static std::atomic<usize> enqueuePos(0);
+static std::atomic<usize> writtenPos(0);
+
+static std::atomic<bool> loggerRunning(false);
+static std::atomic<bool> writerSleeping(false);
+static std::atomic<LogLevel> minimumLevel(LogLevel::Info);
+static u64 logStart = 0;
 
-	va_start(aptr, format);
-	auto ret = vsnprintf(fmtBuffer, size, format, aptr);
-	va_end(aptr);
+// The writer is never joined, so like the job system's its sync objects are
+// built in raw storage and never torn down underneath it at exit
+alignas(std::mutex) static u8 writerMutexStorage[sizeof(std::mutex)];
+alignas(std::condition_variable) static u8 writerSignalStorage[sizeof(std::condition_variable)];
 
-	if(ret > 0) {
-		printf("%s\n", fmtBuffer);
+static std::mutex* writerMutex = 0;
+static std::condition_variable* writerSignal = 0;
+
+
+static const char* levelPrefix(LogSlotLevel level) {
+	switch (level) {
+		case LogSlotLevel::Warning: return "WARNING: ";
+		case LogSlotLevel::Error:   return "ERROR: ";
+		case LogSlotLevel::Fatal:   return "FATAL: ";
+		default:                    return "";
 	}
 }
 
 
-void reportFatalError(const char* format, ...) {
-	va_list aptr;
+static void writeMessage(const LogSlot& slot) {
+	f64 seconds = logStart ? (f64)(slot.time - logStart) / (f64)getPerformanceFrequency() : 0.0;
+
+	printf("[%9.3f] %s%s\n", seconds, levelPrefix(slot.level), slot.text);
+}
 
-	va_start(aptr, format);
-	auto ret = vsnprintf(fmtBuffer, size, format, aptr);
-	va_end(aptr);
 
-	if(ret > 0) {
-		printf("FATAL: %s\n", fmtBuffer);
+// Only the writer thread takes messages, in the order they were claimed
+static void logWriter() {
+	usize pos = writtenPos.load(std::memory_order_relaxed);
+
+	for (;;) {
+		LogSlot& slot = logSlots[pos % LOG_SLOTS];
+
+		if (slot.sequence.load(std::memory_order_acquire) == pos + 1) {
+			writeMessage(slot);
+
+			slot.sequence.store(pos + LOG_SLOTS, std::memory_order_release);
+			writtenPos.store(++pos, std::memory_order_release);
+			continue;
+		}
+
+		fflush(stdout);
+
+		// Producers only signal when they see the writer asleep. With the
+		// fences on both sides, either this check sees the new message or
+		// the producer sees writerSleeping and signals.
+		std::unique_lock<std::mutex> lock(*writerMutex);
+		writerSleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (slot.sequence.load(std::memory_order_acquire) != pos + 1) {
+			writerSignal->wait(lock);
+		}
+
+		writerSleeping.store(false, std::memory_order_relaxed);
 	}
+}
+
+
+void initLogger() {
+	for (usize i = 0; i < LOG_SLOTS; ++i) {
+		logSlots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	writerMutex = new (writerMutexStorage) std::mutex;
+	writerSignal = new (writerSignalStorage) std::condition_variable;
+
+	logStart = getPerformanceCounter();
+	loggerRunning.store(true, std::memory_order_release);
+
+	std::thread(logWriter).detach();
+
+	// Whatever is still queued when main returns gets written
+	atexit(flushLog);
+}
+
+
+void setLogLevel(LogLevel level) {
+	minimumLevel.store(level, std::memory_order_relaxed);
+}
+
+
+static void logFormatted(LogSlotLevel level, const char* format, va_list args) {
+	if (!loggerRunning.load(std::memory_order_acquire)) {
+		LogSlot slot;
+		slot.time = 0;
+		slot.level = level;
+		vsnprintf(slot.text, LOG_MESSAGE_SIZE, format, args);
+
+		writeMessage(slot);
+		return;
+	}
+
+	usize pos = enqueuePos.load(std::memory_order_relaxed);
+	LogSlot* slot;
+
+	for (;;) {
+		slot = logSlots + pos % LOG_SLOTS;
+		usize sequence = slot->sequence.load(std::memory_order_acquire);
+
+		if (sequence == pos) {
+			if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+		}
+		else if (sequence < pos) {
+			// Full, wait for the writer to free a slot rather than lose the
+			// message
+			std::this_thread::yield();
+			pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+		else {
+			pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	slot->time = getPerformanceCounter();
+	slot->level = level;
+	vsnprintf(slot->text, LOG_MESSAGE_SIZE, format, args);
+
+	slot->sequence.store(pos + 1, std::memory_order_release);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (writerSleeping.load(std::memory_order_relaxed)) {
+		// Taking the lock waits for a writer between its check and its wait,
+		// so the signal can't arrive before it is waiting
+		{ std::lock_guard<std::mutex> lock(*writerMutex); }
+		writerSignal->notify_one();
+	}
+}
+
+
+void flushLog() {
+	if (loggerRunning.load(std::memory_order_acquire)) {
+		usize target = enqueuePos.load(std::memory_order_acquire);
+
+		// Messages still being formatted are waited on too. A writer that
+		// has stopped for good can't hold up exit by more than a few seconds.
+		auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+		while (writtenPos.load(std::memory_order_acquire) < target && std::chrono::steady_clock::now() < giveUp) {
+			std::this_thread::yield();
+		}
+	}
+
+	fflush(stdout);
+}
+
+
+void logMessage(const char* format, ...) {
+	if (minimumLevel.load(std::memory_order_relaxed) > LogLevel::Info) return;
+
+	va_list args;
+	va_start(args, format);
+	logFormatted(LogSlotLevel::Info, format, args);
+	va_end(args);
+}
+
+
+void logWarning(const char* format, ...) {
+	if (minimumLevel.load(std::memory_order_relaxed) > LogLevel::Warning) return;
+
+	va_list args;
+	va_start(args, format);
+	logFormatted(LogSlotLevel::Warning, format, args);
+	va_end(args);
+}
+
+
+void logError(const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	logFormatted(LogSlotLevel::Error, format, args);
+	va_end(args);
+}
+
+
+void reportFatalError(const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	logFormatted(LogSlotLevel::Fatal, format, args);
+	va_end(args);
+
+	flushLog();
 
 	assert(false);
-}
\ No newline at end of file
+}
+
+
+const char* pathBaseName(const char* path) {
+	const char* result = path;
+
+	for (const char* c = path; *c; ++c) {
+		if (*c == '/' || *c == '\\') result = c + 1;
+	}
+
+	return result;
+}
+
+
+u64 getPerformanceCounter() {
+	return (u64)std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+
+u64 getPerformanceFrequency() {
+	return (u64)std::chrono::steady_clock::period::den / std::chrono::steady_clock::period::num;
+}
+
+
+#ifdef _WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+bool mapFile(const char* name, MappedFile* file) {
+	*file = {};
+
+	HANDLE fileHandle = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (fileHandle == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(fileHandle, &size) || size.QuadPart == 0) {
+		CloseHandle(fileHandle);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(fileHandle, 0, PAGE_READONLY, 0, 0, 0);
+	CloseHandle(fileHandle);
+
+	if (!mapping) return false;
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		CloseHandle(mapping);
+		return false;
+	}
+
+	file->data = (u8*)view;
+	file->size = (usize)size.QuadPart;
+	file->handle = mapping;
+
+	return true;
+}
+
+
+void unmapFile(MappedFile* file) {
+	if (file->data) UnmapViewOfFile(file->data);
+	if (file->handle) CloseHandle((HANDLE)file->handle);
+
+	*file = {};
+}
+
+
+u8* reserveMemory(usize size) {
+	return (u8*)VirtualAlloc(0, (SIZE_T)size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+
+bool commitMemory(u8* address, usize size) {
+	return VirtualAlloc(address, (SIZE_T)size, MEM_COMMIT, PAGE_READWRITE) != 0;
+}
+
+
+void decommitMemory(u8* address, usize size) {
+	VirtualFree(address, (SIZE_T)size, MEM_DECOMMIT);
+}
+
+
+void releaseMemory(u8* address, usize size) {
+	VirtualFree(address, 0, MEM_RELEASE);
+}
+
+
+usize getPageSize() {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+
+	return info.dwPageSize;
+}
+
+
+u64 getFileModifiedTime(const char* name) {
+	WIN32_FILE_ATTRIBUTE_DATA info;
+
+	if (!GetFileAttributesExA(name, GetFileExInfoStandard, &info)) return 0;
+
+	return ((u64)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+}
+
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool mapFile(const char* name, MappedFile* file) {
+	*file = {};
+
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	void* view = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (view == MAP_FAILED) return false;
+
+	file->data = (u8*)view;
+	file->size = (usize)info.st_size;
+
+	return true;
+}
+
+
+void unmapFile(MappedFile* file) {
+	if (file->data) munmap(file->data, file->size);
+
+	*file = {};
+}
+
+
+u8* reserveMemory(usize size) {
+	void* address = mmap(0, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	return address == MAP_FAILED ? 0 : (u8*)address;
+}
+
+
+bool commitMemory(u8* address, usize size) {
+	return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+
+// Dropping the pages first means they read back as zero if committed again,
+// the same as on windows
+void decommitMemory(u8* address, usize size) {
+	madvise(address, size, MADV_DONTNEED);
+	mprotect(address, size, PROT_NONE);
+}
+
+
+void releaseMemory(u8* address, usize size) {
+	munmap(address, size);
+}
+
+
+usize getPageSize() {
+	return (usize)sysconf(_SC_PAGESIZE);
+}
+
+
+u64 getFileModifiedTime(const char* name) {
+	struct stat info;
+
+	if (stat(name, &info) != 0) return 0;
+
+	return (u64)info.st_mtime;
+}
+
+#endif
@@ -1,9 +1,61 @@
 #pragma once
 
+#include "types.h"
 #include "assert.h"
 
+enum class LogLevel {
+	Info,
+	Warning,
+	Error
+};
+
+// Messages are queued and written out on a background thread, so logging
+// never waits on the terminal. Until this is called they are written
+// straight away.
+void initLogger();
+// Messages below this level are dropped, Info by default
+void setLogLevel(LogLevel level);
+// Waits until everything logged so far has been written
+void flushLog();
+
 void logMessage(const char* format, ...);
+void logWarning(const char* format, ...);
+void logError(const char* format, ...);
 
+// Flushes the log before stopping
 void reportFatalError(const char* format, ...);
 
 #define fatalError(fmt, ...) { reportFatalError(fmt, ##__VA_ARGS__); assert(false);}
+
+
+struct MappedFile {
+	u8*   data;
+	usize size;
+	void* handle;
+};
+
+// Maps a whole file read-only into the address space. Pages are only read in
+// from disk when they are first touched.
+bool mapFile(const char* name, MappedFile* file);
+void unmapFile(MappedFile* file);
+
+// Address space that is set aside without any memory behind it. Pages are
+// committed before they are touched and can be decommitted again to hand
+// their memory back, the addresses stay reserved until released.
+u8* reserveMemory(usize size);
+bool commitMemory(u8* address, usize size);
+void decommitMemory(u8* address, usize size);
+void releaseMemory(u8* address, usize size);
+usize getPageSize();
+
+// Last modification time in platform specific units, only useful for
+// comparing against an earlier call. Returns zero on failure.
+u64 getFileModifiedTime(const char* name);
+
+// The part of a path after the last slash or backslash
+const char* pathBaseName(const char* path);
+
+
+// High resolution timer for measuring how long things take
+u64 getPerformanceCounter();
+u64 getPerformanceFrequency();
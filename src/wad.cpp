@@ -2,8 +2,11 @@
 #include "memory.h"
 #include "wad.h"
 #include "system.h"
+#include "jobs.h"
+#include "memtrace.h"
 
 #include "stdio.h"
+#include "string.h"
 
 struct WadInfo {
 	u8   wadId[4];
@@ -20,8 +23,13 @@ struct LumpInfo {
 struct WadFile {
 	const char* name;
 	u8*         data;
+	usize       size;
 	WadInfo     info;
 	LumpInfo*   directory;
+	MappedFile  mapping;
+	u32*        lumpHash;
+	u32         lumpHashMask;
+	u64         contentKey;
 };
 
 
@@ -32,49 +40,206 @@ static usize     maxWads = 0;
 
 void initWads() {
 	maxWads = 127;
-	u8* memory = memoryAlloc(permanent, sizeof(WadFile) * maxWads);
-
-	wadFiles = (WadFile *)memory;
+	wadFiles = arenaPush<WadFile>(permanent, maxWads);
 	numLoadedWads = 0;
 }
 
 
-WadResult loadWadFile(const char *name) {
-	if(numLoadedWads >= maxWads) return WadResult::Failure;
+// Lump names are up to 8 characters, padded with zeroes. Anything after the
+// first zero is ignored so names can be compared as a single u64.
+static inline u64 lumpNameId(const i8* name) {
+	u64 result = 0;
 
-	FILE* f;
-	auto result = fopen_s(&f, name, "rb");
+	for (int i = 0; i < 8 && name[i]; ++i) {
+		result |= (u64)(u8)name[i] << (i * 8);
+	}
 
-	if(result == 0 ) {
-		fseek(f, 0, SEEK_END);
-		auto size = ftell(f);
-		fseek(f, 0, SEEK_SET);
+	return result;
+}
 
-		if(size) {
-			auto mem = memoryAlloc(permanent, size);
 
-			fread(mem, 1, size, f);
+static inline u32 hashLumpName(u64 id) {
+	return (u32)((id * 0x9E3779B97F4A7C15ull) >> 32);
+}
 
-			WadFile *file = wadFiles + numLoadedWads;
 
-			file->info = *((WadInfo*)mem);
-			file->name = name;
-			file->data = mem;
+// Builds an open addressing table over the directory. Slots hold lumpIndex + 1
+// so zero can mark an empty slot. Entries are inserted in directory order so
+// duplicate names sit along the probe sequence in the same order they appear
+// in the directory.
+static void buildLumpHash(WadFile* file) {
+	u32 capacity = 16;
+	while (capacity < file->info.numLumps * 2) capacity <<= 1;
 
-			if(file->info.infoTableOffset + (sizeof(LumpInfo) * file->info.numLumps) <= size) {
-				file->directory = (LumpInfo*)(mem + file->info.infoTableOffset);
-				numLoadedWads++;
-				return WadResult::Success;
-			}
+	file->lumpHash = arenaPush<u32>(permanent, capacity);
+	file->lumpHashMask = capacity - 1;
+
+	memset(file->lumpHash, 0, sizeof(u32) * capacity);
+
+	for (u32 p = 0; p < file->info.numLumps; ++p) {
+		u32 slot = hashLumpName(lumpNameId(file->directory[p].name)) & file->lumpHashMask;
+
+		while (file->lumpHash[slot]) {
+			slot = (slot + 1) & file->lumpHashMask;
 		}
 
+		file->lumpHash[slot] = p + 1;
+	}
+}
+
+
+// Returns the index of the first lump named id within [first, last) of the
+// wad's directory, or -1.
+static i32 findLumpInWad(const WadFile& wad, u64 id, u32 first, u32 last) {
+	u32 slot = hashLumpName(id) & wad.lumpHashMask;
+
+	while (wad.lumpHash[slot]) {
+		u32 p = wad.lumpHash[slot] - 1;
+
+		if (p >= first && p < last && lumpNameId(wad.directory[p].name) == id) {
+			return p;
+		}
+
+		slot = (slot + 1) & wad.lumpHashMask;
+	}
+
+	return -1;
+}
+
+
+static WadResult readWadFile(const char* name, WadFile* file) {
+	FILE* f;
+	auto result = fopen_s(&f, name, "rb");
+
+	if (result != 0) return WadResult::Failure;
+
+	fseek(f, 0, SEEK_END);
+	auto size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	if (size <= 0) {
 		fclose(f);
+		return WadResult::Failure;
+	}
+
+	auto mem = memoryAlloc(permanent, size);
+	auto read = fread(mem, 1, size, f);
+
+	fclose(f);
+
+	if (read != (usize)size) return WadResult::Failure;
+
+	file->data = mem;
+	file->size = size;
+
+	return WadResult::Success;
+}
+
+
+static WadResult mapWadFile(const char* name, WadFile* file) {
+	if (!mapFile(name, &file->mapping)) return WadResult::Failure;
+
+	file->data = file->mapping.data;
+	file->size = file->mapping.size;
+
+	return WadResult::Success;
+}
+
+
+static WadResult loadWadIntoSlot(const char* name, WadLoadMode mode, WadFile* file) {
+	*file = {};
+
+	auto result = mode == WadLoadMode::Mapped ? mapWadFile(name, file) : readWadFile(name, file);
+	if (result != WadResult::Success) return result;
+
+	if (file->size >= sizeof(WadInfo)) {
+		file->info = *((WadInfo*)file->data);
+		file->name = name;
+
+		if(file->info.infoTableOffset + (sizeof(LumpInfo) * file->info.numLumps) <= file->size) {
+			file->directory = (LumpInfo*)(file->data + file->info.infoTableOffset);
+			buildLumpHash(file);
+			return WadResult::Success;
+		}
 	}
 
+	if (mode == WadLoadMode::Mapped) unmapFile(&file->mapping);
+
 	return WadResult::Failure;
 }
 
 
+WadResult loadWadFile(const char *name, WadLoadMode mode) {
+	if(numLoadedWads >= maxWads) return WadResult::Failure;
+
+	auto result = loadWadIntoSlot(name, mode, wadFiles + numLoadedWads);
+	if (result == WadResult::Success) numLoadedWads++;
+
+	return result;
+}
+
+
+struct WadLoadJob {
+	const char* name;
+	WadLoadMode mode;
+	WadFile*    file;
+	WadResult   result;
+};
+
+static void wadLoadJob(void* data) {
+	auto job = (WadLoadJob*)data;
+
+	MemoryTag memoryTag("wad", job->name);
+	job->result = loadWadIntoSlot(job->name, job->mode, job->file);
+}
+
+
+WadResult loadWadFiles(const char** names, usize count, WadLoadMode mode) {
+	if (numLoadedWads + count > maxWads) return WadResult::Failure;
+
+	auto jobs = arenaPush<WadLoadJob>(temporary, count);
+	JobGroup group = {};
+
+	// Every file gets the slot matching its position in the list, so lump
+	// numbers do not depend on which file finishes loading first
+	for (usize i = 0; i < count; ++i) {
+		jobs[i] = { names[i], mode, wadFiles + numLoadedWads + i, WadResult::Failure };
+		addJob(&group, wadLoadJob, jobs + i);
+	}
+
+	waitForJobs(&group);
+
+	WadResult result = WadResult::Success;
+
+	for (usize i = 0; i < count; ++i) {
+		if (jobs[i].result != WadResult::Success) {
+			logError("Failed to load wad %s", names[i]);
+			result = WadResult::Failure;
+		}
+	}
+
+	if (result == WadResult::Success) {
+		numLoadedWads += count;
+	}
+	else if (mode == WadLoadMode::Mapped) {
+		for (usize i = 0; i < count; ++i) {
+			unmapFile(&jobs[i].file->mapping);
+		}
+	}
+
+	return result;
+}
+
+
+void unloadWads() {
+	for (usize i = 0; i < numLoadedWads; ++i) {
+		if (wadFiles[i].mapping.data) unmapFile(&wadFiles[i].mapping);
+	}
+
+	numLoadedWads = 0;
+}
+
+
 const i32 LUMP_MASK = 0xFFFFFF;
 const i32 WAD_MASK  = 0x7F000000;
 const i32 WAD_SHIFT = 24;
@@ -93,26 +258,40 @@ static inline i32 unpackLumpIndex(i32 lumpNum) {
 
 
 LumpNum findLumpByName(const char* name) {
-	LumpNum result = -1;
-
-	const u64 id = *((const u64*)name);
+	const u64 id = lumpNameId(name);
 
 	for(int i = numLoadedWads - 1; i >= 0; --i) {
-		auto wad = wadFiles[i];
+		auto& wad = wadFiles[i];
+
+		i32 p = findLumpInWad(wad, id, 0, wad.info.numLumps);
 
-		for(u32 p = 0; p < wad.info.numLumps; ++p) {
+		if (p != -1) return packLumpNum(i, p);
+	}
 
-			const u64 lid = *((u64*)wad.directory[p].name);
+	return -1;
+}
 
-			if(lid != id) continue;
 
-			result = packLumpNum(i, p);
+LumpNum findLumpInNamespace(const char* name, const char* startMarker, const char* endMarker) {
+	const u64 id = lumpNameId(name);
+	const u64 startId = lumpNameId(startMarker);
+	const u64 endId = lumpNameId(endMarker);
 
-			return result;
-		}
+	for(int i = numLoadedWads - 1; i >= 0; --i) {
+		auto& wad = wadFiles[i];
+
+		i32 start = findLumpInWad(wad, startId, 0, wad.info.numLumps);
+		if (start == -1) continue;
+
+		i32 end = findLumpInWad(wad, endId, start + 1, wad.info.numLumps);
+		if (end == -1) continue;
+
+		i32 p = findLumpInWad(wad, id, start + 1, end);
+
+		if (p != -1) return packLumpNum(i, p);
 	}
 
-	return result;
+	return -1;
 }
 
 
@@ -147,38 +326,199 @@ LumpResult getLumpByName(const char* name) {
 }
 
 
-#include "string.h"
+static const u64 mapLumpIds[(int)MapLumps::Count] = {
+	0,
+	lumpNameId("THINGS"),
+	lumpNameId("LINEDEFS"),
+	lumpNameId("SIDEDEFS"),
+	lumpNameId("VERTEXES"),
+	lumpNameId("SEGS"),
+	lumpNameId("SSECTORS"),
+	lumpNameId("NODES"),
+	lumpNameId("SECTORS"),
+	lumpNameId("REJECT"),
+	lumpNameId("BLOCKMAP")
+};
 
-Array<LumpNum> findMapLumps() {
-	Array<LumpNum> result;
 
-	result.capacity = 50;
-	result.data = (LumpNum*)memoryAlloc(permanent, sizeof(LumpNum) * result.capacity);
-	result.length = 0;
+// A map is a marker lump followed by the map lumps in a fixed order. Rather
+// than test every lump in the directory, only look at the lumps preceding a
+// THINGS lump, which the hash hands back in directory order.
+static void scanWadForMaps(i32 wadIndex, Array<MapEntry>& maps) {
+	auto& wad = wadFiles[wadIndex];
+	const u64 thingsId = mapLumpIds[(int)MapLumps::Things];
 
-	for (i32 i = 0; i < numLoadedWads; ++i) {
-		auto wad = wadFiles[i];
-
-		for (i32 p = 0; p < wad.info.numLumps; ++p) {
-			if (wad.info.numLumps - p <= 11) break;
-
-			if (strncmp(wad.directory[p + (int)MapLumps::Things].name,     "THINGS\0\0",   8) != 0) continue;
-			if (strncmp(wad.directory[p + (int)MapLumps::Linedefs].name,   "LINEDEFS",     8) != 0) continue;
-			if (strncmp(wad.directory[p + (int)MapLumps::Sidedefs].name,   "SIDEDEFS",     8) != 0) continue;
-			if (strncmp(wad.directory[p + (int)MapLumps::Vertexes].name,   "VERTEXES",     8) != 0) continue;
-			if (strncmp(wad.directory[p + (int)MapLumps::Segs].name,       "SEGS\0\0\0\0", 8) != 0) continue;
-			if (strncmp(wad.directory[p + (int)MapLumps::SubSectors].name, "SSECTORS",     8) != 0) continue;
-			if (strncmp(wad.directory[p + (int)MapLumps::Nodes].name,      "NODES\0\0\0",  8) != 0) continue;
-			if (strncmp(wad.directory[p + (int)MapLumps::Sectors].name,    "SECTORS\0",    8) != 0) continue;
-			if (strncmp(wad.directory[p + (int)MapLumps::Reject].name,     "REJECT\0\0",   8) != 0) continue;
-			if (strncmp(wad.directory[p + (int)MapLumps::Blockmap].name,   "BLOCKMAP",     8) != 0) continue;
-
-			assert(result.length < result.capacity);
-
-			result.data[result.length] = packLumpNum(i, p);
-			result.length++;
+	u32 slot = hashLumpName(thingsId) & wad.lumpHashMask;
+
+	for (; wad.lumpHash[slot]; slot = (slot + 1) & wad.lumpHashMask) {
+		i32 p = (i32)wad.lumpHash[slot] - 1 - (i32)MapLumps::Things;
+
+		if (p < 0 || p + (i32)MapLumps::Blockmap >= (i32)wad.info.numLumps) continue;
+
+		MapEntry entry = {};
+		entry.lump = packLumpNum(wadIndex, p);
+
+		bool isMap = true;
+
+		for (i32 l = 0; l < (i32)MapLumps::Count; ++l) {
+			auto& info = wad.directory[p + l];
+
+			if (l != (i32)MapLumps::Label && lumpNameId(info.name) != mapLumpIds[l]) {
+				isMap = false;
+				break;
+			}
+
+			entry.lumpSizes[l] = info.size;
+		}
+
+		if (isMap) arrayPush(temporary, maps, entry);
+	}
+}
+
+
+// Sidecar index written next to each wad so an unchanged wad can skip the scan
+struct MapIndexHeader {
+	u8  magic[4];
+	u32 version;
+	u64 wadSize;
+	u64 wadTime;
+	u64 directoryHash;
+	u32 numMaps;
+	u32 pad;
+};
+
+struct MapIndexEntry {
+	u32 lumpIndex;
+	u32 lumpSizes[(int)MapLumps::Count];
+};
+
+static const u32 MAP_INDEX_VERSION = 1;
+
+
+static u64 hashBytes(const void* data, usize size, u64 hash = 0xCBF29CE484222325ull) {
+	auto bytes = (const u8*)data;
+
+	for (usize i = 0; i < size; ++i) {
+		hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+	}
+
+	return hash;
+}
+
+
+static u64 hashDirectory(const WadFile& wad) {
+	return hashBytes(wad.directory, sizeof(LumpInfo) * wad.info.numLumps);
+}
+
+
+static void getMapIndexName(const WadFile& wad, char* buffer, usize size) {
+	snprintf(buffer, size, "%s.dnvidx", wad.name);
+}
+
+
+static bool readMapIndex(i32 wadIndex, const MapIndexHeader& key, Array<MapEntry>& maps) {
+	char indexName[1024];
+	getMapIndexName(wadFiles[wadIndex], indexName, sizeof(indexName));
+
+	FILE* f;
+	if (fopen_s(&f, indexName, "rb") != 0) return false;
+
+	MapIndexHeader header;
+	bool valid = fread(&header, sizeof(header), 1, f) == 1
+		&& memcmp(header.magic, key.magic, 4) == 0
+		&& header.version == key.version
+		&& header.wadSize == key.wadSize
+		&& header.wadTime == key.wadTime
+		&& header.directoryHash == key.directoryHash;
+
+	for (u32 i = 0; valid && i < header.numMaps; ++i) {
+		MapIndexEntry indexEntry;
+
+		if (fread(&indexEntry, sizeof(indexEntry), 1, f) != 1) {
+			valid = false;
+			break;
 		}
+
+		MapEntry entry;
+		entry.lump = packLumpNum(wadIndex, indexEntry.lumpIndex);
+		memcpy(entry.lumpSizes, indexEntry.lumpSizes, sizeof(entry.lumpSizes));
+
+		arrayPush(temporary, maps, entry);
+	}
+
+	fclose(f);
+
+	return valid;
+}
+
+
+static void writeMapIndex(i32 wadIndex, MapIndexHeader header, Slice<MapEntry> maps) {
+	char indexName[1024];
+	getMapIndexName(wadFiles[wadIndex], indexName, sizeof(indexName));
+
+	FILE* f;
+	if (fopen_s(&f, indexName, "wb") != 0) return;
+
+	header.numMaps = (u32)maps.length;
+	fwrite(&header, sizeof(header), 1, f);
+
+	for (usize i = 0; i < maps.length; ++i) {
+		MapIndexEntry indexEntry;
+		indexEntry.lumpIndex = unpackLumpIndex(maps.data[i].lump);
+		memcpy(indexEntry.lumpSizes, maps.data[i].lumpSizes, sizeof(indexEntry.lumpSizes));
+
+		fwrite(&indexEntry, sizeof(indexEntry), 1, f);
+	}
+
+	fclose(f);
+}
+
+
+Array<MapEntry> findMapLumps() {
+	MemoryTag memoryTag("map catalog");
+
+	Array<MapEntry> maps = {};
+
+	for (i32 i = 0; i < numLoadedWads; ++i) {
+		auto& wad = wadFiles[i];
+
+		MapIndexHeader key = {};
+		memcpy(key.magic, "DNVI", 4);
+		key.version = MAP_INDEX_VERSION;
+		key.wadSize = wad.size;
+		key.wadTime = getFileModifiedTime(wad.name);
+		key.directoryHash = hashDirectory(wad);
+
+		wad.contentKey = hashBytes(&key, sizeof(key));
+
+		usize first = maps.length;
+
+		if (readMapIndex(i, key, maps)) continue;
+
+		maps.length = first;
+		scanWadForMaps(i, maps);
+
+		writeMapIndex(i, key, { maps.length - first, maps.data + first });
+	}
+
+	// Move the catalog out of temporary storage now its size is known
+	Array<MapEntry> result;
+	result.capacity = result.length = maps.length;
+	result.data = arenaPush<MapEntry>(permanent, maps.length ? maps.length : 1);
+
+	for (usize i = 0; i < maps.length; ++i) {
+		result.data[i] = maps.data[i];
 	}
 
 	return result;
-}
\ No newline at end of file
+}
+
+
+u64 getWadContentKey(LumpNum lumpNum) {
+	return wadFiles[unpackWadIndex(lumpNum)].contentKey;
+}
+
+
+const char* getWadName(LumpNum lumpNum) {
+	return wadFiles[unpackWadIndex(lumpNum)].name;
+}
@@ -18,11 +18,27 @@ enum class MapLumps {
 	Nodes,
 	Sectors,
 	Reject,
-	Blockmap
+	Blockmap,
+	Count
+};
+
+enum class WadLoadMode {
+	// Read the whole file into the permanent arena
+	Copy,
+	// Map the file read-only and point straight into the mapping, lumps are
+	// paged in by the OS the first time they are touched
+	Mapped
 };
 
 void initWads();
-WadResult loadWadFile(const char* name);
+WadResult loadWadFile(const char* name, WadLoadMode mode = WadLoadMode::Mapped);
+// Loads the files in parallel on the job system. Lump numbers are assigned in
+// list order, so later files still override earlier ones.
+WadResult loadWadFiles(const char** names, usize count, WadLoadMode mode = WadLoadMode::Mapped);
+
+// Forgets every loaded wad, unmapping the mapped ones. What they took from
+// the permanent arena is left for the caller to restore.
+void unloadWads();
 
 struct LumpResult {
 	WadResult result;
@@ -30,11 +46,29 @@ struct LumpResult {
 	Slice<u8> lump;
 };
 
+// Later wads override earlier ones, so the last loaded wad containing the
+// lump wins
 LumpNum findLumpByName(const char* name);
+// Same as findLumpByName but only matches lumps between the given markers
+// within a wad, for namespaces such as F_START/F_END
+LumpNum findLumpInNamespace(const char* name, const char* startMarker, const char* endMarker);
 
 LumpResult getLumpByName(const char* name);
 LumpResult getLumpByNum(LumpNum num, usize offset = 0);
 
-Array<LumpNum> findMapLumps();
+struct MapEntry {
+	LumpNum lump;
+	u32     lumpSizes[(int)MapLumps::Count];
+};
+
+// Builds the catalog of maps across all loaded wads, in load order. The result
+// of scanning each wad is cached in a sidecar .dnvidx file keyed on the wad's
+// size, modification time and directory contents.
+Array<MapEntry> findMapLumps();
+
+// Identifies the exact contents of the wad holding the lump, for keying cache
+// files. Only valid once findMapLumps has been called.
+u64 getWadContentKey(LumpNum lumpNum);
+const char* getWadName(LumpNum lumpNum);
 
 